@@ -0,0 +1,520 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "agenda.h"
+#include "connection.h"
+#include "context.h"
+#include "compressor.h"
+#include "sync.h"
+#include "errors.h"
+#include "pattern_match.hpp"
+#include "path_filter.h"
+#include "tracing.h"
+#include <iostream>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <boost/bind.hpp>
+#include <boost/program_options.hpp>
+
+using namespace es3;
+namespace po = boost::program_options;
+
+static double now_secs()
+{
+	struct timeval tv={0};
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+//Results are printed as JSON lines, one per measurement
+static void report(const std::string &bench, const std::string &param,
+				   uint64_t ops, double seconds, const std::string &unit,
+				   const std::string &extra="")
+{
+	char buf[512];
+	snprintf(buf, sizeof(buf), "{\"bench\": \"%s\", \"param\": \"%s\", "
+			 "\"ops\": %llu, \"seconds\": %.6f, \"rate\": %.2f, "
+			 "\"unit\": \"%s\"%s}", bench.c_str(), param.c_str(),
+			 (unsigned long long)ops, seconds,
+			 seconds>0 ? ops/seconds : 0.0, unit.c_str(), extra.c_str());
+	std::cout << buf << std::endl;
+}
+
+class noop_task : public sync_task
+{
+	volatile size_t *counter_;
+public:
+	noop_task(volatile size_t *counter) : counter_(counter) {}
+
+	virtual void operator()(agenda_ptr agenda)
+	{
+		__sync_fetch_and_add(counter_, 1);
+	}
+	virtual void print_to(std::ostream &str)
+	{
+		str << "No-op";
+	}
+};
+
+static void bench_agenda(size_t threads, size_t tasks)
+{
+	agenda_ptr ag(new agenda(threads, 1, 1, true, true,
+							 MIN_SEGMENT_SIZE, 40));
+	volatile size_t counter=0;
+
+	double start=now_secs();
+	for(size_t f=0;f<tasks;++f)
+		ag->schedule(sync_task_ptr(new noop_task(&counter)));
+	double scheduled=now_secs();
+	ag->run();
+	double done=now_secs();
+	if (counter!=tasks)
+		err(errFatal) << "Agenda lost tasks: " << counter << " of " << tasks;
+
+	std::string param="threads="+int_to_string(threads);
+	report("agenda_schedule", param, tasks, scheduled-start, "tasks/s");
+	report("agenda_run", param, tasks, done-scheduled, "tasks/s");
+}
+
+//Commands run the agenda several times (listing, then transfers,
+//then retries), each run is a phase with a few tasks
+static void bench_phases(size_t threads, size_t phases)
+{
+	agenda_ptr ag(new agenda(threads, 1, 1, true, true,
+							 MIN_SEGMENT_SIZE, 40));
+	volatile size_t counter=0;
+
+	double start=now_secs();
+	for(size_t f=0;f<phases;++f)
+	{
+		ag->schedule(sync_task_ptr(new noop_task(&counter)));
+		ag->run();
+	}
+	double done=now_secs();
+	if (counter!=phases)
+		err(errFatal) << "Agenda lost tasks: " << counter << " of " << phases;
+
+	std::string param="threads="+int_to_string(threads);
+	report("agenda_phase", param, phases, done-start, "phases/s");
+}
+
+//Fans out from a worker, like the listing of a wide directory
+class noop_producer : public producer_task
+{
+	volatile size_t *counter_;
+	size_t left_;
+public:
+	noop_producer(volatile size_t *counter, size_t num) :
+		counter_(counter), left_(num) {}
+
+	virtual task_type_e produced_class() const { return taskUnbound; }
+	virtual bool produce_next(agenda_ptr agenda)
+	{
+		if (!left_)
+			return false;
+		left_--;
+		agenda->schedule(sync_task_ptr(new noop_task(counter_)));
+		return true;
+	}
+	virtual void print_to(std::ostream &str)
+	{
+		str << "No-op producer";
+	}
+};
+
+//Producers in the main thread and on the workers share a bounded queue,
+//its depth must stay near the limit
+static void bench_bounded(size_t threads, size_t tasks, size_t limit)
+{
+	agenda_ptr ag(new agenda(threads, 1, 1, true, true,
+							 MIN_SEGMENT_SIZE, 40));
+	ag->set_queue_limit(limit);
+	volatile size_t counter=0;
+	size_t producers=4, max_queued=0;
+
+	double start=now_secs();
+	ag->begin_run();
+	for(size_t f=0;f<producers;++f)
+		ag->schedule(sync_task_ptr(new noop_producer(&counter, tasks)));
+	for(size_t f=0;f<tasks;++f)
+	{
+		ag->schedule(sync_task_ptr(new noop_task(&counter)));
+		if (f%64==0)
+			max_queued=std::max(max_queued,
+								ag->get_metrics().queued_[taskUnbound]);
+	}
+	ag->run();
+	double done=now_secs();
+	size_t total=tasks*(producers+1);
+	if (counter!=total)
+		err(errFatal) << "Agenda lost tasks: " << counter << " of " << total;
+	if (max_queued>limit+producers+1)
+		err(errFatal) << "Queue grew to " << max_queued
+					  << " with the limit " << limit;
+
+	std::string param="threads="+int_to_string(threads)+
+			" limit="+int_to_string(limit);
+	report("agenda_bounded", param, total, done-start, "tasks/s",
+		   ", \"max_queued\": "+int_to_string(max_queued));
+}
+
+class stat_task : public sync_task
+{
+	size_t adds_;
+public:
+	stat_task(size_t adds) : adds_(adds) {}
+
+	virtual void operator()(agenda_ptr agenda)
+	{
+		for(size_t f=0;f<adds_;++f)
+			agenda->add_stat_counter(statUploaded, 1);
+	}
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Stat counter";
+	}
+};
+
+static void bench_stat_counters(size_t threads, size_t adds)
+{
+	agenda_ptr ag(new agenda(threads, 1, 1, true, true,
+							 MIN_SEGMENT_SIZE, 40));
+	for(size_t f=0;f<threads;++f)
+		ag->schedule(sync_task_ptr(new stat_task(adds)));
+
+	double start=now_secs();
+	ag->run();
+	double done=now_secs();
+	if (ag->get_stat_counter(statUploaded)!=threads*adds)
+		err(errFatal) << "Lost statistics updates";
+
+	std::string param="threads="+int_to_string(threads);
+	report("stat_counter", param, threads*adds, done-start, "adds/s");
+}
+
+//Values past the largest bucket (requests stuck for ages, clock jumps)
+//must land in the last bucket and not around it
+static void bench_histogram(size_t records)
+{
+	latency_histogram hist;
+	uint64_t huge[]={uint64_t(1)<<HISTOGRAM_MAX_POWER,
+					 (uint64_t(1)<<HISTOGRAM_MAX_POWER)+12345,
+					 uint64_t(-1)/2};
+	double start=now_secs();
+	for(size_t f=0;f<records;++f)
+		hist.record((f*7919)%100000);
+	double done=now_secs();
+	for(size_t f=0;f<sizeof(huge)/sizeof(huge[0]);++f)
+		hist.record(huge[f]);
+
+	if (hist.count()!=records+3 || hist.max()!=uint64_t(-1)/2 ||
+			hist.percentile(100)!=hist.max())
+		err(errFatal) << "Histogram is corrupted by large values";
+	if (hist.percentile(50)<45000 || hist.percentile(50)>55000)
+		err(errFatal) << "Wrong median: " << hist.percentile(50);
+
+	report("histogram_record", "", records, done-start, "records/s");
+}
+
+class failing_task : public sync_task
+{
+	bool throw_;
+public:
+	failing_task(bool do_throw) : throw_(do_throw) {}
+
+	virtual result_code_t execute(agenda_ptr agenda,
+								  const std::vector<segment_ptr> &segments)
+	{
+		if (throw_)
+			err(errWarn, 0) << "SlowDown - Please reduce your request rate.";
+		return result_code_t(errWarn,
+							 "SlowDown - Please reduce your request rate.",
+							 0, kindThrottled);
+	}
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Failing task";
+	}
+};
+
+//Cost of a throttled request on the task side: an exception versus a
+//returned result
+static void bench_failures(bool do_throw, size_t tasks)
+{
+	agenda_ptr ag(new agenda(1, 1, 1, true, true, MIN_SEGMENT_SIZE, 40));
+	retry_policy no_retries;
+	for(int f=0;f<retryClassesNum;++f)
+		no_retries.max_attempts_[f]=1;
+	ag->set_retry_policy(no_retries);
+	for(size_t f=0;f<tasks;++f)
+		ag->schedule(sync_task_ptr(new failing_task(do_throw)));
+
+	//Don't report every failure
+	logger::set_verbosity(-1);
+	double start=now_secs();
+	size_t failed=ag->run();
+	double done=now_secs();
+	logger::set_verbosity(0);
+	if (failed!=tasks)
+		err(errFatal) << "Lost failed tasks";
+
+	report("task_failure", do_throw ? "throw" : "result", tasks,
+		   done-start, "failures/s");
+}
+
+static std::string make_listing_page(size_t keys)
+{
+	std::string res="<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<ListBucketResult><Name>bench</Name><Prefix>data/</Prefix>"
+			"<Marker></Marker><MaxKeys>1000</MaxKeys><Delimiter>/"
+			"</Delimiter><IsTruncated>true</IsTruncated>";
+	char buf[512];
+	for(size_t f=0;f<keys;++f)
+	{
+		snprintf(buf, sizeof(buf), "<Contents><Key>data/some/longer/path/"
+				 "file-%06zu.bam</Key><LastModified>2013-01-01T00:00:00.000Z"
+				 "</LastModified><ETag>&quot;d41d8cd98f00b204e9800998ecf8427e"
+				 "&quot;</ETag><Size>%zu</Size><StorageClass>STANDARD"
+				 "</StorageClass></Contents>", f, f*1000);
+		res.append(buf);
+	}
+	return res+"</ListBucketResult>";
+}
+
+static void bench_listing(size_t pages)
+{
+	std::string page=make_listing_page(1000);
+	s3_path root;
+	root.bucket_="bench";
+	root.path_="/data/";
+
+	double start=now_secs();
+	for(size_t f=0;f<pages;++f)
+	{
+		s3_directory_ptr dir(new s3_directory());
+		dir->absolute_name_=root;
+		std::string marker;
+		parse_listing_page(page, dir, &marker);
+		if (dir->files_.size()!=1000)
+			err(errFatal) << "Listing parser lost keys";
+	}
+	report("listing_parse", "keys=1000", pages*1000, now_secs()-start,
+		   "keys/s");
+}
+
+static void on_compressed(files_ptr files, uint64_t *size)
+{
+	for(size_t f=0;f<files->sizes_.size();++f)
+		*size+=files->sizes_.at(f);
+}
+
+static void bench_compressor(const bf::path &scratch, uint64_t size,
+							 int level)
+{
+	//Text-like data, so the level matters
+	bf::path src=scratch / bf::unique_path("bench-%%%%-%%%%");
+	{
+		handle_t fl(open(src.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600)
+					| libc_die2("Can't create "+src.string()));
+		std::string line;
+		for(uint64_t written=0, num=0;written<size;written+=line.size(), ++num)
+		{
+			line="chr"+int_to_string(num%23)+"\t"+
+					int_to_string(num*7919%1000003)+"\tACGT"+
+					int_to_string(num*31%97)+"\tPASS\n";
+			write(fl.get(), line.c_str(), line.size()) | libc_die;
+		}
+	}
+
+	context_ptr ctx(new conn_context());
+	ctx->scratch_dir_=scratch;
+	ctx->compression_level_=level;
+	size_t cpus=sysconf(_SC_NPROCESSORS_ONLN);
+	agenda_ptr ag(new agenda(1, cpus, 1, true, true, MIN_SEGMENT_SIZE, 40));
+
+	uint64_t compressed=0;
+	uint64_t raw=bf::file_size(src);
+	ag->schedule(sync_task_ptr(new file_compressor(src, ctx,
+		boost::bind(&on_compressed, _1, &compressed))));
+	double start=now_secs();
+	ag->run();
+	double elapsed=now_secs()-start;
+	bf::remove(src);
+
+	char extra[128];
+	snprintf(extra, sizeof(extra), ", \"threads\": %zu, \"ratio\": %.3f",
+			 cpus, raw ? double(compressed)/raw : 0.0);
+	report("compress", "level="+int_to_string(level), raw, elapsed, "B/s",
+		   extra);
+}
+
+static void bench_pattern(size_t iterations)
+{
+	std::string path;
+	for(int f=0;f<20;++f)
+		path+="/directory-level-"+int_to_string(f);
+	path+="/sample_0001.sorted.dedup.bam";
+
+	const char* patterns[]={"*.bam", "*/directory-level-1*/*level-19/*.bam",
+							"*[0-9].sorted.*", "/directory-*/nomatch/*"};
+	for(size_t p=0;p<sizeof(patterns)/sizeof(patterns[0]);++p)
+	{
+		pattern_match ptn(patterns[p]);
+		size_t matched=0;
+		double start=now_secs();
+		for(size_t f=0;f<iterations;++f)
+			matched+=ptn(path);
+		report("pattern_match", patterns[p], iterations, now_secs()-start,
+			   "matches/s", matched ? ", \"matched\": true" :
+									  ", \"matched\": false");
+
+		glob_set compiled(stringvec(1, patterns[p]));
+		size_t compiled_matched=0;
+		start=now_secs();
+		for(size_t f=0;f<iterations;++f)
+			compiled_matched+=compiled.matches(path);
+		report("glob_set", patterns[p], iterations, now_secs()-start,
+			   "matches/s");
+		if (compiled_matched!=matched)
+			err(errFatal) << "glob_set disagrees with pattern_match on "
+						  << patterns[p];
+	}
+
+	//All of them at once, as --exclude-path options
+	stringvec all(patterns, patterns+sizeof(patterns)/sizeof(patterns[0]));
+	all.push_back("/directory-level-0/directory-level-1/*");
+	path_filter filter(stringvec(), all);
+	size_t pruned=0;
+	double start=now_secs();
+	for(size_t f=0;f<iterations;++f)
+		pruned+=!filter.may_match_under(path.substr(0, path.rfind('/')+1));
+	report("path_filter", "may_match_under", iterations, now_secs()-start,
+		   "checks/s", pruned ? ", \"pruned\": true" :
+								", \"pruned\": false");
+}
+
+static s3_directory_ptr make_tree(const std::string &tag, size_t dirs,
+								  size_t files)
+{
+	s3_directory_ptr root(new s3_directory());
+	root->name_="root";
+	for(size_t d=0;d<dirs;++d)
+	{
+		//Directories are shared between the trees, files are not
+		s3_directory_ptr dir(new s3_directory());
+		dir->name_="dir"+int_to_string(d);
+		dir->parent_=root;
+		root->subdirs_[dir->name_]=dir;
+		for(size_t f=0;f<files;++f)
+		{
+			s3_file_ptr fl(new s3_file());
+			fl->name_=tag+"-file"+int_to_string(f);
+			fl->parent_=dir;
+			dir->files_[fl->name_]=fl;
+		}
+	}
+	return root;
+}
+
+static void bench_merge(size_t dirs, size_t files, size_t iterations)
+{
+	double elapsed=0;
+	for(size_t f=0;f<iterations;++f)
+	{
+		s3_directory_ptr left=make_tree("left", dirs, files);
+		s3_directory_ptr right=make_tree("right", dirs, files);
+		double start=now_secs();
+		merge_to_left<s3_directory_ptr, s3_file_ptr>(left, right);
+		elapsed+=now_secs()-start;
+	}
+	report("merge_to_left", "dirs="+int_to_string(dirs)+",files="+
+		   int_to_string(files), iterations*dirs*files, elapsed, "files/s");
+}
+
+int main(int argc, char **argv)
+{
+	po::options_description desc("es3 microbenchmarks", 80);
+	desc.add_options()
+		("help", "Display this message")
+		("quick", "Run with small sizes (used by ctest)")
+		("scratch-dir", po::value<bf::path>()->default_value(
+			 bf::temp_directory_path()), "Directory for temporary files")
+	;
+	po::variables_map vm;
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(const boost::program_options::error &err)
+	{
+		std::cerr << "Failed to parse command line. Error: "
+				  << err.what() << std::endl;
+		return 2;
+	}
+	if (vm.count("help"))
+	{
+		std::cout << desc;
+		return 1;
+	}
+	bool quick=vm.count("quick");
+	bf::path scratch=vm["scratch-dir"].as<bf::path>();
+	logger::set_verbosity(0);
+
+	try
+	{
+		size_t threads[]={1, 4, 16, 64};
+		for(size_t f=0;f<(quick?2:4);++f)
+			bench_agenda(threads[f], quick ? 10000 : 200000);
+		for(size_t f=0;f<(quick?2:4);++f)
+			bench_phases(threads[f], quick ? 200 : 2000);
+		for(size_t f=0;f<(quick?2:4);++f)
+			bench_bounded(threads[f], quick ? 10000 : 200000, 1000);
+		for(size_t f=0;f<(quick?2:4);++f)
+			bench_stat_counters(threads[f], quick ? 100000 : 1000000);
+		bench_histogram(quick ? 100000 : 10000000);
+		bench_failures(true, quick ? 10000 : 200000);
+		bench_failures(false, quick ? 10000 : 200000);
+
+		bench_listing(quick ? 10 : 200);
+
+		int levels[]={1, 6, 9};
+		for(size_t f=0;f<(quick?1:3);++f)
+			bench_compressor(scratch, quick ? 4*1024*1024 : 128*1024*1024,
+							 levels[f]);
+
+		bench_pattern(quick ? 1000 : 100000);
+		bench_merge(100, quick ? 10 : 1000, quick ? 1 : 5);
+	} catch(const std::exception &ex)
+	{
+		std::cerr << "ERR: " << ex.what() << std::endl;
+		return 8;
+	}
+	return 0;
+}
@@ -0,0 +1,996 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "mock_s3.h"
+#include "connection.h"
+#include "checksum.h"
+#include "errors.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <boost/bind.hpp>
+#include <boost/algorithm/string.hpp>
+
+#define MAX_HEADER_SIZE (1024*1024)
+#define SEND_CHUNK (64*1024)
+
+using namespace es3;
+
+struct es3::mock_request
+{
+	std::string method_, bucket_, key_;
+	std::map<std::string, std::string> query_;
+	header_map_t headers_;
+	std::string body_;
+	bool keep_alive_;
+
+	bool has(const std::string &arg) const { return query_.count(arg)!=0; }
+	std::string arg(const std::string &arg) const
+	{
+		return try_get(query_, arg);
+	}
+};
+
+struct es3::mock_response
+{
+	int code_;
+	header_map_t headers_;
+	std::string body_;
+	//Object payload, sent instead of body_ if set
+	boost::shared_ptr<const std::string> data_;
+	size_t offset_, length_;
+
+	mock_response() : code_(200), offset_(), length_() {}
+};
+
+struct es3::mock_object
+{
+	boost::shared_ptr<const std::string> data_;
+	std::string etag_;
+	time_t mtime_;
+	header_map_t meta_;
+};
+
+struct mock_part
+{
+	boost::shared_ptr<const std::string> data_;
+	part_digest digest_;
+};
+
+struct es3::mock_upload
+{
+	std::string bucket_, key_;
+	header_map_t meta_;
+	std::map<int, mock_part> parts_;
+};
+
+static double now_secs()
+{
+	struct timeval tv={0};
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static std::string url_decode(const std::string &str)
+{
+	std::string res;
+	res.reserve(str.size());
+	for(size_t f=0;f<str.size();++f)
+	{
+		if (str[f]=='%' && f+2<str.size())
+		{
+			res.push_back(char(strtol(str.substr(f+1, 2).c_str(), NULL, 16)));
+			f+=2;
+		} else
+			res.push_back(str[f]);
+	}
+	return res;
+}
+
+static std::string xml_escape(const std::string &str)
+{
+	std::string res;
+	for(size_t f=0;f<str.size();++f)
+	{
+		switch(str[f])
+		{
+		case '&': res.append("&amp;"); break;
+		case '<': res.append("&lt;"); break;
+		case '>': res.append("&gt;"); break;
+		case '"': res.append("&quot;"); break;
+		default: res.push_back(str[f]);
+		}
+	}
+	return res;
+}
+
+static std::string iso_time(time_t tm)
+{
+	char buf[64];
+	struct tm parts={0};
+	gmtime_r(&tm, &parts);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S.000Z", &parts);
+	return buf;
+}
+
+static std::string http_time(time_t tm)
+{
+	char buf[64];
+	struct tm parts={0};
+	gmtime_r(&tm, &parts);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+	return buf;
+}
+
+static const char* status_text(int code)
+{
+	switch(code)
+	{
+	case 100: return "Continue";
+	case 200: return "OK";
+	case 204: return "No Content";
+	case 206: return "Partial Content";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 416: return "Requested Range Not Satisfiable";
+	case 501: return "Not Implemented";
+	case 503: return "Slow Down";
+	default: return "Unknown";
+	}
+}
+
+static void error_reply(mock_response &resp, int code,
+						const std::string &s3_code, const std::string &msg)
+{
+	resp.code_=code;
+	resp.headers_["Content-Type"]="application/xml";
+	resp.body_="<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Error><Code>"+
+			s3_code+"</Code><Message>"+xml_escape(msg)+"</Message></Error>";
+}
+
+static void xml_reply(mock_response &resp, const std::string &body)
+{
+	resp.headers_["Content-Type"]="application/xml";
+	resp.body_="<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"+body;
+}
+
+static header_map_t object_meta(const header_map_t &headers)
+{
+	header_map_t res;
+	for(auto iter=headers.begin();iter!=headers.end();++iter)
+	{
+		if (strncasecmp(iter->first.c_str(), "x-amz-meta-", 11)==0
+				|| strcasecmp(iter->first.c_str(), "Content-Type")==0
+				|| strcasecmp(iter->first.c_str(), "Content-Encoding")==0)
+			res[iter->first]=iter->second;
+	}
+	return res;
+}
+
+//Parses "bytes=a-b" or "bytes=a-" against the object size
+static bool parse_range(const std::string &range, size_t size,
+						size_t *offset, size_t *length)
+{
+	unsigned long long start=0, end=0;
+	if (sscanf(range.c_str(), "bytes=%llu-%llu", &start, &end)==2)
+	{
+		if (end>=size)
+			end=size-1;
+	} else if (sscanf(range.c_str(), "bytes=%llu-", &start)==1)
+		end=size-1;
+	else
+		return false;
+	if (start>end || start>=size)
+		return false;
+	*offset=start;
+	*length=end-start+1;
+	return true;
+}
+
+mock_s3_server::mock_s3_server(const mock_s3_config &config)
+	: config_(config), listen_fd_(-1), port_(), stopping_(),
+	  next_upload_id_(), bytes_in_(), bytes_out_(), throttle_free_at_()
+{
+}
+
+mock_s3_server::~mock_s3_server()
+{
+	stop();
+}
+
+void mock_s3_server::start(int port)
+{
+	listen_fd_=socket(AF_INET, SOCK_STREAM, 0) | libc_die;
+	int one=1;
+	setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr={0};
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr))
+			| libc_die2("Can't bind the mock S3 server");
+	listen(listen_fd_, 128) | libc_die;
+
+	socklen_t len=sizeof(addr);
+	getsockname(listen_fd_, (struct sockaddr*)&addr, &len) | libc_die;
+	port_=ntohs(addr.sin_port);
+
+	stopping_=false;
+	accept_thread_=boost::thread(
+				boost::bind(&mock_s3_server::accept_loop, this));
+}
+
+void mock_s3_server::stop()
+{
+	if (listen_fd_<0)
+		return;
+	stopping_=true;
+	shutdown(listen_fd_, SHUT_RDWR);
+	accept_thread_.join();
+	close(listen_fd_);
+	listen_fd_=-1;
+
+	{
+		guard_t lock(m_);
+		for(auto iter=clients_.begin();iter!=clients_.end();++iter)
+			shutdown(*iter, SHUT_RDWR);
+	}
+	workers_.join_all();
+}
+
+std::string mock_s3_server::endpoint() const
+{
+	return "http://127.0.0.1:"+int_to_string(port_);
+}
+
+std::map<std::string, uint64_t> mock_s3_server::request_counts() const
+{
+	guard_t lock(m_);
+	return counters_;
+}
+
+uint64_t mock_s3_server::bytes_in() const
+{
+	guard_t lock(m_);
+	return bytes_in_;
+}
+
+uint64_t mock_s3_server::bytes_out() const
+{
+	guard_t lock(m_);
+	return bytes_out_;
+}
+
+void mock_s3_server::reset_counters()
+{
+	guard_t lock(m_);
+	counters_.clear();
+	bytes_in_=bytes_out_=0;
+}
+
+void mock_s3_server::count(const std::string &op)
+{
+	guard_t lock(m_);
+	counters_[op]++;
+}
+
+void mock_s3_server::throttle(size_t bytes)
+{
+	if (!config_.bandwidth_)
+		return;
+
+	double wait_until;
+	{
+		guard_t lock(throttle_m_);
+		double now=now_secs();
+		if (throttle_free_at_<now)
+			throttle_free_at_=now;
+		throttle_free_at_+=double(bytes)/config_.bandwidth_;
+		wait_until=throttle_free_at_;
+	}
+	double delay=wait_until-now_secs();
+	if (delay>0)
+		usleep(useconds_t(delay*1000000));
+}
+
+void mock_s3_server::accept_loop()
+{
+	while(!stopping_)
+	{
+		int fd=accept(listen_fd_, NULL, NULL);
+		if (fd<0)
+		{
+			if (errno==EINTR && !stopping_)
+				continue;
+			break;
+		}
+		int one=1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		guard_t lock(m_);
+		clients_.insert(fd);
+		workers_.create_thread(boost::bind(&mock_s3_server::serve, this, fd));
+	}
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+	while(len>0)
+	{
+		ssize_t res=send(fd, data, len, MSG_NOSIGNAL);
+		if (res<0 && errno==EINTR)
+			continue;
+		if (res<=0)
+			return false;
+		data+=res;
+		len-=res;
+	}
+	return true;
+}
+
+void mock_s3_server::serve(int fd)
+{
+	std::string buf;
+	try
+	{
+		while(!stopping_)
+		{
+			mock_request req;
+			if (!read_request(fd, buf, req))
+				break;
+			mock_response resp;
+			handle(req, resp);
+			send_response(fd, req, resp);
+			if (!req.keep_alive_)
+				break;
+		}
+	} catch(const std::exception &ex)
+	{
+		VLOG(2) << "Mock S3 connection dropped: " << ex.what();
+	}
+
+	{
+		guard_t lock(m_);
+		clients_.erase(fd);
+	}
+	close(fd);
+}
+
+//Reads at least one more byte into the buffer
+static bool recv_more(int fd, std::string &buf)
+{
+	char tmp[SEND_CHUNK];
+	while(true)
+	{
+		ssize_t res=recv(fd, tmp, sizeof(tmp), 0);
+		if (res<0 && errno==EINTR)
+			continue;
+		if (res<=0)
+			return false;
+		buf.append(tmp, res);
+		return true;
+	}
+}
+
+bool mock_s3_server::read_request(int fd, std::string &buf,
+								  mock_request &req)
+{
+	size_t hdr_end;
+	while((hdr_end=buf.find("\r\n\r\n"))==std::string::npos)
+	{
+		if (buf.size()>MAX_HEADER_SIZE || !recv_more(fd, buf))
+			return false;
+	}
+
+	std::string head=buf.substr(0, hdr_end);
+	buf.erase(0, hdr_end+4);
+
+	size_t line_end=head.find("\r\n");
+	std::string request_line=head.substr(0, line_end);
+	size_t sp1=request_line.find(' ');
+	size_t sp2=request_line.rfind(' ');
+	if (sp1==std::string::npos || sp2<=sp1)
+		return false;
+	req.method_=request_line.substr(0, sp1);
+	std::string target=request_line.substr(sp1+1, sp2-sp1-1);
+	req.keep_alive_=request_line.substr(sp2+1)=="HTTP/1.1";
+
+	while(line_end!=std::string::npos)
+	{
+		size_t start=line_end+2;
+		line_end=head.find("\r\n", start);
+		std::string line=head.substr(start, line_end==std::string::npos ?
+										 std::string::npos : line_end-start);
+		size_t colon=line.find(':');
+		if (colon!=std::string::npos)
+			req.headers_[trim(line.substr(0, colon))]=
+					trim(line.substr(colon+1));
+	}
+	std::string conn_hdr=try_get(req.headers_, "Connection");
+	if (strcasecmp(conn_hdr.c_str(), "close")==0)
+		req.keep_alive_=false;
+	else if (strcasecmp(conn_hdr.c_str(), "keep-alive")==0)
+		req.keep_alive_=true;
+
+	//Split the target into bucket, key and query arguments
+	std::string path=target, query;
+	size_t qpos=target.find('?');
+	if (qpos!=std::string::npos)
+	{
+		path=target.substr(0, qpos);
+		query=target.substr(qpos+1);
+	}
+	if (path.empty() || path[0]!='/')
+		return false;
+	size_t slash=path.find('/', 1);
+	req.bucket_=url_decode(path.substr(1, slash==std::string::npos ?
+										   std::string::npos : slash-1));
+	if (slash!=std::string::npos)
+		req.key_=url_decode(path.substr(slash+1));
+
+	stringvec args;
+	boost::split(args, query, boost::is_any_of("&"));
+	for(auto iter=args.begin();iter!=args.end();++iter)
+	{
+		if (iter->empty())
+			continue;
+		size_t eq=iter->find('=');
+		if (eq==std::string::npos)
+			req.query_[url_decode(*iter)]="";
+		else
+			req.query_[url_decode(iter->substr(0, eq))]=
+					url_decode(iter->substr(eq+1));
+	}
+
+	if (strcasecmp(try_get(req.headers_, "Expect").c_str(),
+				   "100-continue")==0)
+	{
+		std::string cont="HTTP/1.1 100 Continue\r\n\r\n";
+		if (!send_all(fd, cont.c_str(), cont.size()))
+			return false;
+	}
+
+	size_t received=0;
+	if (req.headers_.count("Content-Length"))
+	{
+		size_t len=atoll(req.headers_["Content-Length"].c_str());
+		while(buf.size()<len)
+		{
+			size_t before=buf.size();
+			if (!recv_more(fd, buf))
+				return false;
+			throttle(buf.size()-before);
+		}
+		req.body_=buf.substr(0, len);
+		buf.erase(0, len);
+		received=len;
+	} else if (strcasecmp(try_get(req.headers_, "Transfer-Encoding").c_str(),
+						  "chunked")==0)
+	{
+		while(true)
+		{
+			size_t eol;
+			while((eol=buf.find("\r\n"))==std::string::npos)
+				if (!recv_more(fd, buf))
+					return false;
+			size_t chunk=strtoul(buf.substr(0, eol).c_str(), NULL, 16);
+			while(buf.size()<eol+2+chunk+2)
+				if (!recv_more(fd, buf))
+					return false;
+			req.body_.append(buf, eol+2, chunk);
+			buf.erase(0, eol+2+chunk+2);
+			throttle(chunk);
+			received+=chunk;
+			if (chunk==0)
+				break;
+		}
+	}
+
+	guard_t lock(m_);
+	bytes_in_+=received;
+	return true;
+}
+
+void mock_s3_server::send_response(int fd, const mock_request &req,
+								   const mock_response &resp)
+{
+	size_t len=resp.data_ ? resp.length_ : resp.body_.size();
+
+	std::string head="HTTP/1.1 "+int_to_string(resp.code_)+" "+
+			status_text(resp.code_)+"\r\n";
+	for(auto iter=resp.headers_.begin();iter!=resp.headers_.end();++iter)
+		head.append(iter->first).append(": ")
+				.append(iter->second).append("\r\n");
+	head.append("Content-Length: ").append(int_to_string(len)).append("\r\n");
+	head.append("Date: ").append(http_time(time(NULL))).append("\r\n");
+	head.append(req.keep_alive_ ? "Connection: keep-alive\r\n" :
+								  "Connection: close\r\n");
+	head.append("\r\n");
+	if (!send_all(fd, head.c_str(), head.size()))
+		throw std::runtime_error("failed to send the response");
+	if (req.method_=="HEAD")
+		return;
+
+	const char *data=resp.data_ ? resp.data_->c_str()+resp.offset_ :
+								  resp.body_.c_str();
+	for(size_t sent=0;sent<len;)
+	{
+		size_t cur=std::min(len-sent, size_t(SEND_CHUNK));
+		throttle(cur);
+		if (!send_all(fd, data+sent, cur))
+			throw std::runtime_error("failed to send the response");
+		sent+=cur;
+	}
+
+	guard_t lock(m_);
+	bytes_out_+=len;
+}
+
+void mock_s3_server::handle(const mock_request &req, mock_response &resp)
+{
+	if (config_.latency_ms_)
+		usleep(config_.latency_ms_*1000);
+
+	static __thread unsigned seed=0;
+	if (!seed)
+		seed=unsigned(pthread_self())^unsigned(time(NULL));
+	if (config_.error_rate_>0 &&
+			rand_r(&seed)<config_.error_rate_*RAND_MAX)
+	{
+		count("503");
+		error_reply(resp, 503, "SlowDown", "Please reduce your request rate.");
+		return;
+	}
+
+	if (req.bucket_.empty())
+	{
+		error_reply(resp, 501, "NotImplemented", "Bucket listing");
+		return;
+	}
+
+	const std::string &m=req.method_;
+	if (m=="GET" && req.key_.empty())
+	{
+		if (req.has("location"))
+		{
+			count("LOCATION");
+			xml_reply(resp, "<LocationConstraint xmlns=\"http://s3.amazonaws"
+					  ".com/doc/2006-03-01/\"/>");
+		} else if (req.has("uploads"))
+			list_uploads(req, resp);
+		else
+			list_bucket(req, resp);
+	} else if (m=="GET" && req.has("uploadId"))
+		list_parts(req, resp);
+	else if (m=="GET" || m=="HEAD")
+		get_object(req, resp);
+	else if (m=="PUT" && req.has("acl"))
+		count("PUT_ACL");
+	else if (m=="PUT" && req.has("uploadId"))
+		put_part(req, resp);
+	else if (m=="PUT")
+		put_object(req, resp);
+	else if (m=="POST" && req.has("uploads"))
+		initiate_upload(req, resp);
+	else if (m=="POST" && req.has("uploadId"))
+		complete_upload(req, resp);
+	else if (m=="DELETE" && req.has("uploadId"))
+	{
+		count("ABORT");
+		guard_t lock(m_);
+		uploads_.erase(req.arg("uploadId"));
+		resp.code_=204;
+	} else if (m=="DELETE")
+	{
+		count("DELETE");
+		guard_t lock(m_);
+		objects_.erase(req.bucket_+"/"+req.key_);
+		resp.code_=204;
+	} else
+		error_reply(resp, 501, "NotImplemented", m+" is not supported");
+}
+
+void mock_s3_server::list_bucket(const mock_request &req,
+								 mock_response &resp)
+{
+	count("LIST");
+	std::string prefix=req.arg("prefix"), marker=req.arg("marker");
+	std::string delimiter=req.arg("delimiter");
+	size_t max_keys=req.has("max-keys") ?
+				atoll(req.arg("max-keys").c_str()) : 1000;
+
+	std::string contents, prefixes, last_prefix, last;
+	size_t num=0;
+	bool truncated=false;
+	{
+		guard_t lock(m_);
+		std::string base=req.bucket_+"/";
+		for(auto iter=objects_.lower_bound(base+prefix);
+			iter!=objects_.end();++iter)
+		{
+			if (iter->first.compare(0, base.size()+prefix.size(),
+									base+prefix)!=0)
+				break;
+			std::string key=iter->first.substr(base.size());
+			if (key<=marker)
+				continue;
+
+			size_t delim=delimiter.empty() ? std::string::npos :
+					key.find(delimiter, prefix.size());
+			if (delim!=std::string::npos)
+			{
+				std::string common=key.substr(0, delim+delimiter.size());
+				if (common==last_prefix || common<=marker)
+					continue;
+				if (num==max_keys)
+				{
+					truncated=true;
+					break;
+				}
+				last_prefix=common;
+				last=common;
+				prefixes.append("<CommonPrefixes><Prefix>")
+						.append(xml_escape(common))
+						.append("</Prefix></CommonPrefixes>");
+			} else
+			{
+				if (num==max_keys)
+				{
+					truncated=true;
+					break;
+				}
+				last=key;
+				const mock_object_ptr &obj=iter->second;
+				contents.append("<Contents><Key>").append(xml_escape(key))
+						.append("</Key><LastModified>")
+						.append(iso_time(obj->mtime_))
+						.append("</LastModified><ETag>")
+						.append(xml_escape(obj->etag_))
+						.append("</ETag><Size>")
+						.append(int_to_string(obj->data_->size()))
+						.append("</Size><StorageClass>STANDARD"
+								"</StorageClass></Contents>");
+			}
+			num++;
+		}
+	}
+
+	std::string res="<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/"
+			"2006-03-01/\"><Name>"+xml_escape(req.bucket_)+"</Name><Prefix>"+
+			xml_escape(prefix)+"</Prefix><Marker>"+xml_escape(marker)+
+			"</Marker>";
+	if (truncated)
+		res+="<NextMarker>"+xml_escape(last)+"</NextMarker>";
+	res+="<MaxKeys>"+int_to_string(max_keys)+"</MaxKeys>";
+	if (!delimiter.empty())
+		res+="<Delimiter>"+xml_escape(delimiter)+"</Delimiter>";
+	res+=std::string("<IsTruncated>")+(truncated?"true":"false")+
+			"</IsTruncated>";
+	xml_reply(resp, res+contents+prefixes+"</ListBucketResult>");
+}
+
+void mock_s3_server::list_uploads(const mock_request &req,
+								  mock_response &resp)
+{
+	count("LIST_UPLOADS");
+	std::string prefix=req.arg("prefix");
+	std::string uploads;
+	{
+		guard_t lock(m_);
+		for(auto iter=uploads_.begin();iter!=uploads_.end();++iter)
+		{
+			const mock_upload_ptr &up=iter->second;
+			if (up->bucket_!=req.bucket_ ||
+					up->key_.compare(0, prefix.size(), prefix)!=0)
+				continue;
+			uploads.append("<Upload><Key>").append(xml_escape(up->key_))
+					.append("</Key><UploadId>").append(iter->first)
+					.append("</UploadId></Upload>");
+		}
+	}
+	xml_reply(resp, "<ListMultipartUploadsResult><Bucket>"+
+			  xml_escape(req.bucket_)+"</Bucket><IsTruncated>false"
+			  "</IsTruncated>"+uploads+"</ListMultipartUploadsResult>");
+}
+
+void mock_s3_server::list_parts(const mock_request &req,
+								mock_response &resp)
+{
+	count("LIST_PARTS");
+	int marker=atoi(req.arg("part-number-marker").c_str());
+	size_t max_parts=req.has("max-parts") ?
+				atoll(req.arg("max-parts").c_str()) : 1000;
+
+	std::string parts;
+	int last=marker;
+	bool truncated=false;
+	{
+		guard_t lock(m_);
+		auto up=uploads_.find(req.arg("uploadId"));
+		if (up==uploads_.end())
+		{
+			error_reply(resp, 404, "NoSuchUpload",
+						"The specified upload does not exist");
+			return;
+		}
+		size_t num=0;
+		const std::map<int, mock_part> &all=up->second->parts_;
+		for(auto iter=all.upper_bound(marker);iter!=all.end();++iter)
+		{
+			if (num++==max_parts)
+			{
+				truncated=true;
+				break;
+			}
+			last=iter->first;
+			parts.append("<Part><PartNumber>")
+					.append(int_to_string(iter->first))
+					.append("</PartNumber><ETag>&quot;")
+					.append(iter->second.digest_.md5_hex())
+					.append("&quot;</ETag><Size>")
+					.append(int_to_string(iter->second.data_->size()))
+					.append("</Size></Part>");
+		}
+	}
+
+	xml_reply(resp, "<ListPartsResult><Bucket>"+xml_escape(req.bucket_)+
+			  "</Bucket><Key>"+xml_escape(req.key_)+"</Key><UploadId>"+
+			  req.arg("uploadId")+"</UploadId><PartNumberMarker>"+
+			  int_to_string(marker)+"</PartNumberMarker>"
+			  "<NextPartNumberMarker>"+int_to_string(last)+
+			  "</NextPartNumberMarker><MaxParts>"+int_to_string(max_parts)+
+			  "</MaxParts><IsTruncated>"+(truncated?"true":"false")+
+			  "</IsTruncated>"+parts+"</ListPartsResult>");
+}
+
+void mock_s3_server::get_object(const mock_request &req,
+								mock_response &resp)
+{
+	count(req.method_);
+	mock_object_ptr obj;
+	{
+		guard_t lock(m_);
+		obj=try_get(objects_, req.bucket_+"/"+req.key_);
+	}
+	if (!obj)
+	{
+		error_reply(resp, 404, "NoSuchKey", "The specified key does not exist.");
+		return;
+	}
+
+	resp.headers_=obj->meta_;
+	resp.headers_["ETag"]=obj->etag_;
+	resp.headers_["Last-Modified"]=http_time(obj->mtime_);
+	resp.headers_["Accept-Ranges"]="bytes";
+	resp.data_=obj->data_;
+	resp.offset_=0;
+	resp.length_=obj->data_->size();
+
+	std::string range=try_get(req.headers_, "Range");
+	if (!range.empty() && req.method_=="GET")
+	{
+		if (!parse_range(range, obj->data_->size(),
+						 &resp.offset_, &resp.length_))
+		{
+			resp.data_.reset();
+			error_reply(resp, 416, "InvalidRange",
+						"The requested range is not satisfiable");
+			return;
+		}
+		resp.code_=206;
+		resp.headers_["Content-Range"]="bytes "+int_to_string(resp.offset_)+
+				"-"+int_to_string(resp.offset_+resp.length_-1)+"/"+
+				int_to_string(obj->data_->size());
+	}
+}
+
+//Validates Content-MD5 like S3 does
+static bool check_md5(const mock_request &req, mock_response &resp,
+					  const part_digest &digest)
+{
+	std::string md5=try_get(req.headers_, "Content-MD5");
+	if (md5.empty() || md5==digest.md5_base64())
+		return true;
+	error_reply(resp, 400, "BadDigest", "The Content-MD5 you specified did "
+				"not match what we received.");
+	return false;
+}
+
+void mock_s3_server::put_object(const mock_request &req,
+								mock_response &resp)
+{
+	count("PUT");
+	if (req.key_.empty())
+	{
+		error_reply(resp, 400, "InvalidRequest", "Missing object key");
+		return;
+	}
+	part_digest digest=compute_digest(req.body_.c_str(), req.body_.size());
+	if (!check_md5(req, resp, digest))
+		return;
+
+	mock_object_ptr obj(new mock_object());
+	obj->data_.reset(new std::string(req.body_));
+	obj->etag_="\""+digest.md5_hex()+"\"";
+	obj->mtime_=time(NULL);
+	obj->meta_=object_meta(req.headers_);
+
+	guard_t lock(m_);
+	objects_[req.bucket_+"/"+req.key_]=obj;
+	resp.headers_["ETag"]=obj->etag_;
+}
+
+void mock_s3_server::put_part(const mock_request &req, mock_response &resp)
+{
+	int part_num=atoi(req.arg("partNumber").c_str());
+	std::string source=try_get(req.headers_, "x-amz-copy-source");
+	count(source.empty() ? "UPLOAD_PART" : "COPY_PART");
+	if (part_num<1 || part_num>10000)
+	{
+		error_reply(resp, 400, "InvalidArgument", "Bad part number");
+		return;
+	}
+
+	mock_part part;
+	if (!source.empty())
+	{
+		source=url_decode(source);
+		if (!source.empty() && source[0]=='/')
+			source.erase(0, 1);
+		mock_object_ptr obj;
+		{
+			guard_t lock(m_);
+			obj=try_get(objects_, source);
+		}
+		if (!obj)
+		{
+			error_reply(resp, 404, "NoSuchKey",
+						"The specified key does not exist.");
+			return;
+		}
+		size_t offset=0, length=obj->data_->size();
+		std::string range=try_get(req.headers_, "x-amz-copy-source-range");
+		if (!range.empty() && !parse_range(range, obj->data_->size(),
+										   &offset, &length))
+		{
+			error_reply(resp, 400, "InvalidArgument",
+						"The x-amz-copy-source-range value is not valid");
+			return;
+		}
+		part.data_.reset(new std::string(*obj->data_, offset, length));
+	} else
+		part.data_.reset(new std::string(req.body_));
+	part.digest_=compute_digest(part.data_->c_str(), part.data_->size());
+	if (source.empty() && !check_md5(req, resp, part.digest_))
+		return;
+
+	{
+		guard_t lock(m_);
+		auto up=uploads_.find(req.arg("uploadId"));
+		if (up==uploads_.end())
+		{
+			error_reply(resp, 404, "NoSuchUpload",
+						"The specified upload does not exist");
+			return;
+		}
+		up->second->parts_[part_num]=part;
+	}
+
+	std::string etag="\""+part.digest_.md5_hex()+"\"";
+	if (source.empty())
+		resp.headers_["ETag"]=etag;
+	else
+		xml_reply(resp, "<CopyPartResult><LastModified>"+
+				  iso_time(time(NULL))+"</LastModified><ETag>"+
+				  xml_escape(etag)+"</ETag></CopyPartResult>");
+}
+
+void mock_s3_server::initiate_upload(const mock_request &req,
+									 mock_response &resp)
+{
+	count("INITIATE");
+	mock_upload_ptr up(new mock_upload());
+	up->bucket_=req.bucket_;
+	up->key_=req.key_;
+	up->meta_=object_meta(req.headers_);
+
+	std::string id;
+	{
+		guard_t lock(m_);
+		id="mock-upload-"+int_to_string(++next_upload_id_);
+		uploads_[id]=up;
+	}
+	xml_reply(resp, "<InitiateMultipartUploadResult><Bucket>"+
+			  xml_escape(req.bucket_)+"</Bucket><Key>"+xml_escape(req.key_)+
+			  "</Key><UploadId>"+id+"</UploadId>"
+			  "</InitiateMultipartUploadResult>");
+}
+
+void mock_s3_server::complete_upload(const mock_request &req,
+									 mock_response &resp)
+{
+	count("COMPLETE");
+	std::vector<int> numbers;
+	const std::string tag="<PartNumber>";
+	for(size_t pos=req.body_.find(tag);pos!=std::string::npos;
+		pos=req.body_.find(tag, pos+1))
+		numbers.push_back(atoi(req.body_.c_str()+pos+tag.size()));
+
+	mock_upload_ptr up;
+	{
+		guard_t lock(m_);
+		up=try_get(uploads_, req.arg("uploadId"));
+	}
+	if (!up)
+	{
+		error_reply(resp, 404, "NoSuchUpload",
+					"The specified upload does not exist");
+		return;
+	}
+
+	//The multipart ETag is the MD5 of the part MD5s
+	boost::shared_ptr<std::string> data(new std::string());
+	std::string md5s;
+	for(size_t f=0;f<numbers.size();++f)
+	{
+		auto part=up->parts_.find(numbers.at(f));
+		if (part==up->parts_.end() || (f>0 && numbers.at(f)<=numbers.at(f-1)))
+		{
+			error_reply(resp, 400, "InvalidPart",
+						"One or more of the specified parts could not be found");
+			return;
+		}
+		data->append(*part->second.data_);
+		md5s.append(reinterpret_cast<const char*>(part->second.digest_.md5_),
+					sizeof(part->second.digest_.md5_));
+	}
+
+	mock_object_ptr obj(new mock_object());
+	obj->data_=data;
+	obj->etag_="\""+compute_digest(md5s.c_str(), md5s.size()).md5_hex()+
+			"-"+int_to_string(numbers.size())+"\"";
+	obj->mtime_=time(NULL);
+	obj->meta_=up->meta_;
+
+	{
+		guard_t lock(m_);
+		objects_[up->bucket_+"/"+up->key_]=obj;
+		uploads_.erase(req.arg("uploadId"));
+	}
+	xml_reply(resp, "<CompleteMultipartUploadResult><Bucket>"+
+			  xml_escape(up->bucket_)+"</Bucket><Key>"+xml_escape(up->key_)+
+			  "</Key><ETag>"+xml_escape(obj->etag_)+"</ETag>"
+			  "</CompleteMultipartUploadResult>");
+}
@@ -0,0 +1,123 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef MOCK_S3_H
+#define MOCK_S3_H
+
+#include "common.h"
+#include <stdint.h>
+#include <boost/thread.hpp>
+#include <set>
+
+namespace es3 {
+
+	struct mock_s3_config
+	{
+		int latency_ms_; //Added to every request
+		uint64_t bandwidth_; //Bytes per second in each direction, 0 - no cap
+		double error_rate_; //Fraction of requests that get a 503 SlowDown
+
+		mock_s3_config() : latency_ms_(), bandwidth_(), error_rate_() {}
+	};
+
+	struct mock_request;
+	struct mock_response;
+	struct mock_object;
+	typedef boost::shared_ptr<mock_object> mock_object_ptr;
+	struct mock_upload;
+	typedef boost::shared_ptr<mock_upload> mock_upload_ptr;
+
+	/**
+	  In-memory S3 stand-in that speaks enough of the REST API for es3:
+	  LIST, HEAD, (range) GET, PUT, multipart uploads with part copies,
+	  DELETE, bucket location and ACLs. Buckets are addressed path-style
+	  and are created on first use. Signatures are not checked.
+	  */
+	class mock_s3_server
+	{
+		const mock_s3_config config_;
+		int listen_fd_;
+		int port_;
+		volatile bool stopping_;
+		boost::thread accept_thread_;
+		boost::thread_group workers_;
+
+		mutable mutex_t m_; //This mutex protects the following data {
+		//Keys are "bucket/key"
+		std::map<std::string, mock_object_ptr> objects_;
+		std::map<std::string, mock_upload_ptr> uploads_;
+		uint64_t next_upload_id_;
+		std::set<int> clients_;
+		std::map<std::string, uint64_t> counters_;
+		uint64_t bytes_in_, bytes_out_;
+		//}
+
+		mutex_t throttle_m_;
+		double throttle_free_at_; //Seconds since the epoch
+	public:
+		explicit mock_s3_server(const mock_s3_config &config);
+		~mock_s3_server();
+
+		//Listens on 127.0.0.1, port 0 picks a free port
+		void start(int port=0);
+		void stop();
+
+		int port() const { return port_; }
+		std::string endpoint() const;
+
+		//Number of requests by operation, "503" counts injected errors
+		std::map<std::string, uint64_t> request_counts() const;
+		uint64_t bytes_in() const;
+		uint64_t bytes_out() const;
+		void reset_counters();
+	private:
+		mock_s3_server(const mock_s3_server &);
+
+		void accept_loop();
+		void serve(int fd);
+		void throttle(size_t bytes);
+		void count(const std::string &op);
+
+		bool read_request(int fd, std::string &buf, mock_request &req);
+		void send_response(int fd, const mock_request &req,
+						   const mock_response &resp);
+		void handle(const mock_request &req, mock_response &resp);
+
+		void list_bucket(const mock_request &req, mock_response &resp);
+		void list_uploads(const mock_request &req, mock_response &resp);
+		void list_parts(const mock_request &req, mock_response &resp);
+		void get_object(const mock_request &req, mock_response &resp);
+		void put_object(const mock_request &req, mock_response &resp);
+		void put_part(const mock_request &req, mock_response &resp);
+		void initiate_upload(const mock_request &req, mock_response &resp);
+		void complete_upload(const mock_request &req, mock_response &resp);
+	};
+
+}; //namespace es3
+
+#endif //MOCK_S3_H
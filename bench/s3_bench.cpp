@@ -0,0 +1,296 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "mock_s3.h"
+#include "context.h"
+#include "agenda.h"
+#include "commands.h"
+#include "checksum.h"
+#include "errors.h"
+#include <iostream>
+#include <iomanip>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <curl/curl.h>
+#include <boost/program_options.hpp>
+
+using namespace es3;
+namespace po = boost::program_options;
+
+struct bench_options
+{
+	int small_files_, small_size_, large_files_, large_size_mb_;
+	int threads_;
+	uint64_t queue_limit_;
+	bool compression_;
+};
+
+static double now_secs()
+{
+	struct timeval tv={0};
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+//Deterministic incompressible content, so runs are comparable
+static void write_file(const bf::path &path, uint64_t size, uint64_t seed)
+{
+	handle_t fl(open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644)
+				| libc_die2("Can't create "+path.string()));
+	std::vector<uint64_t> buf(8192);
+	uint64_t state=seed*0x9E3779B97F4A7C15ULL+1;
+	for(uint64_t written=0;written<size;)
+	{
+		for(size_t f=0;f<buf.size();++f)
+		{
+			state^=state<<13; state^=state>>7; state^=state<<17;
+			buf[f]=state;
+		}
+		size_t cur=std::min(uint64_t(buf.size()*sizeof(uint64_t)),
+							size-written);
+		write(fl.get(), &buf[0], cur) | libc_die;
+		written+=cur;
+	}
+}
+
+static uint64_t generate_data(const bf::path &root, const bench_options &opts)
+{
+	uint64_t total=0;
+	for(int f=0;f<opts.small_files_;++f)
+	{
+		bf::path dir=root / ("dir"+int_to_string(f%10));
+		bf::create_directories(dir);
+		uint64_t size=1+(f*7919)%opts.small_size_;
+		write_file(dir / ("small"+int_to_string(f)), size, f);
+		total+=size;
+	}
+	for(int f=0;f<opts.large_files_;++f)
+	{
+		uint64_t size=uint64_t(opts.large_size_mb_)*1024*1024+f*12345;
+		write_file(root / ("large"+int_to_string(f)), size, 1000000+f);
+		total+=size;
+	}
+	return total;
+}
+
+static part_digest file_digest(const bf::path &path)
+{
+	handle_t fl(open(path.c_str(), O_RDONLY)
+				| libc_die2("Can't open "+path.string()));
+	digest_builder digest;
+	std::vector<char> buf(1024*1024);
+	while(true)
+	{
+		ssize_t res=read(fl.get(), &buf[0], buf.size()) | libc_die;
+		if (res==0)
+			break;
+		digest.update(&buf[0], res);
+	}
+	return digest.finish();
+}
+
+//Returns the number of files that differ
+static size_t compare_trees(const bf::path &left, const bf::path &right)
+{
+	size_t bad=0;
+	for(bf::recursive_directory_iterator iter(left);
+		iter!=bf::recursive_directory_iterator();++iter)
+	{
+		if (!bf::is_regular_file(iter->path()))
+			continue;
+		std::string rel=iter->path().string().substr(left.string().size());
+		bf::path other=bf::path(right.string()+rel);
+		if (!bf::exists(other) ||
+				file_digest(iter->path()).md5_hex()!=file_digest(other).md5_hex())
+		{
+			VLOG(0) << "Mismatch: " << other;
+			bad++;
+		}
+	}
+	return bad;
+}
+
+static int run_scenario(const std::string &name, context_ptr ctx,
+						mock_s3_server &server, const bench_options &opts,
+						const boost::function<int(context_ptr, const stringvec&,
+											agenda_ptr, bool)> &cmd,
+						const stringvec &params)
+{
+	agenda_ptr ag(new agenda(opts.threads_, 4, 4, true, true,
+							 MIN_SEGMENT_SIZE, 40));
+	ag->set_queue_limit(opts.queue_limit_);
+	server.reset_counters();
+	ctx->reset();
+
+	double start=now_secs();
+	int res=cmd(ctx, params, ag, false);
+	double elapsed=now_secs()-start;
+
+	uint64_t bytes=server.bytes_in()+server.bytes_out();
+	std::map<std::string, uint64_t> counts=server.request_counts();
+	uint64_t total=0;
+	std::string details;
+	for(auto iter=counts.begin();iter!=counts.end();++iter)
+	{
+		if (iter->first!="503")
+			total+=iter->second;
+		details.append(" ").append(iter->first).append("=")
+				.append(int_to_string(iter->second));
+	}
+
+	std::cout << std::fixed << std::setprecision(3)
+			  << std::setw(10) << std::left << name
+			  << " time=" << elapsed << "s"
+			  << " throughput=" << bytes/elapsed/1024/1024 << "MB/s"
+			  << " requests=" << total
+			  << " req/s=" << total/elapsed
+			  << " result=" << res << "\n\t" << details << std::endl;
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	bench_options opts;
+	mock_s3_config config;
+	int verbosity=0;
+	double bandwidth_mb=0;
+	bool keep_data=false;
+
+	po::options_description desc("es3 benchmark against a local mock S3", 80);
+	desc.add_options()
+		("help", "Display this message")
+		("verbosity,v", po::value<int>(&verbosity)->default_value(0),
+			"Verbosity level [0 - the lowest, 9 - the highest]")
+		("small-files", po::value<int>(&opts.small_files_)->default_value(2000),
+			"Number of small files")
+		("small-size", po::value<int>(&opts.small_size_)->default_value(65536),
+			"Maximum size of a small file")
+		("large-files", po::value<int>(&opts.large_files_)->default_value(4),
+			"Number of large files")
+		("large-size", po::value<int>(&opts.large_size_mb_)->default_value(64),
+			"Size of a large file in MB")
+		("threads,n", po::value<int>(&opts.threads_)->default_value(32),
+			"Number of network threads")
+		("compression", po::value<bool>(
+			 &opts.compression_)->default_value(false),
+			"Use GZIP compression")
+		("max-queued-tasks", po::value<uint64_t>(
+			 &opts.queue_limit_)->default_value(0),
+			"Maximum number of queued tasks of each kind [0 - unlimited]")
+		("latency", po::value<int>(&config.latency_ms_)->default_value(0),
+			"Latency added by the server to every request, in ms")
+		("bandwidth", po::value<double>(&bandwidth_mb)->default_value(0),
+			"Server bandwidth cap in MB/s [0 - unlimited]")
+		("error-rate", po::value<double>(&config.error_rate_)->default_value(0),
+			"Fraction of requests that fail with 503 SlowDown")
+		("quick", "Use a small data set")
+		("keep-data", "Don't remove the generated data")
+	;
+
+	po::variables_map vm;
+	try
+	{
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch(const boost::program_options::error &err)
+	{
+		std::cerr << "Failed to parse command line. Error: "
+				  << err.what() << std::endl;
+		return 2;
+	}
+	if (vm.count("help"))
+	{
+		std::cout << desc;
+		return 1;
+	}
+	if (vm.count("quick"))
+	{
+		opts.small_files_=100;
+		opts.large_files_=1;
+		opts.large_size_mb_=16;
+	}
+	keep_data=vm.count("keep-data");
+	config.bandwidth_=uint64_t(bandwidth_mb*1024*1024);
+
+	logger::set_verbosity(verbosity);
+	curl_global_init(CURL_GLOBAL_ALL);
+
+	mock_s3_server server(config);
+	server.start();
+
+	bf::path root=bf::temp_directory_path() /
+			bf::unique_path("es3-bench-%%%%-%%%%");
+	bf::path source=root / "source", target=root / "target";
+	bf::create_directories(source);
+	uint64_t total=generate_data(source, opts);
+	std::cout << "Data set: " << opts.small_files_ << " small and "
+			  << opts.large_files_ << " large files, " << total
+			  << " bytes. Server: " << server.endpoint() << std::endl;
+
+	context_ptr ctx(new conn_context());
+	ctx->endpoint_=server.endpoint();
+	ctx->api_key_="bench";
+	ctx->secret_key="bench";
+	ctx->scratch_dir_=root;
+	ctx->do_compression_=opts.compression_;
+	ctx->concurrent_list_req_=0;
+	ctx->small_file_size_=262144;
+	ctx->small_file_batch_=64;
+
+	stringvec up, down, ls;
+	up.push_back(source.string()+"/");
+	up.push_back("s3://bench/data/");
+	down.push_back("s3://bench/data/");
+	down.push_back(target.string()+"/");
+	ls.push_back("s3://bench/data/");
+
+	int res=0;
+	try
+	{
+		res|=run_scenario("upload", ctx, server, opts, &do_rsync, up);
+		res|=run_scenario("sync", ctx, server, opts, &do_rsync, up);
+		res|=run_scenario("ls", ctx, server, opts, &do_du, ls);
+		res|=run_scenario("download", ctx, server, opts, &do_rsync, down);
+		if (compare_trees(source, target)!=0)
+		{
+			std::cerr << "ERR: downloaded data doesn't match" << std::endl;
+			res|=16;
+		}
+	} catch(const std::exception &ex)
+	{
+		std::cerr << "ERR: " << ex.what() << std::endl;
+		res|=8;
+	}
+
+	ctx->reset();
+	server.stop();
+	if (!keep_data)
+		bf::remove_all(root);
+	curl_global_cleanup();
+	return res;
+}
@@ -0,0 +1,104 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "affinity.h"
+#include <fstream>
+#include <boost/algorithm/string.hpp>
+#include <stdlib.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace es3;
+
+std::vector<int> es3::parse_cpu_list(const std::string &list)
+{
+	std::vector<int> res;
+	stringvec ranges;
+	boost::split(ranges, list, boost::is_any_of(","));
+	for(auto iter=ranges.begin();iter!=ranges.end();++iter)
+	{
+		std::string range=trim(*iter);
+		if (range.empty())
+			continue;
+		size_t dash=range.find('-');
+		int from=atoi(range.substr(0, dash).c_str());
+		int to=dash==std::string::npos ? from :
+			atoi(range.substr(dash+1).c_str());
+		for(int f=from;f<=to;++f)
+			res.push_back(f);
+	}
+	return res;
+}
+
+std::vector<std::vector<int> > es3::detect_numa_nodes()
+{
+	std::vector<std::vector<int> > res;
+	bf::path root("/sys/devices/system/node");
+	boost::system::error_code ec;
+	if (!bf::is_directory(root, ec))
+		return res;
+
+	//Nodes are numbered, but the numbers are not necessarily contiguous
+	std::map<int, std::vector<int> > nodes;
+	for(bf::directory_iterator iter(root, ec), end; !ec && iter!=end;
+		iter.increment(ec))
+	{
+		std::string name=iter->path().filename().string();
+		if (name.compare(0, 4, "node")!=0 ||
+				name.find_first_not_of("0123456789", 4)!=std::string::npos)
+			continue;
+
+		std::ifstream cpulist((iter->path() / "cpulist").c_str());
+		std::string line;
+		if (!std::getline(cpulist, line))
+			continue;
+		std::vector<int> cpus=parse_cpu_list(line);
+		if (!cpus.empty()) //Memory-only nodes have no CPUs
+			nodes[atoi(name.c_str()+4)]=cpus;
+	}
+
+	for(auto iter=nodes.begin();iter!=nodes.end();++iter)
+		res.push_back(iter->second);
+	return res;
+}
+
+bool es3::pin_current_thread(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(auto iter=cpus.begin();iter!=cpus.end();++iter)
+		if (*iter>=0 && *iter<CPU_SETSIZE)
+			CPU_SET(*iter, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set)==0;
+#else
+	return false;
+#endif
+}
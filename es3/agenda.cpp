@@ -28,11 +28,20 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include "agenda.h"
 #include "errors.h"
+#include "tracing.h"
+#include "affinity.h"
 #include <unistd.h>
 //#include <thread>
 #include <sstream>
+#include <string.h>
 #include <unistd.h>
 #include <boost/bind.hpp>
+#include <algorithm>
+#include <limits>
+#include <stdlib.h>
+#ifdef __linux__
+#include <malloc.h>
+#endif
 #include <time.h>
 #include <iostream>
 #include <sys/types.h>
@@ -65,17 +74,33 @@ int current_utc_time(struct timespec *ts)
 agenda::agenda(size_t num_unbound, size_t num_cpu_bound, size_t num_io_bound,
 			   bool quiet, bool final_quiet,
 			   size_t segment_size, size_t max_segments_in_flight) :
-	quiet_(quiet), final_quiet_(final_quiet), segment_size_(segment_size),
+	quiet_(quiet), final_quiet_(final_quiet), pin_threads_(),
+	segment_size_(segment_size),
 	max_segments_in_flight_(max_segments_in_flight),
 	num_working_(), num_submitted_(), num_done_(), num_failed_(),
-	segments_in_flight_()
+	num_retries_(), segments_in_flight_(), retry_tick_(), num_delayed_(),
+	running_(), shutdown_(), queue_limit_(), num_parked_(), stats_()
 {
+	memset(queued_, 0, sizeof(queued_));
+	memset(done_by_class_, 0, sizeof(done_by_class_));
+	memset(failed_by_class_, 0, sizeof(failed_by_class_));
+	memset(errors_by_kind_, 0, sizeof(errors_by_kind_));
 	class_limits_[taskUnbound]=num_unbound;
 	class_limits_[taskCPUBound]=num_cpu_bound;
 	class_limits_[taskIOBound]=num_io_bound;
 	current_utc_time(&start_time_) | libc_die2("Can't get time");
+
+	void *stats=0;
+	if (posix_memalign(&stats, STAT_STRIPE_ALIGN,
+					   sizeof(stat_stripe)*STAT_STRIPES))
+		err(errFatal) << "Can't allocate the stat counters";
+	memset(stats, 0, sizeof(stat_stripe)*STAT_STRIPES);
+	stats_=(stat_stripe*)stats;
 }
 
+//The task that is being run by this thread
+static __thread sync_task *current_task=0;
+
 namespace es3
 {
 	struct segment_deleter
@@ -89,15 +114,21 @@ namespace es3
 			u_guard_t guard(parent_->m_);
 			assert(parent_->segments_in_flight_>0);
 			parent_->segments_in_flight_--;
-			parent_->condition_.notify_one();
+			parent_->notify_all_classes(false);
 		}
 	};
 
 	class task_executor
 	{
-		agenda_ptr agenda_;
+		//Not a shared pointer, the agenda owns its workers and stops
+		//them when it's destroyed
+		agenda *agenda_;
+		const task_type_e class_;
+		const std::vector<int> cpus_;
 	public:
-		task_executor(agenda_ptr agenda) : agenda_(agenda) {}
+		task_executor(agenda *agenda, task_type_e cls,
+					  const std::vector<int> &cpus) :
+			agenda_(agenda), class_(cls), cpus_(cpus) {}
 
 		std::pair<sync_task_ptr, std::vector<segment_ptr> > claim_task()
 		{
@@ -105,95 +136,193 @@ namespace es3
 			while(true)
 			{
 				u_guard_t lock(agenda_->m_);
-				if (agenda_->tasks_.empty())
+				if (agenda_->shutdown_)
+					return res_pair;
+				if (!agenda_->running_)
 				{
-					if (agenda_->num_working_==0)
-						return res_pair;
-					agenda_->condition_.wait(lock);
+					//Idle between the runs
+					agenda_->conditions_[class_].wait(lock);
 					continue;
 				}
 
-				//Iterate over classes to find one that is not yet full
-				for(auto iter=agenda_->classes_.begin();
-					iter!=agenda_->classes_.end();++iter)
+				agenda_->advance_retries();
+				if (agenda_->tasks_.empty())
 				{
-					//Check if there are too many tasks of this type running
-					task_type_e cur_class=iter->first;
-
-					size_t cur_num=iter->second;
-					size_t limit=agenda_->get_capability(cur_class);
-					//Unbound tasks are allowed to exceed their limits and
-					//borrow threads from other classes
-//					if (cur_class!=taskUnbound && limit<=cur_num)
-//						continue; //Too busy
-					if (limit<=cur_num)
-						continue;
-
-					size_t segments_avail=agenda_->max_segments_in_flight_-
-							agenda_->segments_in_flight_;
-
-					//Good! We can work on this class.
-					//Find the task with the greatest segment requirements
-					agenda::size_map_t::iterator pair=
-							--agenda_->tasks_.end();
-					size_t segments_needed=pair->first;
-					if (segments_needed>segments_avail)
-					{
-						//Try the task with the least number of required segs
-						pair=agenda_->tasks_.begin();
-						segments_needed=pair->first;
-						if (segments_needed>segments_avail)
-							continue; //No such luck :(
-					}
-
-					if (!pair->second.count(cur_class))
-						continue; //No tasks for this class
-
-					agenda::task_map_t &task_map=pair->second.at(cur_class);
-					assert(!task_map.empty());
-					sync_task_ptr res=task_map.begin()->second;
-					task_map.erase(task_map.begin());
-					if (task_map.empty())
-					{
-						pair->second.erase(cur_class);
-						if (pair->second.empty())
-							agenda_->tasks_.erase(pair->first);
-					}
-
-					agenda_->num_working_++;
-					agenda_->classes_[cur_class]++;
-
-					res_pair.first=res;
-					if (segments_needed)
-						res_pair.second=agenda_->get_segments(segments_needed);
-					return res_pair;
+					wait(lock);
+					continue;
 				}
 
-				agenda_->condition_.wait(lock);
+				if (try_claim(res_pair))
+					return res_pair;
+				wait(lock);
 			}
 		}
 
-		void cleanup(sync_task_ptr cur_task, bool fail)
+		//Must be called with the agenda lock held
+		bool try_claim(std::pair<sync_task_ptr,
+					   std::vector<segment_ptr> > &res_pair)
 		{
+			auto iter=agenda_->classes_.find(class_);
+			if (iter==agenda_->classes_.end())
+				return false; //No tasks of our class yet
+
+			//Check if there are too many tasks of this type running
+			task_type_e cur_class=iter->first;
+
+			size_t cur_num=iter->second;
+			size_t limit=agenda_->get_capability(cur_class);
+			//Unbound tasks are allowed to exceed their limits and
+			//borrow threads from other classes
+//			if (cur_class!=taskUnbound && limit<=cur_num)
+//				return false; //Too busy
+			if (limit<=cur_num)
+				return false;
+
+			size_t segments_avail=agenda_->max_segments_in_flight_-
+					agenda_->segments_in_flight_;
+
+			//Good! We can work on this class.
+			//Find the task with the lowest ordinal among those that
+			//fit into the available segments. On ties prefer the task
+			//with the greatest segment requirements. The buckets are
+			//walked from the largest, so the tasks waiting for segments
+			//are seen first: while one of them is blocked, the released
+			//segments are saved for it instead of going to the tasks with
+			//higher ordinals. Tasks that need no segments can always run,
+			//they are the ones that return the segments.
+			int64_t blocked_ordinal=std::numeric_limits<int64_t>::max();
+			agenda::size_map_t::iterator pair=agenda_->tasks_.end();
+			for(auto seg_iter=agenda_->tasks_.rbegin();
+				seg_iter!=agenda_->tasks_.rend();++seg_iter)
+			{
+				auto by_class=seg_iter->second.find(cur_class);
+				if (by_class==seg_iter->second.end())
+					continue;
+				int64_t ordinal=by_class->second.begin()->first;
+				if (seg_iter->first>segments_avail)
+				{
+					if (seg_iter->first<=agenda_->max_segments_in_flight_)
+						blocked_ordinal=std::min(blocked_ordinal, ordinal);
+					continue;
+				}
+				if (seg_iter->first && ordinal>blocked_ordinal)
+					continue;
+				if (pair==agenda_->tasks_.end() || ordinal <
+						pair->second.at(cur_class).begin()->first)
+					pair=--seg_iter.base();
+			}
+			if (pair==agenda_->tasks_.end())
+				return false; //No such luck :(
+			size_t segments_needed=pair->first;
+
+			agenda::task_map_t &task_map=pair->second.at(cur_class);
+			assert(!task_map.empty());
+			sync_task_ptr res=task_map.begin()->second;
+			task_map.erase(task_map.begin());
+			if (task_map.empty())
+			{
+				pair->second.erase(cur_class);
+				if (pair->second.empty())
+					agenda_->tasks_.erase(pair->first);
+			}
+
+			agenda_->num_working_++;
+			agenda_->classes_[cur_class]++;
+			agenda_->on_claimed(cur_class);
+
+			res_pair.first=res;
+			if (segments_needed)
+				res_pair.second=agenda_->get_segments(segments_needed);
+			return true;
+		}
+
+		void wait(u_guard_t &lock)
+		{
+			//Delayed tasks are only moved to the queue by the workers, so
+			//don't sleep for longer than a tick if there are any
+			boost::condition_variable &cond=agenda_->conditions_[class_];
+			if (agenda_->num_delayed_)
+				cond.timed_wait(lock,
+					boost::posix_time::milliseconds(RETRY_TICK_MS));
+			else
+				cond.wait(lock);
+		}
+
+		//The task is released before the run can end, so a worker never
+		//drops the last reference to the agenda (segments hold them)
+		void cleanup(sync_task_ptr &cur_task, bool fail,
+					 const result_code_t *retry_code)
+		{
+			task_type_e cls=cur_task->get_class();
+			bool delayed;
+			{
+				u_guard_t lock(agenda_->m_);
+				delayed=retry_code &&
+						agenda_->retry_later(cur_task, *retry_code);
+			}
+
+			if (!delayed)
+			{
+				if (retry_code)
+				{
+					VLOG(0) << "ERR: Giving up on a task after "
+							<< cur_task->attempts() << " attempts";
+					fail=true;
+				}
+
+				//Update stats
+				__sync_fetch_and_add(&agenda_->num_done_, 1);
+				__sync_fetch_and_add(&agenda_->done_by_class_[cls], 1);
+				if (fail)
+				{
+					__sync_fetch_and_add(&agenda_->num_failed_, 1);
+					__sync_fetch_and_add(&agenda_->failed_by_class_[cls], 1);
+				}
+			}
+			cur_task.reset();
+
 			u_guard_t lock(agenda_->m_);
 			agenda_->num_working_--;
-			assert(agenda_->classes_[cur_task->get_class()]>0);
-			agenda_->classes_[cur_task->get_class()]--;
+			assert(agenda_->classes_[cls]>0);
+			agenda_->classes_[cls]--;
+			if (agenda_->is_finished())
+			{
+				//We've finished our tasks!
+				agenda_->notify_all_classes(true);
+				agenda_->phase_done_.notify_all();
+			} else
+				agenda_->conditions_[class_].notify_one();
+		}
 
-			if (agenda_->tasks_.empty() && agenda_->num_working_==0)
-				agenda_->condition_.notify_all(); //We've finished our tasks!
-			else
-				agenda_->condition_.notify_one();
+		//Logs and counts the failure, returns true if the task can be
+		//retried
+		bool on_failure(const result_code_t &code)
+		{
+			if (code.code()==errNone)
+			{
+				//The task has asked to be restarted
+				VLOG(2) << "INFO: '" << code.desc() << "'";
+				return true;
+			}
 
-			//Update stats
-			guard_t lockst(agenda_->stats_m_);
-			agenda_->num_done_++;
-			if (fail)
-				agenda_->num_failed_++;
+			__sync_fetch_and_add(&agenda_->errors_by_kind_[code.kind()], 1);
+			if (code.code()==errWarn)
+			{
+				VLOG(1) << "WARN: [" << pthread_self() << "] '"
+						<< code.desc() << "'";
+				return true;
+			}
+			VLOG(0) << "ERROR: '" << code.desc() << "'";
+			return false;
 		}
 
 		void operator ()()
 		{
+			//Memory is allocated on the node of the thread that touches
+			//it first, so segments filled by this thread are node-local
+			if (!cpus_.empty() && !pin_current_thread(cpus_))
+				VLOG(2) << "Can't set thread affinity";
+
 			while(true)
 			{
 				std::pair<sync_task_ptr, std::vector<segment_ptr> > cur_task;
@@ -201,44 +330,37 @@ namespace es3
 				if (!cur_task.first)
 					break;
 
-				bool fail=true;
-				for(int f=0; f<10; ++f)
+				//Tasks scheduled from this one inherit its ordinal
+				current_task=cur_task.first.get();
+
+				//Failed tasks are not retried here, they are put aside
+				//for a while so that the thread can do something useful
+				bool fail=true, retry=false;
+				result_code_t code;
+				try
 				{
-					try
-					{
-						(*cur_task.first)(agenda_, cur_task.second);
+					code=cur_task.first->execute(agenda_->shared_from_this(),
+												 cur_task.second);
+					if (code.ok())
 						fail=false;
-						break;
-					} catch (const es3_exception &ex)
-					{
-						const result_code_t &code = ex.err();
-						if (code.code()==errNone)
-						{
-							VLOG(2) << "INFO: " << ex.what();
-							sleep(5);
-							continue;
-						} else if (code.code()==errWarn)
-						{
-                            VLOG(1) << "WARN: [" << pthread_self() << "]" << ex.what();
-                            sleep(10);
-							continue;
-						} else
-						{
-							VLOG(0) << ex.what();
-							break;
-						}
-					} catch(const std::exception &ex)
-					{
-						VLOG(0) << "ERR: " << ex.what();
-						break;
-					} catch(...)
-					{
-						VLOG(0) << "Unknown exception. Skipping";
-						break;
-					}
+					else
+						retry=on_failure(code);
+				} catch (const es3_exception &ex)
+				{
+					code=ex.err();
+					retry=on_failure(code);
+				} catch(const std::exception &ex)
+				{
+					VLOG(0) << "ERR: " << ex.what();
+				} catch(...)
+				{
+					VLOG(0) << "Unknown exception. Skipping";
 				}
 
-				cleanup(cur_task.first, fail);
+				current_task=0;
+				//The segments must be released before the run can end
+				cur_task.second.clear();
+				cleanup(cur_task.first, fail, retry ? &code : 0);
 			}
 		}
 	};
@@ -260,6 +382,101 @@ std::vector<segment_ptr> agenda::get_segments(size_t num)
 	return res;
 }
 
+void agenda::set_retry_policy(const retry_policy &policy)
+{
+	guard_t lock(m_);
+	retry_policy_=policy;
+}
+
+bool agenda::retry_later(sync_task_ptr task, const result_code_t &code)
+{
+	retry_class_e cls=retryTransient;
+	if (code.code()==errNone)
+		cls=retryInfo;
+	else if (code.kind()==kindThrottled || code.retry_after()>=0)
+		cls=retryThrottled;
+
+	task->attempts_++;
+	if (task->attempts_>=retry_policy_.max_attempts_[cls])
+		return false;
+
+	//Exponential backoff with "equal jitter" - a random delay between
+	//the half and the full backoff, so that the retries don't come in
+	//waves. The server's hint takes precedence if it's longer.
+	static __thread unsigned int seed=0;
+	if (!seed)
+		seed=time(NULL) ^ (uintptr_t)&seed;
+	int shift=std::min(task->attempts_-1, 20);
+	uint64_t delay=std::min(retry_policy_.base_delay_ms_<<shift,
+							retry_policy_.max_delay_ms_);
+	delay=delay/2+(delay/2 ? rand_r(&seed)%(delay/2+1) : 0);
+	if (code.retry_after()>0)
+		delay=std::max(delay, uint64_t(code.retry_after())*1000);
+
+	uint64_t now_tick=get_elapsed_millis()/RETRY_TICK_MS;
+	if (now_tick<retry_tick_)
+		now_tick=retry_tick_;
+	uint64_t due=now_tick+std::max<uint64_t>(
+		1, (delay+RETRY_TICK_MS-1)/RETRY_TICK_MS);
+	delayed_task entry={due, task};
+	retry_wheel_[due%RETRY_WHEEL_SLOTS].push_back(entry);
+	num_delayed_++;
+	__sync_fetch_and_add(&num_retries_, 1);
+	VLOG(2) << "Retrying a task in " << delay << "ms, attempt "
+			<< task->attempts_+1;
+	return true;
+}
+
+void agenda::advance_retries()
+{
+	if (!num_delayed_)
+		return;
+	uint64_t now_tick=get_elapsed_millis()/RETRY_TICK_MS;
+	if (now_tick<=retry_tick_)
+		return;
+
+	//Visit the slots that were passed since the last time, entries that
+	//are due on the next turns of the wheel stay in place
+	uint64_t passed=std::min<uint64_t>(now_tick-retry_tick_,
+									   RETRY_WHEEL_SLOTS);
+	for(uint64_t f=0;f<passed;++f)
+	{
+		std::vector<delayed_task> &slot=
+				retry_wheel_[(now_tick-f)%RETRY_WHEEL_SLOTS];
+		for(size_t pos=0;pos<slot.size();)
+		{
+			if (slot[pos].due_tick_>now_tick)
+			{
+				++pos;
+				continue;
+			}
+			enqueue(slot[pos].task_);
+			slot[pos]=slot.back();
+			slot.pop_back();
+			num_delayed_--;
+		}
+	}
+	retry_tick_=now_tick;
+}
+
+void agenda::enqueue(sync_task_ptr task)
+{
+	classes_[task->get_class()]; //Force insertion of class entry
+	queued_[task->get_class()]++;
+	task_map_t &task_map=tasks_[task->needs_segments()][task->get_class()];
+	task_map.insert(std::make_pair(task->ordinal(), task));
+	conditions_[task->get_class()].notify_one();
+}
+
+void agenda::notify_all_classes(bool all_threads)
+{
+	for(int f=0;f<taskTypesNum;++f)
+		if (all_threads)
+			conditions_[f].notify_all();
+		else
+			conditions_[f].notify_one();
+}
+
 void agenda::schedule(sync_task_ptr task)
 {
 	u_guard_t lock(m_);
@@ -270,43 +487,138 @@ void agenda::schedule(sync_task_ptr task)
 //		tasks_.insert(iter, task);
 //	else
 //		tasks_.push_back(task);
-	classes_[task->get_class()]; //Force insertion of class entry
-	task_map_t &task_map=tasks_[task->needs_segments()][task->get_class()];
-	task_map.insert(std::make_pair(task->ordinal(), task));
-	condition_.notify_one();
+	if (!task->has_ordinal() && current_task)
+		task->set_ordinal(current_task->ordinal());
+
+	task_type_e cls=task->get_class();
+	enqueue(task);
+	__sync_fetch_and_add(&num_submitted_, 1);
+
+	if (current_task || !running_ || !queue_limit_ ||
+			queued_[cls]<queue_limit_)
+		return;
+	while(running_ && !shutdown_ && queued_[cls]>queue_limit_/2)
+		room_.wait(lock);
+}
 
-	guard_t lockst(stats_m_);
-	num_submitted_++;
+void agenda::on_claimed(task_type_e cls)
+{
+	assert(queued_[cls]>0);
+	queued_[cls]--;
+	//The waiting producers are resumed when the queue crosses the low
+	//watermark, so they don't wake up for every claimed task
+	if (!queue_limit_ || queued_[cls]!=queue_limit_/2)
+		return;
+	room_.notify_all();
+	std::vector<sync_task_ptr> parked;
+	parked.swap(parked_[cls]);
+	num_parked_-=parked.size();
+	for(auto iter=parked.begin();iter!=parked.end();++iter)
+		enqueue(*iter);
+}
+
+bool agenda::park_if_congested(sync_task_ptr producer, task_type_e cls)
+{
+	guard_t lock(m_);
+	if (!queue_limit_ || queued_[cls]<queue_limit_)
+		return false;
+	if (!producer->has_ordinal() && current_task)
+		producer->set_ordinal(current_task->ordinal());
+	parked_[cls].push_back(producer);
+	num_parked_++;
+	//It comes back as a new task, once this run of it is counted as done
+	__sync_fetch_and_add(&num_submitted_, 1);
+	return true;
+}
+
+void agenda::set_queue_limit(size_t limit)
+{
+	guard_t lock(m_);
+	queue_limit_=limit;
+}
+
+void producer_task::operator()(agenda_ptr agenda)
+{
+	while(!agenda->park_if_congested(shared_from_this(), produced_class()))
+		if (!produce_next(agenda))
+			return;
 }
 
 typedef boost::shared_ptr<boost::thread> thread_ptr_t;
 
-size_t agenda::run()
+agenda::~agenda()
 {
-	std::vector<thread_ptr_t> threads;
-	size_t thread_num=0;
+	{
+		guard_t lock(m_);
+		shutdown_=true;
+		notify_all_classes(true);
+		room_.notify_all();
+	}
+	for(size_t f=0;f<workers_.size();++f)
+		workers_.at(f)->join();
+	free(stats_);
+}
+
+void agenda::start_workers()
+{
+	//Threads of each class are spread evenly over the NUMA nodes. There's
+	//nothing to gain on a single-node machine.
+	std::vector<std::vector<int> > nodes;
+	if (pin_threads_)
+		nodes=detect_numa_nodes();
+	if (nodes.size()<2)
+		nodes.clear();
+#ifdef M_MMAP_THRESHOLD
+	//Make sure that segment buffers are always freshly mapped, otherwise
+	//malloc can reuse memory that was first touched on another node
+	if (!nodes.empty())
+		mallopt(M_MMAP_THRESHOLD, 1024*1024);
+#endif
+
 	for(auto iter=class_limits_.begin();iter!=class_limits_.end();++iter)
-		thread_num+=iter->second;
+		for(size_t f=0;f<iter->second;++f)
+		{
+			std::vector<int> cpus;
+			if (!nodes.empty())
+				cpus=nodes.at(f%nodes.size());
+			workers_.push_back(thread_ptr_t(new boost::thread(
+				task_executor(this, iter->first, cpus))));
+		}
+}
 
-	for(int f=0;f<thread_num;++f)
-		threads.push_back(thread_ptr_t(new boost::thread(task_executor(shared_from_this()))));
+void agenda::begin_run()
+{
+	if (workers_.empty())
+		start_workers();
+	guard_t lock(m_);
+	if (running_)
+		return;
+	running_=true;
+	notify_all_classes(true);
+}
 
+size_t agenda::run()
+{
+	begin_run();
+
+	thread_ptr_t progress;
 	if (!quiet_)
+		progress.reset(new boost::thread(boost::bind(&agenda::draw_progress,
+													 this)));
 	{
-		threads.push_back(thread_ptr_t(new boost::thread(boost::bind(&agenda::draw_progress,
-												  this))));
-		for(int f=0;f<threads.size();++f)
-			threads.at(f)->join();
+		u_guard_t lock(m_);
+		while(!is_finished())
+			phase_done_.wait(lock);
+		running_=false;
+	}
 
+	if (progress)
+	{
+		progress->join();
 		//Draw progress the last time
 		draw_progress_widget();
 		std::cerr<<std::endl;
-	} else
-	{
-		for(int f=0;f<threads.size();++f)
-			threads.at(f)->join();
 	}
-
 	return num_failed_;
 }
 
@@ -322,7 +634,7 @@ void agenda::draw_progress()
 	{
 		{
 			guard_t g(m_);
-			if (num_working_==0 && tasks_.empty())
+			if (is_finished())
 				return;
 		}
 		draw_progress_widget();
@@ -330,10 +642,73 @@ void agenda::draw_progress()
 	}
 }
 
-void agenda::add_stat_counter(const std::string &stat, uint64_t val)
+const char* es3::stat_counter_name(stat_counter_e stat)
+{
+	switch(stat)
+	{
+	case statRead: return "read";
+	case statCompressed: return "compressed";
+	case statPrecompressed: return "precompressed";
+	case statDecompressed: return "decompressed";
+	case statUploaded: return "uploaded";
+	case statDownloaded: return "downloaded";
+	case statDeduplicated: return "deduplicated";
+	default: return "unknown";
+	}
+}
+
+static size_t current_stat_stripe()
 {
-	guard_t lockst(stats_m_);
-	cur_stats_[stat]+=val;
+	static size_t next_stripe=0;
+	static __thread size_t stripe=size_t(-1);
+	if (stripe==size_t(-1))
+		stripe=__sync_fetch_and_add(&next_stripe, 1) % STAT_STRIPES;
+	return stripe;
+}
+
+void agenda::add_stat_counter(stat_counter_e stat, uint64_t val)
+{
+	assert(stat<statCountersNum);
+	__sync_fetch_and_add(&stats_[current_stat_stripe()].counters_[stat], val);
+}
+
+uint64_t agenda::get_stat_counter(stat_counter_e stat) const
+{
+	assert(stat<statCountersNum);
+	uint64_t res=0;
+	for(size_t f=0;f<STAT_STRIPES;++f)
+		res+=stats_[f].counters_[stat];
+	return res;
+}
+
+agenda_metrics agenda::get_metrics()
+{
+	agenda_metrics res;
+	memset(&res, 0, sizeof(res));
+	{
+		guard_t lock(m_);
+		for(int f=0;f<taskTypesNum;++f)
+			res.queued_[f]=queued_[f];
+		for(auto iter=classes_.begin();iter!=classes_.end();++iter)
+			res.running_[iter->first]=iter->second;
+		res.segments_in_flight_=segments_in_flight_;
+		res.retrying_=num_delayed_;
+	}
+
+	for(int f=0;f<taskTypesNum;++f)
+	{
+		res.done_[f]=done_by_class_[f];
+		res.failed_[f]=failed_by_class_[f];
+	}
+	res.submitted_=num_submitted_;
+	res.retries_=num_retries_;
+	for(int f=0;f<errorKindsNum;++f)
+		res.errors_[f]=errors_by_kind_[f];
+	res.max_segments_in_flight_=max_segments_in_flight_;
+	res.elapsed_millis_=get_elapsed_millis();
+	for(int f=0;f<statCountersNum;++f)
+		res.stats_[f]=get_stat_counter(stat_counter_e(f));
+	return res;
 }
 
 std::pair<std::string, std::string> agenda::format_si(uint64_t val,
@@ -366,14 +741,14 @@ void agenda::draw_progress_widget()
 
 	std::stringstream str;
 	{
-		guard_t lockst(stats_m_);
+		uint64_t failed = num_failed_;
 		str << "Tasks: [" << num_done_ << "/" << num_submitted_
 			<< "]";
-		if (num_failed_)
-			str << " Failed tasks: " << num_failed_;
+		if (failed)
+			str << " Failed tasks: " << failed;
 
-		uint64_t uploaded = cur_stats_["uploaded"];
-		uint64_t downloaded = cur_stats_["downloaded"];
+		uint64_t uploaded = get_stat_counter(statUploaded);
+		uint64_t downloaded = get_stat_counter(statDownloaded);
 		if (downloaded)
 		{
 			auto dl=format_si(downloaded, false);
@@ -414,11 +789,11 @@ void agenda::draw_stats()
 	uint64_t el = get_elapsed_millis();
 
 	std::cerr << "time taken [sec]: " << el/1000 << "." << el%1000 << std::endl;
-	for(auto f=cur_stats_.begin();f!=cur_stats_.end();++f)
+	for(int f=0;f<statCountersNum;++f)
 	{
-		std::string name=f->first;
-		uint64_t val=f->second;
-		if (!val) continue;
+		std::string name=stat_counter_name(stat_counter_e(f));
+		uint64_t val=get_stat_counter(stat_counter_e(f));
+		if (!val || !el) continue;
 
 		uint64_t avg = val*1000/el;
 
@@ -426,6 +801,11 @@ void agenda::draw_stats()
 				  << ", average [B/sec]: " << avg
 				  << std::endl;
 	}
+	for(int f=0;f<errorKindsNum;++f)
+		if (errors_by_kind_[f])
+			std::cerr << error_kind_name(error_kind_e(f)) << " errors: "
+					  << errors_by_kind_[f] << std::endl;
+	get_tracer().print_summary(std::cerr);
 }
 
 void agenda::print_queue()
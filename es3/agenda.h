@@ -31,6 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define AGENDA_H
 
 #include "common.h"
+#include "errors.h"
 #include <boost/enable_shared_from_this.hpp>
 //#include <condition_variable>
 
@@ -47,24 +48,65 @@ namespace es3 {
 	};
 	typedef boost::shared_ptr<segment> segment_ptr;
 
+	//Statistics counters are pre-registered so that counting on the hot
+	//path is a single atomic add without any lookups or locks.
+	enum stat_counter_e
+	{
+		statRead,
+		statCompressed,
+		statPrecompressed,
+		statDecompressed,
+		statUploaded,
+		statDownloaded,
+		statDeduplicated,
+		statCountersNum
+	};
+	const char* stat_counter_name(stat_counter_e stat);
+
+	//Counters are striped across threads, each stripe occupying its own
+	//cache line. Stripes are summed only when the counters are read.
+	#define STAT_STRIPES 16
+	#define STAT_STRIPE_ALIGN 64
+	struct stat_stripe
+	{
+		uint64_t counters_[statCountersNum];
+	} __attribute__((aligned(STAT_STRIPE_ALIGN)));
+
 	enum task_type_e
 	{
 		taskUnbound,
 		taskCPUBound,
 		taskIOBound,
+
+		taskTypesNum
 	};
 
 	class sync_task
 	{
+		int64_t ordinal_;
+		bool has_ordinal_;
+		int attempts_; //Number of failed attempts, updated by the agenda
+		friend class agenda;
 	public:
+		sync_task() : ordinal_(), has_ordinal_(), attempts_() {}
 		virtual ~sync_task() {}
 
 		virtual task_type_e get_class() const { return taskUnbound; }
 		virtual size_t needs_segments() const { return 0; }
+		//Tasks with lower ordinals are run first. Tasks without an explicit
+		//ordinal inherit it from the task that schedules them, so all the
+		//work for one file shares the file's position in the queue.
 		virtual int64_t ordinal() const
 		{
-			return 0;
+			return ordinal_;
+		}
+		void set_ordinal(int64_t ordinal)
+		{
+			ordinal_=ordinal;
+			has_ordinal_=true;
 		}
+		bool has_ordinal() const { return has_ordinal_; }
+		int attempts() const { return attempts_; }
 		virtual void operator()(agenda_ptr agenda,
 								const std::vector<segment_ptr> &segments)
 		{
@@ -72,67 +114,199 @@ namespace es3 {
 			operator ()(agenda);
 		}
 		virtual void operator()(agenda_ptr agenda){}
+		//Runs the task. Expected failures (e.g. throttling) can be
+		//returned instead of thrown, that's much cheaper when a slow
+		//server makes thousands of requests fail.
+		virtual result_code_t execute(agenda_ptr agenda,
+									  const std::vector<segment_ptr> &segments)
+		{
+			(*this)(agenda, segments);
+			return sok;
+		}
 		virtual void print_to(std::ostream &str) = 0;
+	protected:
+		//Tasks that resume from the point of failure call this when they
+		//make progress, so the retry limit and the backoff apply to each
+		//step rather than to the whole task
+		void reset_attempts() { attempts_=0; }
 	};
 	typedef boost::shared_ptr<sync_task> sync_task_ptr;
 
+	/**
+	  A task that schedules a long series of tasks of one class, one at a
+	  time. With a queue limit it's parked while that class is congested
+	  and continues from where it stopped when the queue has room again.
+	  */
+	class producer_task : public sync_task,
+		public boost::enable_shared_from_this<producer_task>
+	{
+	public:
+		virtual task_type_e produced_class() const = 0;
+		//Schedules the next task, returns false when there's nothing left
+		virtual bool produce_next(agenda_ptr agenda) = 0;
+		virtual void operator()(agenda_ptr agenda);
+	};
+
 	inline bool operator < (sync_task_ptr p1, sync_task_ptr p2)
 	{
 		return p1->ordinal() < p2->ordinal();
 	}
 
+	class result_code_t;
+
+	enum retry_class_e
+	{
+		retryInfo, //The task asked to be restarted
+		retryTransient, //Network errors, 5xx responses
+		retryThrottled, //The server asked us to slow down
+
+		retryClassesNum
+	};
+
+	/**
+	  Failed tasks are put aside and restarted after a jittered exponential
+	  backoff, so that the worker threads are free to do other work.
+	  */
+	struct retry_policy
+	{
+		int max_attempts_[retryClassesNum];
+		uint64_t base_delay_ms_, max_delay_ms_;
+
+		retry_policy() : base_delay_ms_(1000), max_delay_ms_(60000)
+		{
+			max_attempts_[retryInfo]=10;
+			max_attempts_[retryTransient]=10;
+			max_attempts_[retryThrottled]=20;
+		}
+	};
+
+	//Delayed tasks are kept in a timer wheel with this resolution
+	#define RETRY_TICK_MS 100
+	#define RETRY_WHEEL_SLOTS 512
+
+	//Point-in-time view of the agenda, used to export metrics
+	struct agenda_metrics
+	{
+		size_t queued_[taskTypesNum], running_[taskTypesNum];
+		uint64_t done_[taskTypesNum], failed_[taskTypesNum];
+		uint64_t submitted_, retries_;
+		uint64_t errors_[errorKindsNum];
+		size_t retrying_;
+		size_t segments_in_flight_, max_segments_in_flight_;
+		uint64_t elapsed_millis_;
+		uint64_t stats_[statCountersNum];
+	};
+
 	class agenda : public boost::enable_shared_from_this<agenda>
 	{
 		std::map<task_type_e, size_t> class_limits_;
 		const size_t max_segments_in_flight_, segment_size_;
 		const bool quiet_, final_quiet_;
+		bool pin_threads_;
 		struct timespec start_time_;
 
 		mutex_t m_; //This mutex protects the following data {
-		boost::condition_variable condition_;
+		//Each task class has its own pool of threads
+		boost::condition_variable conditions_[taskTypesNum];
+		//Signalled when the last task of a run() is done
+		boost::condition_variable phase_done_;
+		//The workers are started by the first run() and are kept until
+		//the agenda is destroyed, they only take tasks inside run()
+		std::vector<boost::shared_ptr<boost::thread> > workers_;
+		bool running_, shutdown_;
 		typedef std::multimap<int64_t, sync_task_ptr> task_map_t;
 		typedef std::map<task_type_e, task_map_t> task_by_class_t;
 		typedef std::map<size_t, task_by_class_t> size_map_t;
 		std::map<size_t, task_by_class_t> tasks_;
 		std::map<task_type_e, size_t> classes_;
+		size_t queued_[taskTypesNum];
 		size_t num_working_;
+		//With a queue limit, producers of a class with too many queued
+		//tasks are held back until the queue is drained to the half
+		size_t queue_limit_;
+		boost::condition_variable room_;
+		std::vector<sync_task_ptr> parked_[taskTypesNum];
+		size_t num_parked_;
 		size_t segments_in_flight_;
+		struct delayed_task
+		{
+			uint64_t due_tick_;
+			sync_task_ptr task_;
+		};
+		std::vector<delayed_task> retry_wheel_[RETRY_WHEEL_SLOTS];
+		uint64_t retry_tick_;
+		size_t num_delayed_;
+		retry_policy retry_policy_;
 		//}
 
-		mutex_t stats_m_; //This mutex protects the following data {
-		size_t num_submitted_, num_done_, num_failed_;
-		std::map<std::string, std::pair<uint64_t, uint64_t> > progress_;
-		std::map<std::string, uint64_t> cur_stats_;
-		//}
+		//Updated atomically, no locks are needed
+		uint64_t num_submitted_, num_done_, num_failed_, num_retries_;
+		uint64_t done_by_class_[taskTypesNum], failed_by_class_[taskTypesNum];
+		uint64_t errors_by_kind_[errorKindsNum];
+		//Allocated separately: plain new doesn't honor the alignment
+		stat_stripe *stats_;
 
 		friend struct segment_deleter;
 	public:
 		agenda(size_t num_unbound, size_t num_cpu_bound,
 			   size_t num_io_bound, bool quiet, bool final_quiet,
 			   size_t def_segment_size, size_t max_segments_in_flight_);
+		~agenda();
 
 		size_t get_capability(task_type_e tp) const
 		{
 			return class_limits_.at(tp);
 		}
+		//Blocks the callers outside of the agenda's threads while the
+		//queue of the task's class is full (the workers are never blocked)
 		void schedule(sync_task_ptr task);
+		//Lets the workers take tasks while more are being scheduled, so
+		//that a bounded queue can be drained. run() waits for the end.
+		void begin_run();
+		//Runs the scheduled tasks (and the ones they schedule) to the end.
+		//The threads and their connections are reused by the next call.
 		size_t run();
+		//Maximum number of queued tasks per class, 0 means no limit
+		void set_queue_limit(size_t limit);
+		size_t queue_limit() const { return queue_limit_; }
+		//Called by a producer running on a worker before it schedules
+		//a task of the given class. If the class is congested the
+		//producer is put aside and rescheduled once it's drained.
+		bool park_if_congested(sync_task_ptr producer, task_type_e cls);
+		void set_retry_policy(const retry_policy &policy);
+		//Pins the thread pools to NUMA nodes if there's more than one
+		void set_affinity(bool pin_threads) { pin_threads_=pin_threads; }
 
-		void add_stat_counter(const std::string &stat, uint64_t val);
+		void add_stat_counter(stat_counter_e stat, uint64_t val);
+		uint64_t get_stat_counter(stat_counter_e stat) const;
+		agenda_metrics get_metrics();
 
 		size_t max_in_flight() const { return max_segments_in_flight_; }
 		size_t segment_size() const { return segment_size_; }
 
+		uint64_t get_elapsed_millis() const;
+
 		void print_queue();
 		void print_epilog();
 		size_t tasks_count() const { return tasks_.size(); }
 	private:
 		std::vector<segment_ptr> get_segments(size_t num);
+		void start_workers();
+		void enqueue(sync_task_ptr task);
+		void notify_all_classes(bool all_threads);
+		//Both must be called with m_ held
+		bool retry_later(sync_task_ptr task, const result_code_t &code);
+		void advance_retries();
+		void on_claimed(task_type_e cls);
+		bool is_finished() const
+		{
+			return tasks_.empty() && num_working_==0 && num_delayed_==0 &&
+					num_parked_==0;
+		}
 
 		void draw_progress();
 		void draw_progress_widget();
 		void draw_stats();
-		uint64_t get_elapsed_millis() const;
 		std::pair<std::string, std::string> format_si(uint64_t val,
 													  bool per_sec);
 
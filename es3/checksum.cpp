@@ -0,0 +1,214 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "checksum.h"
+#include "errors.h"
+#include <openssl/evp.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+using namespace es3;
+
+#define CRC32C_POLY 0x82F63B78
+
+namespace
+{
+	struct crc32c_table
+	{
+		uint32_t table_[256];
+
+		crc32c_table()
+		{
+			for(uint32_t f=0;f<256;++f)
+			{
+				uint32_t crc=f;
+				for(int k=0;k<8;++k)
+					crc=(crc&1) ? (crc>>1)^CRC32C_POLY : crc>>1;
+				table_[f]=crc;
+			}
+		}
+	};
+	const crc32c_table sw_table;
+}
+
+uint32_t es3::crc32c(uint32_t crc, const char *data, size_t len)
+{
+	const unsigned char *ptr=reinterpret_cast<const unsigned char*>(data);
+	crc=~crc;
+#ifdef __SSE4_2__
+	//Align the input, then eat it 8 bytes at a time
+	while(len>0 && (reinterpret_cast<uintptr_t>(ptr)&7)!=0)
+	{
+		crc=_mm_crc32_u8(crc, *ptr++);
+		len--;
+	}
+#ifdef __x86_64__
+	uint64_t crc64=crc;
+	while(len>=8)
+	{
+		crc64=_mm_crc32_u64(crc64, *reinterpret_cast<const uint64_t*>(ptr));
+		ptr+=8;
+		len-=8;
+	}
+	crc=uint32_t(crc64);
+#endif
+	while(len>=4)
+	{
+		crc=_mm_crc32_u32(crc, *reinterpret_cast<const uint32_t*>(ptr));
+		ptr+=4;
+		len-=4;
+	}
+	while(len>0)
+	{
+		crc=_mm_crc32_u8(crc, *ptr++);
+		len--;
+	}
+#else
+	while(len>0)
+	{
+		crc=sw_table.table_[(crc^*ptr++)&0xFF]^(crc>>8);
+		len--;
+	}
+#endif
+	return ~crc;
+}
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum=0;
+	for(;vec;vec>>=1, mat++)
+		if (vec&1)
+			sum^=*mat;
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	for(int n=0;n<32;++n)
+		square[n]=gf2_matrix_times(mat, mat[n]);
+}
+
+uint32_t es3::crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	//This is the zlib's crc32_combine() with the Castagnoli polynomial
+	if (len2==0)
+		return crc1;
+
+	uint32_t even[32], odd[32];
+	odd[0]=CRC32C_POLY; //Operator for one zero bit
+	uint32_t row=1;
+	for(int n=1;n<32;++n)
+	{
+		odd[n]=row;
+		row<<=1;
+	}
+	gf2_matrix_square(even, odd); //Two zero bits
+	gf2_matrix_square(odd, even); //Four zero bits
+
+	//Apply len2 zero bytes to crc1
+	do
+	{
+		gf2_matrix_square(even, odd);
+		if (len2&1)
+			crc1=gf2_matrix_times(even, crc1);
+		len2>>=1;
+		if (len2==0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2&1)
+			crc1=gf2_matrix_times(odd, crc1);
+		len2>>=1;
+	} while(len2!=0);
+
+	return crc1^crc2;
+}
+
+std::string part_digest::md5_hex() const
+{
+	assert(valid_);
+	return tobinhex(md5_, sizeof(md5_));
+}
+
+std::string part_digest::md5_base64() const
+{
+	assert(valid_);
+	return base64_encode(reinterpret_cast<const char*>(md5_), sizeof(md5_));
+}
+
+std::string part_digest::crc32c_base64() const
+{
+	assert(valid_);
+	//S3 expects the big-endian representation
+	char buf[4]={char(crc32c_>>24), char(crc32c_>>16),
+				 char(crc32c_>>8), char(crc32c_)};
+	return base64_encode(buf, 4);
+}
+
+digest_builder::digest_builder() : md5_ctx_(EVP_MD_CTX_new()), crc_()
+{
+	if (!md5_ctx_ || !EVP_DigestInit_ex(md5_ctx_, EVP_md5(), NULL))
+		err(errFatal) << "Can't initialize MD5 digest";
+}
+
+digest_builder::~digest_builder()
+{
+	EVP_MD_CTX_free(md5_ctx_);
+}
+
+void digest_builder::update(const char *data, size_t len)
+{
+	EVP_DigestUpdate(md5_ctx_, data, len);
+	crc_=crc32c(crc_, data, len);
+}
+
+part_digest digest_builder::finish()
+{
+	part_digest res;
+	unsigned int md_len=0;
+	EVP_DigestFinal_ex(md5_ctx_, res.md5_, &md_len);
+	assert(md_len==sizeof(res.md5_));
+	res.crc32c_=crc_;
+	res.valid_=true;
+	return res;
+}
+
+part_digest es3::compute_digest(const char *data, size_t len)
+{
+	//Feed both digests in cache-sized chunks
+	digest_builder builder;
+	for(size_t offset=0;offset<len;offset+=65536)
+		builder.update(data+offset, std::min(len-offset, size_t(65536)));
+	return builder.finish();
+}
@@ -0,0 +1,90 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "common.h"
+#include <stdint.h>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+namespace es3 {
+
+	enum checksum_e
+	{
+		checksumNone,
+		checksumCRC32C,
+	};
+
+	/**
+	  CRC32C (Castagnoli) in the zlib convention: pass 0 as the initial
+	  value and the previous result to continue a running checksum.
+	  */
+	ES3LIB_PUBLIC uint32_t crc32c(uint32_t crc, const char *data, size_t len);
+	/**
+	  Computes crc32c(A+B) from crc32c(A), crc32c(B) and the length of B.
+	  */
+	ES3LIB_PUBLIC uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2,
+										  uint64_t len2);
+
+	struct part_digest
+	{
+		unsigned char md5_[16];
+		uint32_t crc32c_;
+		bool valid_;
+
+		part_digest() : crc32c_(), valid_(false) {}
+
+		std::string md5_hex() const;
+		std::string md5_base64() const;
+		std::string crc32c_base64() const;
+	};
+
+	/**
+	  Computes MD5 and CRC32C of a part in a single pass over the data.
+	  */
+	class digest_builder
+	{
+		EVP_MD_CTX *md5_ctx_;
+		uint32_t crc_;
+
+		digest_builder(const digest_builder&);
+		digest_builder& operator = (const digest_builder&);
+	public:
+		digest_builder();
+		~digest_builder();
+
+		void update(const char *data, size_t len);
+		part_digest finish();
+	};
+
+	ES3LIB_PUBLIC part_digest compute_digest(const char *data, size_t len);
+}; //namespace es3
+
+#endif //CHECKSUM_H
@@ -29,6 +29,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "commands.h"
 #include "connection.h"
 #include "sync.h"
+#include "listing_cache.h"
+#include "inventory.h"
 #include <iostream>
 #include <boost/program_options.hpp>
 #include "errors.h"
@@ -36,13 +38,35 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 using namespace es3;
 namespace po = boost::program_options;
 
+int es3::term_width = 80;
+
+#define INVENTORY_HELP "Read the remote tree from the S3 Inventory report " \
+	"instead of listing it. Either the manifest.json of the report or " \
+	"its CSV data file (local or s3://), can be given several times."
+#define INVENTORY_RELIST_HELP "Directory under the remote path to list " \
+	"on top of the inventory report, e.g. the one with the objects " \
+	"written after the report was made."
+
 int es3::do_rsync(context_ptr context, const stringvec& params,
 			 agenda_ptr ag, bool help)
 {
 	po::options_description opts("Sync options", term_width);
-	stringvec included, excluded;
+	stringvec included, excluded, priorities, deadlines, inventory, relist;
+	std::string order;
 	opts.add_options()
 		("delete-missing,D", "Delete missing files from the sync destination")
+		("order", po::value<std::string>(&order)->default_value("fifo"),
+			"Order in which files are transferred [fifo - as they are found, "
+			"files - finish files one by one, smallest - smallest files "
+			"first, deadline - earliest deadline first]")
+		("priority", po::value<stringvec>(&priorities),
+			"Priority of the files matching the pattern in PATTERN:NUMBER "
+			"format. Files with higher priorities are transferred first, "
+			"the default priority is 0.")
+		("deadline", po::value<stringvec>(&deadlines),
+			"Deadline of the files matching the pattern in PATTERN:SECONDS "
+			"format, used with '--order deadline'. Files without a "
+			"deadline are transferred last.")
 		("exclude-path,E", po::value<stringvec>(&excluded),
 			"Exclude the paths matching the pattern from synchronization. "
 			"If set, all matching files will be excluded even if they match "
@@ -51,6 +75,9 @@ int es3::do_rsync(context_ptr context, const stringvec& params,
 			"Include the paths matching the pattern for synchronization. "
 			"If set, only the matching paths will be included in "
 			"synchronization.")
+		("inventory", po::value<stringvec>(&inventory), INVENTORY_HELP)
+		("inventory-relist", po::value<stringvec>(&relist),
+			INVENTORY_RELIST_HELP)
 	;
 
 	if (help)
@@ -94,6 +121,25 @@ int es3::do_rsync(context_ptr context, const stringvec& params,
 
 	bool delete_missing=vm.count("delete-missing");
 
+	schedule_policy policy;
+	if (order=="fifo")
+		policy.set_order(orderFifo);
+	else if (order=="files")
+		policy.set_order(orderFiles);
+	else if (order=="smallest")
+		policy.set_order(orderSmallest);
+	else if (order=="deadline")
+		policy.set_order(orderDeadline);
+	else
+	{
+		std::cerr << "ERR: Unknown order: " << order << std::endl;
+		return 2;
+	}
+	for(auto iter=priorities.begin();iter!=priorities.end();++iter)
+		policy.add_priority(*iter);
+	for(auto iter=deadlines.begin();iter!=deadlines.end();++iter)
+		policy.add_deadline(*iter);
+
 	s3_connection conn(context);
 	std::vector<s3_path> remotes;
 	stringvec locals;
@@ -147,6 +193,8 @@ int es3::do_rsync(context_ptr context, const stringvec& params,
 	{
 		synchronizer sync(ag, context, remotes, locals, do_upload,
 						  delete_missing, included, excluded);
+		sync.set_policy(policy);
+		sync.set_inventory(inventory, relist);
 		if (!sync.create_schedule(false, false, false))
 		{
 			std::cerr << "ERR: <SOURCE> not found.\n";
@@ -384,41 +432,77 @@ static void get_size(s3_directory_ptr cur, stat_struct *out)
 int es3::do_du(context_ptr context, const stringvec& params,
 		 agenda_ptr ag, bool help)
 {
+	po::options_description opts("du options", term_width);
+	stringvec inventory, relist;
+	opts.add_options()
+		("inventory", po::value<stringvec>(&inventory), INVENTORY_HELP)
+		("inventory-relist", po::value<stringvec>(&relist),
+			INVENTORY_RELIST_HELP)
+	;
+
 	if (help)
 	{
-		std::cout << "Test syntax: es3 du <PATH>\n"
+		std::cout << "Test syntax: es3 du [OPTIONS] <PATH>\n"
 				  << "where <PATH> is:\n"					 
 				  << "\t - Amazon S3 storage (in s3://<bucket>/path/ format)"
 				  << std::endl << std::endl;
+		std::cout << opts;
 		return 0;
 	}
-	if (params.size()!=1)
+
+	po::positional_options_description pos;
+	pos.add("<ARGS>", -1);
+	stringvec args;
+	opts.add_options()
+			("<ARGS>", po::value<stringvec>(&args)->multitoken()->required())
+	;
+	po::variables_map vm;
+	try
+	{
+		po::store(po::command_line_parser(params)
+			.options(opts).positional(pos).run(), vm);
+		po::notify(vm);
+	} catch(const boost::program_options::error &err)
+	{
+		std::cerr << "ERR: Failed to parse configuration options. Error: "
+				  << err.what() << "\n"
+				  << "Use --help for help\n";
+		return 2;
+	}
+	if (args.size()!=1)
 	{
 		std::cerr << "ERR: <PATH> must be specified.\n";
 		return 2;
 	}
 	
-	std::string tgt = params.at(0);		
+	std::string tgt = args.at(0);		
 	s3_connection conn(context);
 
 	s3_path path = parse_path(tgt);
 	std::string region=conn.find_region(path.bucket_);
 	path.zone_=region;
 
-	//Do recursive ls
-	s3_directory_ptr cur_root=schedule_recursive_walk(path, context, ag);
-	
-	int res=ag->run();
-	if (res!=0)
-		return res;
+	s3_directory_ptr cur_root;
+	if (!inventory.empty())
+		cur_root=load_inventory(context, ag, path, inventory, relist);
+	else
+	{
+		//Do recursive ls
+		cur_root=schedule_recursive_walk(path, context, ag);
+		int res=ag->run();
+		if (res!=0)
+			return res;
+	}
 	
-	if (ag->tasks_count())
+	if (!cur_root || ag->tasks_count())
 	{
 		ag->print_epilog(); //Print stats, so they're at least visible
 		std::cerr << "ERR: ";
 		ag->print_queue();
 		return 4;
 	}
+	if (context->listing_cache_ && inventory.empty())
+		context->listing_cache_->save(path, cur_root);
 	
 	//Calculate total size and print it
 	stat_struct st={0};
@@ -432,17 +516,22 @@ int es3::do_du(context_ptr context, const stringvec& params,
 	return 0;
 }
 
+static void fill_file_info(s3_connection &conn, s3_file_ptr file)
+{
+	file_desc mod=conn.find_mtime_and_size(file->absolute_name_);
+	file->desc_mtime_=mod.mtime_;
+	file->desc_raw_size_=mod.raw_size_;
+	file->has_desc_=mod.found_;
+}
+
 class get_file_info: public sync_task,
 		public boost::enable_shared_from_this<get_file_info>
 {
-	const s3_path path_;
+	s3_file_ptr file_;
 	context_ptr context_;
-	std::map<s3_path, file_desc> &desc_map_;
-	mutex_t &mtx_;
 public:
-	get_file_info(const s3_path &path, context_ptr context,
-				  std::map<s3_path, file_desc> &desc, mutex_t &mtx) :
-		path_(path), context_(context), desc_map_(desc), mtx_(mtx)
+	get_file_info(s3_file_ptr file, context_ptr context) :
+		file_(file), context_(context)
 	{
 	}
 
@@ -450,19 +539,23 @@ public:
 
 	virtual void print_to(std::ostream &str)
 	{
-		str << "Get info about " << path_;
+		str << "Get info about " << file_->absolute_name_;
 	}
 
 	virtual void operator()(agenda_ptr agenda)
 	{
 		s3_connection conn(context_);
-		file_desc mod=conn.find_mtime_and_size(path_);
-		
-		guard_t lock(mtx_);
-		desc_map_[path_] = mod;
+		fill_file_info(conn, file_);
 	}
 };
 
+static void print_file_info(s3_file_ptr file)
+{
+	std::cout << file->desc_mtime_
+			  << "\t"<< file->desc_raw_size_
+			  << "\t" << file->absolute_name_ << std::endl;
+}
+
 int es3::do_ls(context_ptr context, const stringvec& params,
 		 agenda_ptr ag, bool help)
 {
@@ -487,9 +580,20 @@ int es3::do_ls(context_ptr context, const stringvec& params,
 	std::string region=conn.find_region(path.bucket_);
 	path.zone_=region;
 
-	//Do non-recursive ls
-	s3_directory_ptr cur=conn.list_files_shallow(
-				path, s3_directory_ptr(), true);
+	listing_cache_ptr cache=context->listing_cache_;
+	s3_directory_ptr snapshot=cache ? cache->load(path) : s3_directory_ptr();
+	s3_directory_ptr cur;
+	if (snapshot && snapshot->listed_at_ &&
+			snapshot->listed_at_>=cache->fresh_after())
+		cur=snapshot;
+	else
+	{
+		//Do non-recursive ls
+		cur=conn.list_files_shallow(path, s3_directory_ptr(), true);
+		if (snapshot)
+			merge_snapshot(cur, snapshot);
+	}
+
 	size_t files=0, dirs=0;
 	uint64_t total=0;
 	for(auto iter=cur->subdirs_.begin(); iter!=cur->subdirs_.end();++iter)
@@ -498,16 +602,16 @@ int es3::do_ls(context_ptr context, const stringvec& params,
 		dirs++;
 	}
 	
-	if (cur->files_.size()>10)
+	//Objects that haven't changed since the snapshot keep their metadata
+	std::vector<s3_file_ptr> unknown;
+	for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
+		if (!iter->second->has_desc_)
+			unknown.push_back(iter->second);
+
+	if (unknown.size()>10)
 	{
-		std::map<s3_path, file_desc> desc_map;
-		mutex_t desc_mtx;	
-		for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
-		{
-			sync_task_ptr tsk(new get_file_info(iter->second->absolute_name_,
-												context, desc_map, desc_mtx));
-			ag->schedule(tsk);
-		}
+		for(auto iter=unknown.begin(); iter!=unknown.end();++iter)
+			ag->schedule(sync_task_ptr(new get_file_info(*iter, context)));
 		int res=ag->run();
 		if (res!=0)
 			return res;
@@ -519,30 +623,20 @@ int es3::do_ls(context_ptr context, const stringvec& params,
 			ag->print_queue();
 			return 4;
 		}
-		
-		for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
-		{
-			s3_path remote_name = iter->second->absolute_name_;
-			const file_desc &mod=desc_map.at(remote_name);
-			std::cout << mod.mtime_
-					  << "\t"<< mod.raw_size_
-					  << "\t" << remote_name << std::endl;
-			files++;
-			total+=iter->second->size_;
-		}
 	} else
 	{
-		for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
-		{
-			s3_path remote_name = iter->second->absolute_name_;
-			file_desc mod=conn.find_mtime_and_size(remote_name);
-			std::cout << mod.mtime_
-					  << "\t"<< mod.raw_size_
-					  << "\t" << remote_name << std::endl;
-			files++;
-			total+=iter->second->size_;
-		}		
+		for(auto iter=unknown.begin(); iter!=unknown.end();++iter)
+			fill_file_info(conn, *iter);
+	}
+
+	for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
+	{
+		print_file_info(iter->second);
+		files++;
+		total+=iter->second->size_;
 	}
+	if (cache && (cur!=snapshot || !unknown.empty()))
+		cache->save(path, cur);
 	
 	std::cout<<"Total files: " << files << std::endl;
 	std::cout<<"Total directories: " << dirs << std::endl;
@@ -628,11 +722,106 @@ int es3::do_publish(context_ptr context, const stringvec& params,
 	return 0;	
 }
 
+static int report_failure(agenda_ptr ag)
+{
+    ag->print_epilog(); //Print stats, so they're at least visible
+    std::cerr << "ERR: ";
+    ag->print_queue();
+    return 4;
+}
+
+//Runs the scheduled tasks, returns a non-zero code if some have failed
+static int run_checked(agenda_ptr ag)
+{
+    int res=ag->run();
+    if (res!=0)
+        return res;
+
+    if (ag->tasks_count())
+        return report_failure(ag);
+    return 0;
+}
+
+static void schedule_file_info(s3_directory_ptr dir, context_ptr context,
+                               agenda_ptr ag, const path_filter &filter)
+{
+    for(auto iter=dir->files_.begin(); iter!=dir->files_.end();++iter)
+        if (!iter->second->has_desc_ &&
+                filter.matches(iter->second->absolute_name_.path_))
+            ag->schedule(sync_task_ptr(new get_file_info(iter->second, context)));
+    for(auto iter=dir->subdirs_.begin(); iter!=dir->subdirs_.end();++iter)
+        if (filter.may_match_under(iter->second->absolute_name_.path_))
+            schedule_file_info(iter->second, context, ag, filter);
+}
+
+static size_t print_tree(s3_directory_ptr dir, const path_filter &filter)
+{
+    size_t num=0;
+    for(auto iter=dir->files_.begin(); iter!=dir->files_.end();++iter)
+        if (filter.matches(iter->second->absolute_name_.path_))
+        {
+            print_file_info(iter->second);
+            num++;
+        }
+    for(auto iter=dir->subdirs_.begin(); iter!=dir->subdirs_.end();++iter)
+        if (filter.may_match_under(iter->second->absolute_name_.path_))
+            num+=print_tree(iter->second, filter);
+    return num;
+}
+
+//Walks the listing snapshots or the inventory reports, the HEAD requests
+//are only sent for the objects that have changed since they were taken
+static int list_with_snapshots(context_ptr context, agenda_ptr ag,
+                               const stringvec &args,
+                               path_filter_ptr filter,
+                               const stringvec &inventory,
+                               const stringvec &relist)
+{
+    s3_connection conn(context);
+    std::vector<std::pair<s3_path, s3_directory_ptr> > roots;
+    for(auto iter=args.begin();iter!=args.end();++iter)
+    {
+        s3_path path = parse_path(*iter);
+        path.zone_=conn.find_region(path.bucket_);
+        if (inventory.empty())
+        {
+            roots.push_back(std::make_pair(path,
+                schedule_recursive_walk(path, context, ag, filter)));
+            continue;
+        }
+
+        s3_directory_ptr tree=load_inventory(context, ag, path,
+                                             inventory, relist, filter);
+        if (!tree)
+            return report_failure(ag);
+        roots.push_back(std::make_pair(path, tree));
+    }
+    int res=run_checked(ag);
+    if (res!=0)
+        return res;
+
+    for(auto iter=roots.begin();iter!=roots.end();++iter)
+        schedule_file_info(iter->second, context, ag, *filter);
+    res=run_checked(ag);
+    if (res!=0)
+        return res;
+
+    size_t num=0;
+    for(auto iter=roots.begin();iter!=roots.end();++iter)
+    {
+        num+=print_tree(iter->second, *filter);
+        if (context->listing_cache_ && inventory.empty())
+            context->listing_cache_->save(iter->first, iter->second);
+    }
+    std::cerr<<"Total files listed: " << num << std::endl;
+    return 0;
+}
+
 int es3::do_lsr(context_ptr context, const stringvec& params,
          agenda_ptr ag, bool help)
 {
     po::options_description opts("recursive ls options", term_width);
-    stringvec included, excluded;
+    stringvec included, excluded, inventory, relist;
     opts.add_options()
         ("exclude-path,E", po::value<stringvec>(&excluded),
             "Exclude the paths matching the pattern from listing. "
@@ -641,6 +830,9 @@ int es3::do_lsr(context_ptr context, const stringvec& params,
         ("include-path,I", po::value<stringvec>(&included),
             "Include the paths matching the pattern for listing. "
             "If set, only the matching paths will be published")
+        ("inventory", po::value<stringvec>(&inventory), INVENTORY_HELP)
+        ("inventory-relist", po::value<stringvec>(&relist),
+            INVENTORY_RELIST_HELP)
     ;
 
     if (help)
@@ -678,6 +870,11 @@ int es3::do_lsr(context_ptr context, const stringvec& params,
         return 2;
     }
 
+    if (context->listing_cache_ || !inventory.empty())
+        return list_with_snapshots(context, ag, args,
+            path_filter_ptr(new path_filter(included, excluded)),
+            inventory, relist);
+
     s3_connection conn(context);
 
     //Do recursive publication
@@ -754,7 +951,7 @@ int es3::do_mass_rm(context_ptr context, const stringvec& params,
                     VLOG(0) << ex.what();
                     break;
                 }
-            } ¡ch(const std::exception &ex)
+            } catch(const std::exception &ex)
             {
                 VLOG(0) << "ERR: " << ex.what();
                 break;
@@ -36,6 +36,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/stat.h>
 #include "scope_guard.h"
 #include "errors.h"
+#include "io_engine.h"
 
 using namespace es3;
 
@@ -64,26 +65,20 @@ namespace es3
 
 		std::pair<bf::path,uint64_t> do_compress(agenda_ptr agenda)
 		{
-			handle_t src(open(parent_->path_.c_str(), O_RDONLY)
-						 | libc_die2("Failed to open "
-									 +parent_->path_.string()
-									 +" for compression"));
-			lseek64(src.get(), offset_, SEEK_SET)
-					| libc_die2("Incorrect offset "+int_to_string(offset_)
-								+" in "+parent_->path_.string());
+			const bool direct=parent_->context_->direct_io_;
+			transfer_file src(parent_->path_, O_RDONLY, direct);
 
 			//Generate the temp name
 			bf::path tmp_nm = bf::path(parent_->context_->scratch_dir_) /
 					bf::unique_path("scratchy-%%%%-%%%%-%%%%-%%%%");
-			handle_t tmp_desc(open(tmp_nm.c_str(), O_RDWR|O_CREAT, 0600)
-							  | libc_die2("Failed to create temp file: "
-										  +tmp_nm.string()));
+			transfer_file tmp_desc(tmp_nm, O_RDWR|O_CREAT, direct);
 
 			VLOG(2) << "Compressing part " << block_num_ << " out of " <<
 					   block_total_ << " of " << parent_->path_;
 
 			z_stream stream = {0};
-			deflateInit2(&stream, 1, Z_DEFLATED,
+			deflateInit2(&stream, parent_->context_->compression_level_,
+						 Z_DEFLATED,
 							   15|16, //15 window bits | GZIP
 							   8,
 							   Z_DEFAULT_STRATEGY);
@@ -100,8 +95,11 @@ namespace es3
 			{
 				size_t chunk = std::min(uint64_t(buf.size()),
 										size_-raw_consumed);
-				ssize_t ln=read(src.get(), &buf[0], chunk) | libc_die;
-				assert(ln>0);
+				size_t ln=src.read_at(&buf[0], chunk,
+									  offset_+raw_consumed);
+				if (ln==0)
+					err(errFatal) << "File " << parent_->path_
+								  << " was truncated during compression";
 				raw_consumed+=ln;
 
 				stream.avail_in = ln;
@@ -117,7 +115,7 @@ namespace es3
 									  << parent_->path_;
 
 					size_t cur_consumed=buf_out.size() - stream.avail_out;
-					write(tmp_desc.get(), &buf_out[0], cur_consumed) | libc_die;
+					tmp_desc.write_at(&buf_out[0], cur_consumed, consumed);
 					consumed += cur_consumed;
 				} while(stream.avail_in!=0);
 			}
@@ -131,13 +129,13 @@ namespace es3
 				err(errFatal) << "Failed to finish compression of "
 							  << parent_->path_;
 			size_t cur_consumed=buf_out.size() - stream.avail_out;
-			consumed += cur_consumed;
 			if (cur_consumed!=0)
-				write(tmp_desc.get(), &buf_out[0], cur_consumed) | libc_die;
+				tmp_desc.write_at(&buf_out[0], cur_consumed, consumed);
+			consumed += cur_consumed;
 
-			agenda->add_stat_counter("compressed", consumed);
-			agenda->add_stat_counter("precompressed", size_);
-			agenda->add_stat_counter("read", size_);
+			agenda->add_stat_counter(statCompressed, consumed);
+			agenda->add_stat_counter(statPrecompressed, size_);
+			agenda->add_stat_counter(statRead, size_);
 
 			VLOG(2) << "Done compressing part " << block_num_ << " out of " <<
 					   block_total_ << " of " << parent_->path_;
@@ -204,23 +202,22 @@ void file_decompressor::operator()(agenda_ptr agenda)
 	buf.resize(1024*1024);
 	buf_out.resize(1024*1024*2);
 
-	uint64_t written_so_far=0;
-	handle_t in_fl(open(source_.c_str(), O_RDONLY) |
-				   libc_die2("Failed to decompress to "+result_.string()+
-							 ", can't open temporary file"));
+	uint64_t written_so_far=0, read_so_far=0;
+	transfer_file in_fl(source_, O_RDONLY, context_->direct_io_);
 
 	//Create the temporary output file
 	bf::path temp_name_template=result_.string()+"-%%%%%%%%%";
 	bf::path temp_out_name=bf::unique_path(temp_name_template);
 	ON_BLOCK_EXIT(&unlink, temp_out_name.c_str());
 
-	handle_t out_fl(open(temp_out_name.c_str(), O_WRONLY|O_CREAT, 0600) |
-					libc_die2("Failed to decompress to "+result_.string()));
+	transfer_file out_fl(temp_out_name, O_WRONLY|O_CREAT,
+						 context_->direct_io_);
 	while(true)
 	{
-		size_t cur_chunk=read(in_fl.get(), &buf[0], buf.size()) | libc_die;
+		size_t cur_chunk=in_fl.read_at(&buf[0], buf.size(), read_so_far);
 		if (cur_chunk==0)
 			break;
+		read_so_far+=cur_chunk;
 
 		stream.avail_in = cur_chunk;
 		stream.next_in = (Bytef*)&buf[0];
@@ -234,9 +231,9 @@ void file_decompressor::operator()(agenda_ptr agenda)
 				err(errFatal) << "GZ error, failed to decompress " << result_;
 
 			size_t to_write = buf_out.size()-stream.avail_out;
+			out_fl.write_at(&buf_out[0], to_write, written_so_far);
 			written_so_far+=to_write;
-			write(out_fl.get(), &buf_out[0], to_write) | libc_die;
-			agenda->add_stat_counter("decompressed", to_write);
+			agenda->add_stat_counter(statDecompressed, to_write);
 
 			if (res == Z_STREAM_END)
 			{
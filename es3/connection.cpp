@@ -31,10 +31,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <curl/curl.h>
 #include "errors.h"
 #include <openssl/hmac.h>
-#include <openssl/md5.h>
-#include <tinyxml.h>
+#include "xml_stream.h"
 #include "scope_guard.h"
 #include <boost/algorithm/string.hpp>
+#include <sys/time.h>
 
 using namespace es3;
 
@@ -45,6 +45,125 @@ static std::string escape(const std::string &str)
 	return std::string(res);
 }
 
+namespace es3 {
+	/**
+	  Base for the handlers of S3 replies, it picks up the error document
+	  that can come instead of any reply.
+	  */
+	class s3_reply : public xml_handler
+	{
+	public:
+		bool is_error_;
+		std::string code_, message_;
+
+		s3_reply() : is_error_() {}
+
+		virtual void on_open(const xml_text &path)
+		{
+			if (path=="Error")
+				is_error_=true;
+		}
+
+		virtual void on_close(const xml_text &path, const xml_text &text)
+		{
+			if (path=="Error/Code")
+				text.assign_to(&code_);
+			else if (path=="Error/Message")
+				text.assign_to(&message_);
+		}
+	};
+}; //namespace es3
+
+//Picks up the text of the first element with the given path
+class value_reply : public s3_reply
+{
+	const char *path_;
+public:
+	bool found_;
+	std::string value_;
+
+	value_reply(const char *path) : path_(path), found_() {}
+
+	virtual void on_close(const xml_text &path, const xml_text &text)
+	{
+		if (!found_ && path.size_==strlen(path_) &&
+				memcmp(path.data_, path_, path.size_)==0)
+		{
+			found_=true;
+			text.assign_to(&value_);
+		} else
+			s3_reply::on_close(path, text);
+	}
+};
+
+struct listing_entry
+{
+	xml_text key_;
+	uint64_t size_;
+	xml_text mtime_, etag_;
+};
+
+/**
+  ListBucketResult handler, emits the entries as soon as they are parsed.
+  Fields are collected into buffers that are reused for every entry.
+  */
+class listing_reply : public s3_reply
+{
+	std::string key_, mtime_, etag_;
+	uint64_t size_;
+	std::string last_name_, next_marker_;
+	bool truncated_;
+public:
+	listing_reply() : size_(), truncated_() {}
+
+	//Returns true and sets the marker if there are more pages
+	bool next_page(std::string *marker) const
+	{
+		*marker= next_marker_.empty() ? last_name_ : next_marker_;
+		return truncated_ && !marker->empty();
+	}
+
+	virtual void on_close(const xml_text &path, const xml_text &text)
+	{
+		if (path=="ListBucketResult/Contents/Key")
+			text.assign_to(&key_);
+		else if (path=="ListBucketResult/Contents/Size")
+			size_=text.to_uint64();
+		else if (path=="ListBucketResult/Contents/LastModified")
+			text.assign_to(&mtime_);
+		else if (path=="ListBucketResult/Contents/ETag")
+			text.assign_to(&etag_);
+		else if (path=="ListBucketResult/Contents")
+		{
+			listing_entry entry;
+			entry.key_=xml_text(key_);
+			entry.size_=size_;
+			entry.mtime_=xml_text(mtime_);
+			entry.etag_=xml_text(etag_);
+			if (!key_.empty())
+				on_entry(entry);
+			last_name_.swap(key_);
+			key_.clear();
+			mtime_.clear();
+			etag_.clear();
+			size_=0;
+		} else if (path=="ListBucketResult/CommonPrefixes/Prefix")
+		{
+			if (!text.empty())
+				on_prefix(text);
+			text.assign_to(&last_name_);
+		} else if (path=="ListBucketResult/IsTruncated")
+			truncated_= text!="false";
+		else if (path=="ListBucketResult/NextMarker")
+			text.assign_to(&next_marker_);
+		else
+			s3_reply::on_close(path, text);
+	}
+
+	virtual void on_entry(const listing_entry &entry) = 0;
+	virtual void on_prefix(const xml_text &prefix) = 0;
+};
+
 s3_path es3::parse_path(const std::string &url)
 {
 	s3_path res;
@@ -72,7 +191,7 @@ s3_path es3::parse_path(const std::string &url)
 }
 
 s3_connection::s3_connection(const context_ptr &conn_data)
-    : conn_data_(conn_data), header_list_(), num_lists_()
+    : conn_data_(conn_data), header_list_(), num_lists_(), keep_alive_()
 {
 }
 
@@ -82,65 +201,243 @@ s3_connection::~s3_connection()
 		curl_slist_free_all(header_list_);
 }
 
-void s3_connection::checked(curl_ptr_t curl, int curl_code)
+curl_ptr_t s3_connection::get_curl(const s3_path &path)
 {
-	if (curl_code!=CURLE_OK)
+	if (!keep_alive_)
+		return conn_data_->get_curl(path.zone_, path.bucket_);
+
+	std::string key=path.zone_+"/"+path.bucket_;
+	if (!pinned_ || pinned_key_!=key)
 	{
-		char* error_buffer=conn_data_->err_buf_for(curl);
-		assert(error_buffer);
-		if (strlen(error_buffer)!=0)
-		{
-			assert(strlen(error_buffer)<=CURL_ERROR_SIZE);
-			err(errWarn) << "curl error: " << error_buffer;
-		} else
-			err(errWarn) << "curl error: "
-						 << curl_easy_strerror((CURLcode)curl_code);
-        conn_data_->taint(curl);
+		pinned_=conn_data_->get_curl(path.zone_, path.bucket_);
+		pinned_key_=key;
 	}
+	return pinned_;
 }
 
-void s3_connection::check_for_errors(curl_ptr_t curl,
-									 const std::string &curl_res)
+void s3_connection::taint(curl_ptr_t curl)
+{
+	if (pinned_==curl)
+		pinned_.reset();
+	conn_data_->taint(curl);
+}
+
+static trace_op_e classify_request(const std::string &verb,
+								   const std::string &path)
+{
+	bool has_upload_id=path.find("uploadId=")!=std::string::npos;
+	if (verb=="GET")
+	{
+		if (has_upload_id)
+			return traceListParts;
+		if (path.find("?location")!=std::string::npos ||
+				path.find("?uploads")!=std::string::npos)
+			return traceOther;
+		if (path.compare(0, 2, "/?")==0)
+			return traceList;
+		return traceGet;
+	}
+	if (verb=="PUT")
+	{
+		//Part uploads with data go through upload_data
+		if (has_upload_id)
+			return traceCopyPart;
+		return path.find("?acl")!=std::string::npos ? traceOther : tracePut;
+	}
+	if (verb=="POST")
+	{
+		if (path.find("?uploads")!=std::string::npos)
+			return traceInitiate;
+		return has_upload_id ? traceComplete : traceOther;
+	}
+	if (verb=="HEAD")
+		return traceHead;
+	if (verb=="DELETE" && !has_upload_id)
+		return traceDelete;
+	return traceOther;
+}
+
+static uint64_t info_micros(CURL *curl, CURLINFO info)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+	curl_off_t val=0;
+	if (curl_easy_getinfo(curl, info, &val)!=CURLE_OK || val<0)
+		return 0;
+	return val;
+#else
+	double val=0;
+	if (curl_easy_getinfo(curl, info, &val)!=CURLE_OK || val<0)
+		return 0;
+	return uint64_t(val*1000000);
+#endif
+}
+
+static uint64_t delta(uint64_t to, uint64_t from)
+{
+	return to>from ? to-from : 0;
+}
+
+result_code_t s3_connection::try_perform(curl_ptr_t curl, trace_op_e op,
+										 const s3_path &path)
+{
+	struct timeval start={0};
+	gettimeofday(&start, NULL);
+	int curl_code=curl_easy_perform(curl.get());
+
+	CURL *c=curl.get();
+	request_timing t;
+	t.op_=op;
+	t.path_="s3://"+path.bucket_+path.path_;
+	t.status_=0;
+	curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &t.status_);
+	t.curl_code_=curl_code;
+	t.start_=start.tv_sec+start.tv_usec/1000000.0;
+
+	//Curl reports the times from the start of the request
+#if LIBCURL_VERSION_NUM >= 0x073d00
+	uint64_t dns=info_micros(c, CURLINFO_NAMELOOKUP_TIME_T);
+	uint64_t connect=info_micros(c, CURLINFO_CONNECT_TIME_T);
+	uint64_t tls=info_micros(c, CURLINFO_APPCONNECT_TIME_T);
+	uint64_t first_byte=info_micros(c, CURLINFO_STARTTRANSFER_TIME_T);
+	uint64_t total=info_micros(c, CURLINFO_TOTAL_TIME_T);
+	curl_off_t up=0, down=0;
+	curl_easy_getinfo(c, CURLINFO_SIZE_UPLOAD_T, &up);
+	curl_easy_getinfo(c, CURLINFO_SIZE_DOWNLOAD_T, &down);
+#else
+	uint64_t dns=info_micros(c, CURLINFO_NAMELOOKUP_TIME);
+	uint64_t connect=info_micros(c, CURLINFO_CONNECT_TIME);
+	uint64_t tls=info_micros(c, CURLINFO_APPCONNECT_TIME);
+	uint64_t first_byte=info_micros(c, CURLINFO_STARTTRANSFER_TIME);
+	uint64_t total=info_micros(c, CURLINFO_TOTAL_TIME);
+	double up=0, down=0;
+	curl_easy_getinfo(c, CURLINFO_SIZE_UPLOAD, &up);
+	curl_easy_getinfo(c, CURLINFO_SIZE_DOWNLOAD, &down);
+#endif
+	t.dns_=dns;
+	t.connect_=delta(connect, dns);
+	t.tls_=tls ? delta(tls, connect) : 0;
+	t.wait_=delta(first_byte, std::max(connect, tls));
+	t.transfer_=delta(total, first_byte);
+	t.total_=total;
+	t.bytes_up_=uint64_t(up);
+	t.bytes_down_=uint64_t(down);
+	get_tracer().record(t);
+
+	return try_checked(curl, curl_code);
+}
+
+void s3_connection::perform(curl_ptr_t curl, trace_op_e op,
+							const s3_path &path)
+{
+	try_perform(curl, op, path) | die;
+}
+
+result_code_t s3_connection::try_checked(curl_ptr_t curl, int curl_code)
+{
+	if (curl_code==CURLE_OK)
+		return sok;
+
+	taint(curl);
+	error_kind_e kind= curl_code==CURLE_OPERATION_TIMEDOUT ?
+				kindTimeout : kindNetwork;
+	char* error_buffer=conn_data_->err_buf_for(curl);
+	assert(error_buffer);
+	if (strlen(error_buffer)!=0)
+	{
+		assert(strlen(error_buffer)<=CURL_ERROR_SIZE);
+		return result_code_t(errWarn, std::string("curl error: ")+
+							 error_buffer, -1, kind);
+	}
+	return result_code_t(errWarn, std::string("curl error: ")+
+			curl_easy_strerror((CURLcode)curl_code), -1, kind);
+}
+
+void s3_connection::checked(curl_ptr_t curl, int curl_code)
+{
+	if (curl_code!=CURLE_OK)
+		try_checked(curl, curl_code) | die;
+}
+
+long s3_connection::response_code(curl_ptr_t curl)
 {
 	long code=400;
 	checked(curl,
 			curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &code));
+	return code;
+}
+
+void s3_connection::check_for_errors(curl_ptr_t curl,
+									 const std::string &curl_res)
+{
+	try_check_for_errors(curl, curl_res) | die;
+}
+
+void s3_connection::check_for_errors(curl_ptr_t curl, const s3_reply &reply)
+{
+	try_check_for_errors(curl, reply) | die;
+}
+
+result_code_t s3_connection::try_check_for_errors(curl_ptr_t curl,
+												  const std::string &curl_res)
+{
+	if (response_code(curl)<400)
+		return sok;
+	s3_reply reply;
+	parse_xml(curl_res, &reply);
+	return try_check_for_errors(curl, reply);
+}
+
+result_code_t s3_connection::try_check_for_errors(curl_ptr_t curl,
+												  const s3_reply &reply)
+{
+	long code=response_code(curl);
 	if (code<400)
-        return;
+        return sok;
 
-    conn_data_->taint(curl);
+    taint(curl);
 
 	code_e err_level=errFatal;
+	error_kind_e kind=kindGeneric;
 	if (code>=500)
+	{
 		err_level=errWarn;
-	std::string def_error="HTTP code "+int_to_string(code)+" received.";
-
-	TiXmlDocument doc;
-	doc.Parse(curl_res.c_str());
-	if (!doc.Error())
-	{
-		TiXmlHandle docHandle(&doc);
-		TiXmlNode *s3_err_code=docHandle.FirstChild("Error")
-				.FirstChild("Code")
-				.FirstChild()
-				.ToText();
-		TiXmlNode *message=docHandle.FirstChild("Error")
-				.FirstChild("Message")
-				.FirstChild()
-				.ToText();
-		
-		//Workaround for timeouts
-		std::string msg_val = message->Value();
-		std::string err_code = s3_err_code->Value();
-		if (msg_val.find("Idle connections will be closed")!=-1)
-			err_level=errWarn; //Lower error level
-		if (msg_val.find("NoSuchUpload")!=-1)
-			err_level=errWarn; //Lower error level
-		
-		if (s3_err_code && message)
-			err(err_level) << "" << err_code << " - " << msg_val;
-	} else
-		err(err_level) << "" << def_error;
+		kind=kindServer;
+	}
+
+	//Throttling, the agenda backs off for longer
+	int retry_after=-1;
+	if (code==503 || reply.code_=="SlowDown")
+	{
+		err_level=errWarn;
+		kind=kindThrottled;
+		retry_after=0;
+#if LIBCURL_VERSION_NUM >= 0x074200
+		curl_off_t hint=0;
+		if (curl_easy_getinfo(curl.get(), CURLINFO_RETRY_AFTER,
+							  &hint)==CURLE_OK && hint>0)
+			retry_after=int(hint);
+#endif
+	}
+
+	if (!reply.is_error_ || reply.code_.empty())
+		return result_code_t(err_level, "HTTP code "+int_to_string(code)+
+							 " received.", retry_after, kind);
+
+	//Workaround for timeouts
+	const std::string &msg_val = reply.message_;
+	if (reply.code_=="RequestTimeout" ||
+			msg_val.find("Idle connections will be closed")!=-1)
+	{
+		err_level=errWarn; //Lower error level
+		kind=kindTimeout;
+	}
+	if (reply.code_=="NoSuchUpload")
+	{
+		err_level=errWarn; //Lower error level
+		kind=kindNoSuchUpload;
+	}
+	return result_code_t(err_level, reply.code_+" - "+msg_val,
+						 retry_after, kind);
 }
 
 void s3_connection::prepare(curl_ptr_t curl,
@@ -192,10 +489,19 @@ void s3_connection::set_url(curl_ptr_t curl,
 	if (cur_path.path_.empty())
 		cur_path.path_.append("/");
 
-	std::string url = conn_data_->use_ssl_?"https://" : "http://";
-	url.append(cur_path.bucket_);
-	url.append(".").append(cur_path.zone_);
-	url.append(".amazonaws.com");
+	std::string url;
+	if (!conn_data_->endpoint_.empty())
+	{
+		//Path-style addressing for S3-compatible servers
+		url = conn_data_->endpoint_;
+		url.append("/").append(cur_path.bucket_);
+	} else
+	{
+		url = conn_data_->use_ssl_?"https://" : "http://";
+		url.append(cur_path.bucket_);
+		url.append(".").append(cur_path.zone_);
+		url.append(".amazonaws.com");
+	}
 	url.append(cur_path.path_);
 	url.append(args);
 	checked(curl,
@@ -270,7 +576,7 @@ std::string s3_connection::read_fully(const std::string &verb,
 									  const header_map_t &opts)
 {
 	std::string res;
-	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
+	curl_ptr_t curl=get_curl(path);
 	prepare(curl, verb, path, opts);
 	if (!args.empty())
 		set_url(curl, path, args);
@@ -278,11 +584,99 @@ std::string s3_connection::read_fully(const std::string &verb,
 				curl.get(), CURLOPT_WRITEFUNCTION, &string_appender));
 	checked(curl,curl_easy_setopt(
 				curl.get(), CURLOPT_WRITEDATA, &res));
-	checked(curl,curl_easy_perform(curl.get()));
+	perform(curl, classify_request(verb, path.path_+args), path);
 	check_for_errors(curl, res);
 	return res;
 }
 
+struct object_feeder
+{
+	CURL *curl_;
+	const boost::function<void(const char*, size_t)> *sink_;
+	std::string error_body_, failure_;
+};
+
+static size_t object_data(const char *ptr,
+						  size_t size, size_t nmemb, void *userdata)
+{
+	object_feeder *feeder=reinterpret_cast<object_feeder*>(userdata);
+	//Error replies are kept for check_for_errors
+	long code=0;
+	curl_easy_getinfo(feeder->curl_, CURLINFO_RESPONSE_CODE, &code);
+	if (code>=300)
+	{
+		feeder->error_body_.append(ptr, size*nmemb);
+		return size*nmemb;
+	}
+
+	try
+	{
+		(*feeder->sink_)(ptr, size*nmemb);
+	} catch(const std::exception &ex)
+	{
+		feeder->failure_=ex.what();
+		return 0;
+	}
+	return size*nmemb;
+}
+
+void s3_connection::read_object(const s3_path &path,
+	const boost::function<void(const char*, size_t)> &sink)
+{
+	curl_ptr_t curl=get_curl(path);
+	object_feeder feeder={curl.get(), &sink};
+	prepare(curl, "GET", path);
+	checked(curl, curl_easy_setopt(
+				curl.get(), CURLOPT_WRITEFUNCTION, &object_data));
+	checked(curl,curl_easy_setopt(
+				curl.get(), CURLOPT_WRITEDATA, &feeder));
+	result_code_t res=try_perform(curl, traceGet, path);
+	if (!feeder.failure_.empty())
+		err(errFatal) << "Failed to process " << path << ": "
+					  << feeder.failure_;
+	res | die;
+	check_for_errors(curl, feeder.error_body_);
+}
+
+static size_t xml_feeder(const char *ptr,
+						 size_t size, size_t nmemb, void *userdata)
+{
+	xml_stream_parser *parser=reinterpret_cast<xml_stream_parser*>(userdata);
+	try
+	{
+		parser->feed(ptr, size*nmemb);
+	} catch(const std::exception &ex)
+	{
+		//Exceptions can't go through curl, abort the transfer instead
+		parser->fail(ex.what());
+		return 0;
+	}
+	return size*nmemb;
+}
+
+void s3_connection::read_streaming(const std::string &verb,
+								   const s3_path &path,
+								   const std::string &args,
+								   s3_reply *reply,
+								   const header_map_t &opts)
+{
+	xml_stream_parser parser(reply);
+	curl_ptr_t curl=get_curl(path);
+	prepare(curl, verb, path, opts);
+	if (!args.empty())
+		set_url(curl, path, args);
+	checked(curl, curl_easy_setopt(
+				curl.get(), CURLOPT_WRITEFUNCTION, &xml_feeder));
+	checked(curl,curl_easy_setopt(
+				curl.get(), CURLOPT_WRITEDATA, &parser));
+	perform(curl, classify_request(verb, path.path_+args), path);
+	bool parsed=parser.finish();
+	check_for_errors(curl, *reply);
+	if (!parsed)
+		err(errWarn) << "Bad document received for " << path << ": "
+					 << parser.error();
+}
+
 static std::string extract_leaf(const std::string &path)
 {
 	size_t idx=path.find_last_of('/');
@@ -298,8 +692,52 @@ static void decrement(int *ptr, mutex_t *mtx, boost::condition_variable *cv)
     cv->notify_all();
 }
 
+//Puts the listed files and subdirectories into the directory
+class directory_reply : public listing_reply
+{
+	s3_directory_ptr target_;
+public:
+	directory_reply(s3_directory_ptr target) : target_(target) {}
+
+	virtual void on_entry(const listing_entry &entry)
+	{
+		//Yes, Virginia, there are directory-like-files in S3
+		if (entry.key_.data_[entry.key_.size_-1]=='/')
+			return;
+		s3_file_ptr fl(new s3_file());
+		fl->name_ = extract_leaf(entry.key_.str());
+		fl->absolute_name_=derive(target_->absolute_name_, fl->name_);
+		fl->size_ = entry.size_;
+		fl->mtime_str_ = entry.mtime_.str();
+		fl->parent_ = target_;
+		target_->files_[fl->name_]=fl;
+	}
+
+	virtual void on_prefix(const xml_text &prefix)
+	{
+		//Trim trailing '/'
+		std::string trimmed_name(prefix.data_, prefix.size_-1);
+		s3_directory_ptr dir(new s3_directory());
+		dir->name_ = extract_leaf(trimmed_name);
+		dir->absolute_name_=derive(target_->absolute_name_,
+								   dir->name_+"/");
+		dir->parent_ = target_;
+		target_->subdirs_[dir->name_] = dir;
+	}
+};
+
+bool es3::parse_listing_page(const std::string &page,
+							 s3_directory_ptr target, std::string *marker)
+{
+	directory_reply reply(target);
+	if (!parse_xml(page, &reply))
+		err(errWarn) << "Failed to get file listing of "
+					 << target->absolute_name_;
+	return reply.next_page(marker);
+}
+
 s3_directory_ptr s3_connection::list_files_shallow(const s3_path &path,
-	s3_directory_ptr target, bool try_to_root)
+	s3_directory_ptr target, bool try_to_root, const std::string &name_prefix)
 {            
     {
         const int num_reqs = conn_data_->concurrent_list_req_;
@@ -324,13 +762,14 @@ s3_directory_ptr s3_connection::list_files_shallow(const s3_path &path,
 		}
 	}
 
+	time_t started=time(0);
 	std::string marker;
 	while(true)
 	{
 		std::string args;
 		assert(!path.path_.empty() && path.path_[0]=='/');
 
-		std::string no_leading_slash = path.path_.substr(1);
+		std::string no_leading_slash = path.path_.substr(1)+name_prefix;
 		if (no_leading_slash.empty())
 			args="?marker="+escape(marker)+"&delimiter=/";
 		else
@@ -339,71 +778,16 @@ s3_directory_ptr s3_connection::list_files_shallow(const s3_path &path,
 
 		s3_path root=path;
 		root.path_="/";
-		std::string list=read_fully("GET", root, args);
-
-		TiXmlDocument doc;
-		doc.Parse(list.c_str());
-		if (doc.Error())
-			err(errWarn) << "Failed to get file listing from /" << path;
-		TiXmlHandle docHandle(&doc);
-
-		TiXmlNode *node=docHandle.FirstChild("ListBucketResult")
-				.FirstChild("IsTruncated")
-				.ToNode();
-		if (!node)
-			break;
-		node=node->NextSibling();
-		if (!node)
-			break;
-
-		while(node)
-		{
-			std::string name;
-			if (strcmp(node->Value(), "Contents")==0)
-			{
-				name = node->FirstChild("Key")->
-						FirstChild()->ToText()->Value();
-				std::string size = node->FirstChild("Size")->
-						FirstChild()->ToText()->Value();
-				std::string mtime = node->FirstChild("LastModified")->
-						FirstChild()->ToText()->Value();
-				if (*name.rbegin()!='/')
-				{
-					//Yes, Virginia, there are directory-like-files in S3
-					s3_file_ptr fl(new s3_file());
-					fl->name_ = extract_leaf(name);
-					fl->absolute_name_=derive(target->absolute_name_,
-											  fl->name_);
-					fl->size_ = atoll(size.c_str());
-					fl->mtime_str_ = mtime;
-					fl->parent_ = target;
-					target->files_[fl->name_]=fl;
-				}
-			} else if (strcmp(node->Value(), "CommonPrefixes")==0)
-			{
-                name = node->FirstChild("Prefix")->
-						FirstChild()->ToText()->Value();
-				//Trim trailing '/'
-				std::string trimmed_name=name.substr(0, name.size()-1);
-				s3_directory_ptr dir(new s3_directory());
-				dir->name_ = extract_leaf(trimmed_name);
-				dir->absolute_name_=derive(target->absolute_name_,
-										   dir->name_+"/");
-				dir->parent_ = target;
-				target->subdirs_[dir->name_] = dir;
-			}
-
-			node=node->NextSibling();
-			if (!node)
-				marker = name;
-		}
-
-		std::string is_trunc=docHandle.FirstChild("ListBucketResult")
-				.FirstChild("IsTruncated").FirstChild().Text()->Value();
-		if (is_trunc=="false")
+		//Entries are added as the page is being received
+		directory_reply reply(target);
+		read_streaming("GET", root, args, &reply);
+		if (!reply.next_page(&marker))
 			break;
 	}
 
+	//Listings of a part of the directory can't be reused
+	if (name_prefix.empty())
+		target->listed_at_=started;
 	return target;
 }
 
@@ -451,6 +835,17 @@ static size_t find_mtime(void *ptr, size_t size, size_t nmemb, void *userdata)
 	if (!md.empty())
 		info->mode_ = atoll(md.c_str());
 
+	std::string etag=find_header(ptr, size, nmemb, "etag");
+	if (!etag.empty())
+		info->etag_ = etag;
+
+	std::string crc=find_header(ptr, size, nmemb, "x-amz-meta-crc32c");
+	if (!crc.empty())
+	{
+		info->crc32c_ = uint32_t(atoll(crc.c_str()));
+		info->has_crc32c_ = true;
+	}
+
 	return size*nmemb;
 }
 
@@ -469,18 +864,20 @@ file_desc s3_connection::find_mtime_and_size(const s3_path &path)
 	result.mode_ = 0664;
 	result.remote_size_=result.raw_size_=0;
 
-	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
+	curl_ptr_t curl=get_curl(path);
 	prepare(curl, "HEAD", path);
 	//last-modified
 	checked(curl, curl_easy_setopt(
 				curl.get(), CURLOPT_HEADERFUNCTION, &::find_mtime));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, &result));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_NOBODY, 1));
-	checked(curl, curl_easy_perform(curl.get()));
+	perform(curl, traceHead, path);
 
-	long code=404;
-	checked(curl, curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &code));
+	long code=response_code(curl);
 	result.found_=code!=404;
+	//Other failures (e.g. throttling) must not be mistaken for an object
+	if (code>=400 && code!=404)
+		check_for_errors(curl, std::string());
 	
 	if (result.raw_size_==0)
 		result.raw_size_=result.remote_size_;
@@ -492,19 +889,10 @@ class buf_data
 	const char *buf_;
 	size_t total_size_;
 	size_t written_;
-	MD5_CTX md5_ctx;
 public:
 	buf_data(const char *buf, size_t total_size)
 		: buf_(buf), total_size_(total_size), written_()
 	{
-		MD5_Init(&md5_ctx);
-	}
-
-	std::string get_md5()
-	{
-		unsigned char md[MD5_DIGEST_LENGTH+1]={0};
-		MD5_Final(md, &md5_ctx);
-		return tobinhex(md, MD5_DIGEST_LENGTH);
 	}
 
 	static size_t read_func(char *bufptr, size_t size,
@@ -520,7 +908,6 @@ public:
 		if (tocopy!=0)
 		{
 			memcpy(bufptr, buf_+written_, tocopy);
-			MD5_Update(&md5_ctx, bufptr, tocopy);
 			written_+=tocopy;
 		}
 		return tocopy;
@@ -528,11 +915,31 @@ public:
 };
 
 std::string s3_connection::upload_data(const s3_path &path, const std::string &upload_id, int part_num,
-	const char *data, size_t size, const header_map_t& opts)
+	const char *data, size_t size, const header_map_t& opts,
+	const part_digest &digest)
+{
+	std::string etag;
+	try_upload_data(path, upload_id, part_num, data, size, &etag,
+					opts, digest) | die;
+	return etag;
+}
+
+result_code_t s3_connection::try_upload_data(const s3_path &path,
+	const std::string &upload_id, int part_num,
+	const char *data, size_t size, std::string *etag,
+	const header_map_t& opts, const part_digest &digest)
 {
 	assert(data);
 
-	std::string etag;
+	//Digests are normally computed by the reader, so that hashing
+	//doesn't stall the network threads
+	part_digest dg=digest.valid_ ? digest : compute_digest(data, size);
+	header_map_t part_opts=opts;
+	part_opts["Content-MD5"]=dg.md5_base64();
+	if (conn_data_->checksum_==checksumCRC32C)
+		part_opts["x-amz-checksum-crc32c"]=dg.crc32c_base64();
+
+	etag->clear();
 	buf_data read_data(data, size);
 
     s3_path fin_path=path;
@@ -542,11 +949,11 @@ std::string s3_connection::upload_data(const s3_path &path, const std::string &u
         fin_path.path_+=std::string("?partNumber=")+int_to_string(part_num)+"&uploadId="+upload_id;
     }
 
-	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
-    prepare(curl, "PUT", fin_path, opts);
+	curl_ptr_t curl=get_curl(path);
+    prepare(curl, "PUT", fin_path, part_opts);
 	checked(curl, curl_easy_setopt(curl.get(),
 								   CURLOPT_HEADERFUNCTION, &find_etag));
-	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, &etag));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, etag));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_UPLOAD, 1));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_INFILESIZE_LARGE,
 							 uint64_t(size)));
@@ -559,47 +966,111 @@ std::string s3_connection::upload_data(const s3_path &path, const std::string &u
 								   CURLOPT_WRITEFUNCTION, &string_appender));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &result));
 
-	checked(curl, curl_easy_perform(curl.get()));
-	check_for_errors(curl, result);
+	result_code_t res=try_perform(curl,
+		upload_id.empty() ? tracePut : traceUploadPart, path);
+	if (res.ok())
+		res=try_check_for_errors(curl, result);
+	if (!res.ok())
+		return res;
 
-	if (!etag.empty() &&
-			strcasecmp(etag.c_str(), ("\""+read_data.get_md5()+"\"").c_str()))
+	if (!etag->empty() &&
+			strcasecmp(etag->c_str(), ("\""+dg.md5_hex()+"\"").c_str()))
 		abort(); //Data corruption. This SHOULD NOT happen!
 
-    if (!upload_id.empty())
+    if (!upload_id.empty() && conn_data_->paranoid_checks_)
     {
-		s3_path chk_path=path;
-		chk_path.path_ += std::string("?uploadId=")+upload_id;
-        std::string args="&part-number-marker="+int_to_string(part_num-1)+"&max-parts=1";	
-        std::string ans=read_fully("GET", chk_path, args);
-        if (!check_part(ans, part_num))
+        if (!check_part(path, upload_id, part_num))
             err(errWarn) << "Failed to get information about part "<< int_to_string(part_num) << " for upload " << path;
     }
 
-	return etag;
+	return sok;
+}
+
+//Collects the parts from a ListPartsResult
+class part_list_reply : public s3_reply
+{
+	std::string num_, etag_;
+public:
+	//Part numbers and their ETags
+	std::vector<std::pair<size_t, std::string> > parts_;
+	bool truncated_, malformed_;
+	std::string next_marker_;
+
+	part_list_reply() : truncated_(), malformed_() {}
+
+	virtual void on_close(const xml_text &path, const xml_text &text)
+	{
+		if (path=="ListPartsResult/Part/PartNumber")
+			text.assign_to(&num_);
+		else if (path=="ListPartsResult/Part/ETag")
+			text.assign_to(&etag_);
+		else if (path=="ListPartsResult/Part")
+		{
+			if (num_.empty() || etag_.empty())
+				malformed_=true;
+			parts_.push_back(std::make_pair(
+				xml_text(num_).to_uint64(), etag_));
+			num_.clear();
+			etag_.clear();
+		} else if (path=="ListPartsResult/IsTruncated")
+			truncated_= text=="true";
+		else if (path=="ListPartsResult/NextPartNumberMarker")
+			text.assign_to(&next_marker_);
+		else
+			s3_reply::on_close(path, text);
+	}
+};
+
+bool s3_connection::check_part(const s3_path &path,
+							   const std::string &upload_id, int part_num)
+{
+	s3_path chk_path=path;
+	chk_path.path_ += std::string("?uploadId=")+upload_id;
+	std::string args="&part-number-marker="+int_to_string(part_num-1)+
+			"&max-parts=1";
+	part_list_reply reply;
+	read_streaming("GET", chk_path, args, &reply);
+	return !reply.parts_.empty() && reply.parts_.at(0).first==part_num;
 }
 
-bool s3_connection::check_part(const std::string &ans, int part_num)
+void s3_connection::verify_parts(const s3_path &path,
+	const std::string &upload_id, const std::vector<std::string> &etags)
 {
-    TiXmlDocument doc;
-    doc.Parse(ans.c_str());
-    if (doc.Error())
-        return false;
-    TiXmlHandle docHandle(&doc);
-    TiXmlNode *node=docHandle.FirstChild("ListPartsResult")
-            .FirstChild("Part")
-            .ToNode();
-    if (!node)
-        return false;
-    node=node->FirstChild("PartNumber");
-    if (!node)
-        return false;
+	//Parts were already checked against their MD5 during the upload, so
+	//we only need to confirm that S3 has all of them. A single ListParts
+	//returns up to 1000 parts.
+	std::vector<bool> seen(etags.size());
+	std::string marker="0";
+	while(true)
+	{
+		s3_path chk_path=path;
+		chk_path.path_ += std::string("?uploadId=")+upload_id;
+		part_list_reply reply;
+		read_streaming("GET", chk_path,
+			"&max-parts=1000&part-number-marker="+marker, &reply);
+		if (reply.malformed_)
+			err(errWarn) << "Incorrect document format - bad part info";
+
+		for(auto iter=reply.parts_.begin();iter!=reply.parts_.end();++iter)
+		{
+			size_t idx=iter->first-1;
+			if (idx>=etags.size())
+				continue;
+			if (strcasecmp(iter->second.c_str(), etags.at(idx).c_str()))
+				err(errWarn) << "ETag mismatch for part " << idx+1
+							 << " of upload " << path;
+			seen.at(idx)=true;
+		}
 
-    std::string text=node->FirstChild()->ToText()->Value();
-    if (text!=int_to_string(part_num))
-        return false;
+		if (!reply.truncated_ || reply.next_marker_.empty())
+			break;
+		marker=reply.next_marker_;
+	}
 
-    return true;
+	for(size_t f=0;f<seen.size();++f)
+		if (!seen.at(f))
+			err(errWarn) << "Part " << f+1 << " of upload " << path
+						 << " is missing";
 }
 
 std::string lexioprev(const std::string &cur)
@@ -619,58 +1090,81 @@ std::string lexioprev(const std::string &cur)
     return res;
 }
 
+//Looks for an upload in a ListMultipartUploadsResult
+class upload_list_reply : public s3_reply
+{
+	const std::string &upload_id_;
+public:
+	size_t num_uploads_;
+	bool found_;
+
+	upload_list_reply(const std::string &upload_id)
+		: upload_id_(upload_id), num_uploads_(), found_() {}
+
+	virtual void on_close(const xml_text &path, const xml_text &text)
+	{
+		if (path=="ListMultipartUploadsResult/Upload/UploadId")
+		{
+			num_uploads_++;
+			if (text==upload_id_)
+				found_=true;
+		} else
+			s3_reply::on_close(path, text);
+	}
+};
+
 std::string s3_connection::initiate_multipart(
 	const s3_path &path, const header_map_t &opts)
 {
 	s3_path up_path =path;
     up_path.path_+="?uploads";
-	std::string list=read_fully("POST", up_path, "", opts);
-
-	TiXmlDocument doc;
-	doc.Parse(list.c_str());
-	if (doc.Error())
-		err(errWarn) << "Failed to initiate multipart to " << path;
-	TiXmlHandle docHandle(&doc);
-
-	TiXmlNode *node=docHandle.FirstChild("InitiateMultipartUploadResult")
-			.FirstChild("UploadId")
-			.FirstChild()
-			.ToText();
-	if (!node)
-		err(errWarn) << "Incorrect document format - no upload ID";	
-    std::string uploadId=node->Value();
+	value_reply reply("InitiateMultipartUploadResult/UploadId");
+	read_streaming("POST", up_path, "", &reply, opts);
+	if (!reply.found_ || reply.value_.empty())
+		err(errWarn) << "Incorrect document format - no upload ID";
+    const std::string &uploadId=reply.value_;
+    if (!conn_data_->paranoid_checks_)
+        return uploadId;
 
     //Validate that the upload is created
     s3_path all_paths=path;
     all_paths.path_="/?uploads";
-    std::string cur_uploads=read_fully("GET", all_paths, "&prefix="+path.path_.substr(1));
-    TiXmlDocument cur_uploads_xml;
-    cur_uploads_xml.Parse(cur_uploads.c_str());
-    if (cur_uploads_xml.Error())
-        err(errWarn) << "Failed to initiate multipart to " << path;
-    TiXmlHandle curDocHandle(&cur_uploads_xml);
-
-    TiXmlNode *cur_node=curDocHandle.FirstChild("ListMultipartUploadsResult")
-            .FirstChild("Upload").ToNode();
-    if (!cur_node)
+	upload_list_reply cur_uploads(uploadId);
+	read_streaming("GET", all_paths, "&prefix="+path.path_.substr(1),
+				   &cur_uploads);
+	if (!cur_uploads.num_uploads_)
         err(errWarn) << "Incorrect document format - no upload ID";
-    while(cur_node)
-    {
-        TiXmlHandle upHandle(cur_node);
-        std::string val=upHandle.FirstChild("UploadId").FirstChild().ToText()->ValueStr();
-//        std::cerr<<"Val "<< val<<std::endl;
-        if (val==uploadId)
-            return uploadId;
-
-        cur_node=cur_node->NextSibling();
-    }
+	if (cur_uploads.found_)
+		return uploadId;
 
     err(errWarn) << "Can't find an active upload with id="<<uploadId;
 }
 
+std::string s3_connection::upload_part_copy(const s3_path &path,
+	const std::string &upload_id, int part_num, const s3_path &source,
+	uint64_t offset, uint64_t size)
+{
+	header_map_t opts;
+	opts["x-amz-copy-source"]="/"+source.bucket_+source.path_;
+	opts["x-amz-copy-source-range"]="bytes="+int_to_string(offset)+"-"+
+			int_to_string(offset+size-1);
+
+	s3_path part_path=path;
+	part_path.path_+="?partNumber="+int_to_string(part_num)+
+			"&uploadId="+upload_id;
+	value_reply reply("CopyPartResult/ETag");
+	read_streaming("PUT", part_path, "", &reply, opts);
+	if (!reply.found_)
+		err(errWarn) << "Incorrect document format - no part ETag";
+	return reply.value_;
+}
+
 std::string s3_connection::complete_multipart(const s3_path &path,
-	const std::string &upload_id, const std::vector<std::string> &etags)
+	const std::string &upload_id, const std::vector<std::string> &etags,
+	const std::vector<std::string> &checksums)
 {
+	verify_parts(path, upload_id, etags);
+
 	std::string data="<CompleteMultipartUpload>";
 	for(size_t f=0;f<etags.size();++f)
 	{
@@ -681,6 +1175,10 @@ std::string s3_connection::complete_multipart(const s3_path &path,
 		data.append("  <ETag>")
 				.append(etags.at(f))
 				.append("</ETag>\n");
+		if (!checksums.empty())
+			data.append("  <ChecksumCRC32C>")
+					.append(checksums.at(f))
+					.append("</ChecksumCRC32C>\n");
 		data.append("</Part>\n");
 	}
 	data.append("</CompleteMultipartUpload>");
@@ -688,7 +1186,7 @@ std::string s3_connection::complete_multipart(const s3_path &path,
 	s3_path up_path=path;
 	up_path.path_+="?uploadId="+upload_id;
 
-	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
+	curl_ptr_t curl=get_curl(path);
 	prepare(curl, "POST", up_path);
 
 	buf_data data_params(data.c_str(), data.size());
@@ -705,7 +1203,7 @@ std::string s3_connection::complete_multipart(const s3_path &path,
 	checked(curl, curl_easy_setopt(
 				curl.get(), CURLOPT_WRITEDATA, &read_data));
 
-	checked(curl, curl_easy_perform(curl.get()));
+	perform(curl, traceComplete, path);
 	check_for_errors(curl, read_data);
 
 	VLOG(2) << "Completed multipart of " << path;
@@ -747,7 +1245,13 @@ public:
 void s3_connection::download_data(const s3_path &path,
 	uint64_t offset, char *data, size_t size, const header_map_t& opts)
 {
-	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
+	try_download_data(path, offset, data, size, opts) | die;
+}
+
+result_code_t s3_connection::try_download_data(const s3_path &path,
+	uint64_t offset, char *data, size_t size, const header_map_t& opts)
+{
+	curl_ptr_t curl=get_curl(path);
 
 	prepare(curl, "GET", path, opts);
 	checked(curl, curl_easy_setopt(
@@ -762,13 +1266,84 @@ void s3_connection::download_data(const s3_path &path,
 							 &write_data::write_func));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &wd));
 
-	checked(curl, curl_easy_perform(curl.get()));
-	check_for_errors(curl, std::string(data,
-								 std::min(wd.written(), size_t(1024))));
+	result_code_t res=try_perform(curl, traceGet, path);
+	if (res.ok())
+		res=try_check_for_errors(curl, std::string(data,
+			std::min(wd.written(), size_t(1024))));
+	if (!res.ok())
+		return res;
 
 	if (wd.written()!=size)
-		err(errWarn)  << "Size of a segment at offset " << offset
-					  << " of "<< path << " is incorrect.";
+		return result_code_t(errWarn, "Size of a segment at offset "+
+							 int_to_string(offset)+" of s3://"+path.bucket_+
+							 path.path_+" is incorrect.", -1, kindNetwork);
+	return sok;
+}
+
+//Collects a whole object, gives up on the ones that are too large
+struct object_buffer
+{
+	std::vector<char> *data_;
+	size_t max_size_;
+	bool too_large_;
+
+	static size_t write_func(const char *bufptr, size_t size,
+							 size_t nitems, void *userp)
+	{
+		object_buffer *self=reinterpret_cast<object_buffer*>(userp);
+		size_t len=size*nitems;
+		if (self->data_->size()+len > self->max_size_)
+		{
+			self->too_large_=true;
+			return 0;
+		}
+		self->data_->insert(self->data_->end(), bufptr, bufptr+len);
+		return len;
+	}
+};
+
+result_code_t s3_connection::try_download_object(const s3_path &path,
+	size_t max_size, std::vector<char> *data, file_desc *desc)
+{
+	*desc=file_desc();
+	desc->mode_=0664;
+	data->clear();
+
+	curl_ptr_t curl=get_curl(path);
+	prepare(curl, "GET", path);
+	checked(curl, curl_easy_setopt(
+				curl.get(), CURLOPT_HEADERFUNCTION, &::find_mtime));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, desc));
+	object_buffer buf={data, max_size, false};
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION,
+							 &object_buffer::write_func));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &buf));
+
+	result_code_t res=try_perform(curl, traceGet, path);
+	long code=response_code(curl);
+	desc->found_=code!=404;
+	if (buf.too_large_ && code<300)
+	{
+		//The object has grown since it was listed
+		taint(curl);
+		data->clear();
+		desc->found_=true;
+		return sok;
+	}
+	if (res.ok() && desc->found_)
+		res=try_check_for_errors(curl,
+			std::string(data->begin(), data->end()));
+	if (!res.ok())
+		return res;
+
+	if (!desc->found_)
+		data->clear();
+	else if (data->size()!=desc->remote_size_)
+		return result_code_t(errWarn, "Size of s3://"+path.bucket_+
+							 path.path_+" is incorrect.", -1, kindNetwork);
+	if (desc->raw_size_==0)
+		desc->raw_size_=desc->remote_size_;
+	return sok;
 }
 
 std::string s3_connection::find_region(const std::string &bucket)
@@ -778,25 +1353,13 @@ std::string s3_connection::find_region(const std::string &bucket)
 	path.bucket_ = bucket;
 	path.path_ = "/?location";
 
-	std::string reg_data=read_fully("GET", path);
-
-	TiXmlDocument doc;
-	doc.Parse(reg_data.c_str());
-	if (doc.Error())
-		err(errWarn) << "Can't find region, bad document received. "
-					 << doc.ErrorDesc();
-	TiXmlHandle docHandle(&doc);
-
-	TiXmlNode *n1=docHandle.FirstChild("LocationConstraint").ToNode();
-	if (!n1)
+	value_reply reply("LocationConstraint");
+	read_streaming("GET", path, "", &reply);
+	if (!reply.found_)
 		err(errWarn) << "Incorrect document format - no location id";
-
-	TiXmlNode *node=docHandle.FirstChild("LocationConstraint")
-			.FirstChild()
-			.ToText();
-	if (!node)
+	if (reply.value_.empty())
 		return "s3"; //Default location
-	return std::string("s3-")+node->Value();
+	return std::string("s3-")+reply.value_;
 }
 
 void s3_connection::set_acl(const s3_path &path, const std::string &acl)
@@ -31,6 +31,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "common.h"
 #include "context.h"
+#include "errors.h"
+#include "tracing.h"
 #include <functional>
 #include <boost/weak_ptr.hpp>
 
@@ -49,6 +51,9 @@ namespace es3 {
 		mode_t mode_;
 		bool compressed_;
 		bool found_;
+		std::string etag_;
+		uint32_t crc32c_;
+		bool has_crc32c_;
 	};
 
 	struct s3_path
@@ -97,6 +102,8 @@ namespace es3 {
 		file_map_t files_;
 		subdir_map_t subdirs_;
 		s3_directory_weak_t parent_;
+		//0 if the directory hasn't been listed completely
+		time_t listed_at_;
 	};
 
 	struct s3_file
@@ -107,10 +114,26 @@ namespace es3 {
 
 		uint64_t size_;
 		s3_directory_weak_t parent_;
+
+		//Metadata from a HEAD request (see file_desc), if it's known
+		bool has_desc_;
+		time_t desc_mtime_;
+		uint64_t desc_raw_size_;
 	};
 
+	/**
+	  Adds the files and subdirectories from one ListBucketResult page to
+	  the target. Returns true if the listing is truncated, in which case
+	  the marker is set to the key to continue from.
+	  */
+	ES3LIB_PUBLIC bool parse_listing_page(const std::string &page,
+		s3_directory_ptr target, std::string *marker);
+
 	typedef boost::function<void(size_t)> progress_callback_t;
 
+	//Handler for the XML replies, see connection.cpp
+	class s3_reply;
+
 	class s3_connection
 	{
 		const context_ptr conn_data_;
@@ -119,39 +142,96 @@ namespace es3 {
         boost::condition_variable num_parallel_reqs_;
         boost::mutex parallel_req_mutex_;
         int num_lists_;
+
+		bool keep_alive_;
+		curl_ptr_t pinned_;
+		std::string pinned_key_;
     public:
 		s3_connection(const context_ptr &conn_data);
 		~s3_connection();
 
+		//Use the same HTTP connection for all requests to a bucket until
+		//this object is destroyed or the connection fails
+		void keep_connection() { keep_alive_=true; }
+
 		std::string read_fully(const std::string &verb,
 							   const s3_path &path,
 							   const std::string &args="",
 							   const header_map_t &opts=header_map_t());
+		//Passes the object's data to the sink while it's being received
+		void read_object(const s3_path &path,
+			const boost::function<void(const char*, size_t)> &sink);
         std::string upload_data(const s3_path &path, const std::string &upload_id, int part_num,
 								const char *data, size_t size,
-								const header_map_t& opts=header_map_t());
+								const header_map_t& opts=header_map_t(),
+								const part_digest &digest=part_digest());
+		std::string upload_part_copy(const s3_path &path,
+									 const std::string &upload_id,
+									 int part_num, const s3_path &source,
+									 uint64_t offset, uint64_t size);
 		void download_data(const s3_path &path,
 			uint64_t offset, char *data, size_t size,
 			const header_map_t& opts=header_map_t());
 
+		//These don't throw for the failures that are expected and can be
+		//retried (throttling, server and network errors), the result is
+		//returned instead
+		result_code_t try_upload_data(const s3_path &path,
+			const std::string &upload_id, int part_num,
+			const char *data, size_t size, std::string *etag,
+			const header_map_t& opts=header_map_t(),
+			const part_digest &digest=part_digest());
+		result_code_t try_download_data(const s3_path &path,
+			uint64_t offset, char *data, size_t size,
+			const header_map_t& opts=header_map_t());
+		//Reads the object and its metadata with a single GET. If it's
+		//larger than max_size the data is left empty.
+		result_code_t try_download_object(const s3_path &path,
+			size_t max_size, std::vector<char> *data, file_desc *desc);
+
+		//Only the entries starting with the name prefix are listed, the
+		//results are added to the target if it's given
 		s3_directory_ptr list_files_shallow(const s3_path &path,
-			s3_directory_ptr target, bool try_to_root);
+			s3_directory_ptr target, bool try_to_root,
+			const std::string &name_prefix="");
 
 		std::string initiate_multipart(const s3_path &path,
 									   const header_map_t &opts);
 		std::string complete_multipart(const s3_path &path,
 									   const std::string &upload_id,
-									   const std::vector<std::string> &etags);
+									   const std::vector<std::string> &etags,
+									   const std::vector<std::string> &checksums=
+											std::vector<std::string>());
 		file_desc find_mtime_and_size(const s3_path &path);
 
 		std::string find_region(const std::string &bucket);
 		
 		void set_acl(const s3_path &path, const std::string &acl);
 	private:
-        bool check_part(const std::string &doc, int part_num);
+		curl_ptr_t get_curl(const s3_path &path);
+		void taint(curl_ptr_t curl);
+		bool check_part(const s3_path &path, const std::string &upload_id,
+						int part_num);
+		void verify_parts(const s3_path &path, const std::string &upload_id,
+						  const std::vector<std::string> &etags);
+		//Runs the request, recording its timings
+		void perform(curl_ptr_t curl, trace_op_e op, const s3_path &path);
+		result_code_t try_perform(curl_ptr_t curl, trace_op_e op,
+								  const s3_path &path);
 		void checked(curl_ptr_t curl, int curl_code);
+		result_code_t try_checked(curl_ptr_t curl, int curl_code);
+		long response_code(curl_ptr_t curl);
 		void check_for_errors(curl_ptr_t curl,
 							  const std::string &curl_res);
+		void check_for_errors(curl_ptr_t curl, const s3_reply &reply);
+		result_code_t try_check_for_errors(curl_ptr_t curl,
+										   const std::string &curl_res);
+		result_code_t try_check_for_errors(curl_ptr_t curl,
+										   const s3_reply &reply);
+		//Feeds the reply to the handler while it's being received
+		void read_streaming(const std::string &verb, const s3_path &path,
+							const std::string &args, s3_reply *reply,
+							const header_map_t &opts=header_map_t());
 		void prepare(curl_ptr_t curl,
 					 const std::string &verb,
 					 const s3_path &path,
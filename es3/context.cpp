@@ -65,6 +65,14 @@ conn_context::~conn_context()
 	reset();
 }
 
+size_t conn_context::count_connections(size_t *busy)
+{
+	guard_t lock(m_);
+	if (busy)
+		*busy=borrowed_curls_.size();
+	return error_bufs_.size();
+}
+
 void conn_context::taint(curl_ptr_t ptr)
 {
     guard_t lock(m_);
@@ -30,12 +30,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define CONTEXT_H
 
 #include "common.h"
+#include "checksum.h"
 #define MAX_SEGMENTS 9999
 
 typedef void CURL;
 
 namespace es3 {
 	struct s3_path;
+	class dedup_index;
+	class listing_cache;
 
 	typedef boost::shared_ptr<CURL> curl_ptr_t;
 
@@ -43,11 +46,28 @@ namespace es3 {
 	{
 	public:
 		bf::path scratch_dir_;
-		bool use_ssl_, do_compression_;
+		bool use_ssl_, do_compression_, resume_downloads_, paranoid_checks_;
+		//Bypass the page cache for bulk file transfers
+		bool direct_io_;
         std::string api_key_, secret_key;
+		//Overrides the Amazon S3 URL, e.g. "http://localhost:9000"
+		std::string endpoint_;
         int concurrent_list_req_;
+		//Files up to this size are uploaded in batches, one connection
+		//per batch
+		int small_file_size_, small_file_batch_;
+		int compression_level_;
+		checksum_e checksum_;
+		//Set if uploads should reuse chunks that are already in S3
+		boost::shared_ptr<dedup_index> dedup_;
+		//Set if ls, lsr and du may answer from listing snapshots
+		boost::shared_ptr<listing_cache> listing_cache_;
 
-        conn_context() : use_ssl_(), do_compression_(true), concurrent_list_req_(-1) {};
+        conn_context() : use_ssl_(), do_compression_(true),
+			resume_downloads_(), paranoid_checks_(), direct_io_(),
+			concurrent_list_req_(-1), small_file_size_(), small_file_batch_(),
+			compression_level_(1),
+			checksum_(checksumNone) {};
 		~conn_context();
 
 		curl_ptr_t get_curl(const std::string &zone,
@@ -55,6 +75,9 @@ namespace es3 {
         void taint(curl_ptr_t ptr);
 
 		void reset();
+		//Returns the number of open connections and how many of them
+		//are currently in use
+		size_t count_connections(size_t *busy);
 		char* err_buf_for(curl_ptr_t ptr)
 		{
 			return error_bufs_[ptr.get()];
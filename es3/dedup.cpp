@@ -0,0 +1,275 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "dedup.h"
+#include "errors.h"
+#include "connection.h"
+#include <openssl/evp.h>
+#include <fcntl.h>
+#include <fstream>
+#include <boost/algorithm/string.hpp>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+using namespace es3;
+
+namespace
+{
+	struct gear_table
+	{
+		uint64_t table_[256];
+
+		gear_table()
+		{
+			//The table must be the same for every run, so use splitmix64
+			//with a fixed seed
+			uint64_t state=0x6573336465647570ULL;
+			for(int f=0;f<256;++f)
+			{
+				uint64_t z=(state+=0x9E3779B97F4A7C15ULL);
+				z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+				z=(z^(z>>27))*0x94D049BB133111EBULL;
+				table_[f]=z^(z>>31);
+			}
+		}
+	};
+	const gear_table gear;
+
+	class chunk_hasher
+	{
+		EVP_MD_CTX *ctx_;
+	public:
+		chunk_hasher() : ctx_(EVP_MD_CTX_new())
+		{
+			if (!ctx_ || !EVP_DigestInit_ex(ctx_, EVP_sha256(), NULL))
+				err(errFatal) << "Can't initialize SHA-256 digest";
+		}
+		~chunk_hasher()
+		{
+			EVP_MD_CTX_free(ctx_);
+		}
+
+		void update(const char *data, size_t len)
+		{
+			EVP_DigestUpdate(ctx_, data, len);
+		}
+
+		std::string finish()
+		{
+			unsigned char md[EVP_MAX_MD_SIZE];
+			unsigned int md_len=0;
+			EVP_DigestFinal_ex(ctx_, md, &md_len);
+			EVP_DigestInit_ex(ctx_, EVP_sha256(), NULL);
+			return tobinhex(md, md_len);
+		}
+	};
+}
+
+std::vector<dedup_chunk> es3::split_into_chunks(const bf::path &path,
+												uint64_t max_chunk)
+{
+	assert(max_chunk>MIN_DEDUP_CHUNK);
+	//Cut points are expected every ~(max-min)/2 bytes past the minimum
+	uint64_t mask=1;
+	while(mask*2 < (max_chunk-MIN_DEDUP_CHUNK)/2)
+		mask*=2;
+	mask--;
+
+	handle_t fl(open(path.c_str(), O_RDONLY)
+				| libc_die2("Failed to open "+path.string()));
+
+	std::vector<dedup_chunk> res;
+	std::vector<char> buf(1024*1024);
+	chunk_hasher hasher;
+	boost::shared_ptr<digest_builder> digest(new digest_builder());
+
+	uint64_t offset=0, chunk_start=0, hash=0;
+	while(true)
+	{
+		ssize_t ln=read(fl.get(), &buf[0], buf.size()) | libc_die;
+		if (ln==0)
+			break;
+
+		size_t consumed=0;
+		for(size_t f=0;f<size_t(ln);++f)
+		{
+			hash=(hash<<1)+gear.table_[static_cast<unsigned char>(buf[f])];
+			uint64_t cur_size=offset+f+1-chunk_start;
+			if (cur_size<MIN_DEDUP_CHUNK)
+				continue;
+			if ((hash&mask)!=0 && cur_size<max_chunk)
+				continue;
+
+			//Got a cut point
+			hasher.update(&buf[consumed], f+1-consumed);
+			digest->update(&buf[consumed], f+1-consumed);
+			consumed=f+1;
+
+			dedup_chunk chunk;
+			chunk.offset_=chunk_start;
+			chunk.size_=cur_size;
+			chunk.hash_=hasher.finish();
+			chunk.digest_=digest->finish();
+			res.push_back(chunk);
+
+			digest.reset(new digest_builder());
+			chunk_start+=cur_size;
+			hash=0;
+		}
+		hasher.update(&buf[consumed], ln-consumed);
+		digest->update(&buf[consumed], ln-consumed);
+		offset+=ln;
+	}
+
+	if (offset>chunk_start || res.empty())
+	{
+		dedup_chunk chunk;
+		chunk.offset_=chunk_start;
+		chunk.size_=offset-chunk_start;
+		chunk.hash_=hasher.finish();
+		chunk.digest_=digest->finish();
+		res.push_back(chunk);
+	}
+	return res;
+}
+
+dedup_index::dedup_index(const bf::path &file) : file_(file), loaded_()
+{
+}
+
+void dedup_index::load()
+{
+	if (loaded_)
+		return;
+	loaded_=true;
+
+	//Journal records are:
+	//	O <bucket> <path> - the following chunks belong to this object
+	//	C <hash> <offset> <size> <part> - a chunk of the current object
+	//	F <hash> - the chunk is no longer valid
+	std::ifstream in(file_.c_str());
+	std::string line, bucket, path;
+	while(std::getline(in, line))
+	{
+		stringvec parts;
+		boost::split(parts, line, boost::is_any_of("\t"));
+		if (parts.size()==3 && parts.at(0)=="O")
+		{
+			bucket=parts.at(1);
+			path=parts.at(2);
+			drop_object(bucket+path);
+		} else if (parts.size()==5 && parts.at(0)=="C" && !bucket.empty())
+		{
+			chunk_location loc;
+			loc.bucket_=bucket;
+			loc.path_=path;
+			loc.offset_=atoll(parts.at(2).c_str());
+			loc.size_=atoll(parts.at(3).c_str());
+			loc.part_=atoi(parts.at(4).c_str());
+			chunks_[parts.at(1)]=loc;
+			objects_[bucket+path].push_back(parts.at(1));
+		} else if (parts.size()==2 && parts.at(0)=="F")
+			chunks_.erase(parts.at(1));
+		else if (!line.empty())
+			VLOG(1) << "Skipping a malformed record in " << file_;
+	}
+}
+
+void dedup_index::append(const std::string &records)
+{
+	handle_t fl(open(file_.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0600)
+				| libc_die2("Failed to open dedup index "+file_.string()));
+	//A single write, so that concurrent es3 instances don't interleave
+	write(fl.get(), records.c_str(), records.size())
+			| libc_die2("Failed to update dedup index "+file_.string());
+}
+
+void dedup_index::drop_object(const std::string &name)
+{
+	std::map<std::string, stringvec>::iterator iter=objects_.find(name);
+	if (iter==objects_.end())
+		return;
+	for(auto f=iter->second.begin();f!=iter->second.end();++f)
+	{
+		std::map<std::string, chunk_location>::iterator ch=chunks_.find(*f);
+		if (ch!=chunks_.end() && ch->second.bucket_+ch->second.path_==name)
+			chunks_.erase(ch);
+	}
+	objects_.erase(iter);
+}
+
+bool dedup_index::find(const std::string &hash, chunk_location *loc)
+{
+	guard_t lock(m_);
+	load();
+	std::map<std::string, chunk_location>::iterator iter=chunks_.find(hash);
+	if (iter==chunks_.end())
+		return false;
+	*loc=iter->second;
+	return true;
+}
+
+void dedup_index::forget(const std::string &hash)
+{
+	guard_t lock(m_);
+	load();
+	if (chunks_.erase(hash))
+		append("F\t"+hash+"\n");
+}
+
+void dedup_index::record_object(const s3_path &path,
+								const std::vector<dedup_chunk> &chunks)
+{
+	guard_t lock(m_);
+	load();
+	//The object has been overwritten, so its old chunks are gone
+	drop_object(path.bucket_+path.path_);
+
+	std::string records="O\t"+path.bucket_+"\t"+path.path_+"\n";
+	for(size_t f=0;f<chunks.size();++f)
+	{
+		const dedup_chunk &ch=chunks.at(f);
+		chunk_location loc;
+		loc.bucket_=path.bucket_;
+		loc.path_=path.path_;
+		loc.offset_=ch.offset_;
+		loc.size_=ch.size_;
+		loc.part_=f+1;
+		chunks_[ch.hash_]=loc;
+		objects_[path.bucket_+path.path_].push_back(ch.hash_);
+
+		records.append("C\t").append(ch.hash_).append("\t")
+				.append(int_to_string(ch.offset_)).append("\t")
+				.append(int_to_string(ch.size_)).append("\t")
+				.append(int_to_string(f+1)).append("\n");
+	}
+	append(records);
+}
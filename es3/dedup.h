@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "common.h"
+#include "checksum.h"
+#include <stdint.h>
+
+//S3 doesn't allow parts smaller than 5MB (except for the last one)
+#define MIN_DEDUP_CHUNK (5*1024*1024)
+#define MAX_DEDUP_CHUNK (32*1024*1024)
+
+namespace es3 {
+	struct s3_path;
+
+	struct dedup_chunk
+	{
+		uint64_t offset_, size_;
+		std::string hash_; //SHA-256 of the chunk data
+		part_digest digest_;
+	};
+
+	/**
+	  Splits the file into content-defined chunks using a gear rolling
+	  hash, so that an insertion only changes the chunks around it.
+	  */
+	ES3LIB_PUBLIC std::vector<dedup_chunk> split_into_chunks(
+		const bf::path &path, uint64_t max_chunk);
+
+	struct chunk_location
+	{
+		std::string bucket_, path_;
+		uint64_t offset_, size_;
+		int part_;
+	};
+
+	/**
+	  Local index of chunks that are known to exist in S3. It's stored as
+	  an append-only journal and replayed on the first lookup.
+	  */
+	class dedup_index
+	{
+		mutex_t m_;
+		const bf::path file_;
+		bool loaded_;
+
+		std::map<std::string, chunk_location> chunks_;
+		//Object name -> hashes of its chunks
+		std::map<std::string, stringvec> objects_;
+	public:
+		explicit dedup_index(const bf::path &file);
+
+		bool find(const std::string &hash, chunk_location *loc);
+		void forget(const std::string &hash);
+		//Replaces everything we know about the object
+		void record_object(const s3_path &path,
+						   const std::vector<dedup_chunk> &chunks);
+	private:
+		void load();
+		void append(const std::string &records);
+		void drop_object(const std::string &name);
+	};
+	typedef boost::shared_ptr<dedup_index> dedup_index_ptr;
+}; //namespace es3
+
+#endif //DEDUP_H
@@ -37,6 +37,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <iostream>
 #include "commands.h"
 #include "scope_guard.h"
+#include "checksum.h"
+#include "io_engine.h"
+#include "materializer.h"
 
 using namespace es3;
 using namespace boost::filesystem;
@@ -47,6 +50,81 @@ void local_file_deleter::operator ()(agenda_ptr agenda_)
 	bf::remove_all(file_);
 }
 
+//Sidecar file that records which segments of a partial download are
+//already on disk. It starts with a text header identifying the remote
+//object (ETag, size and segmentation), followed by one byte per segment.
+class resume_map
+{
+	mutex_t m_;
+	const bf::path path_;
+	handle_t fl_;
+	std::string header_;
+	std::vector<char> done_;
+	bool reused_;
+public:
+	resume_map(const bf::path &path, const std::string &header,
+			   size_t num_segments) :
+		path_(path), fl_(open(path.c_str(), O_RDWR|O_CREAT, 0600)
+			| libc_die2("Failed to open resume map "+path.string())),
+		header_(header), done_(num_segments, '0'), reused_()
+	{
+		std::string existing;
+		uint64_t len=fl_.size();
+		if (len==header_.size()+num_segments)
+		{
+			existing.resize(len);
+			pread(fl_.get(), &existing[0], len, 0) | libc_die;
+		}
+
+		if (!existing.empty() && existing.compare(0, header_.size(),
+												  header_)==0)
+		{
+			done_.assign(existing.begin()+header_.size(), existing.end());
+			reused_=true;
+		} else
+			reset();
+	}
+
+	bool reused() const { return reused_; }
+
+	void reset()
+	{
+		guard_t lock(m_);
+		std::fill(done_.begin(), done_.end(), '0');
+		std::string data=header_;
+		data.append(done_.begin(), done_.end());
+		ftruncate(fl_.get(), 0) | libc_die;
+		pwrite(fl_.get(), data.c_str(), data.size(), 0) | libc_die;
+		reused_=false;
+	}
+
+	bool is_done(size_t segment)
+	{
+		guard_t lock(m_);
+		return done_.at(segment)=='1';
+	}
+
+	size_t num_done()
+	{
+		guard_t lock(m_);
+		return std::count(done_.begin(), done_.end(), '1');
+	}
+
+	void mark_done(size_t segment)
+	{
+		guard_t lock(m_);
+		done_.at(segment)='1';
+		pwrite(fl_.get(), "1", 1, header_.size()+segment)
+				| libc_die2("Failed to update "+path_.string());
+	}
+
+	void discard()
+	{
+		unlink(path_.c_str());
+	}
+};
+typedef boost::shared_ptr<resume_map> resume_map_ptr;
+
 struct download_content
 {
 	mutex_t m_;
@@ -60,18 +138,144 @@ struct download_content
 	s3_path remote_path_;
 	bf::path local_file_, target_file_;
 	bool delete_temp_file_, compressed_;
+	resume_map_ptr resume_;
+	//Set if the file is created in place, local_file_ is the target then
+	pending_file_ptr out_;
+	//Opened by the first written segment and kept for the rest of them
+	boost::shared_ptr<transfer_file> out_file_;
+
+	//Whole-file checksum from the object metadata, if present
+	bool has_crc32c_;
+	uint32_t crc32c_;
+	std::vector<uint32_t> seg_crcs_;
+	std::vector<bool> have_seg_crcs_;
 
 	download_content() : mtime_(), num_segments_(), segments_read_(),
 		remote_size_(), raw_size_(), delete_temp_file_(true),
-		mode_(0664), compressed_() {}
+		mode_(0664), compressed_(), has_crc32c_(), crc32c_() {}
 	~download_content()
 	{
-		if (local_file_!=target_file_ && delete_temp_file_)
+		//Partial downloads are kept around if they can be resumed
+		if (local_file_!=target_file_ && delete_temp_file_ && !resume_)
 			unlink(local_file_.c_str());
 	}
 };
 typedef boost::shared_ptr<download_content> download_content_ptr;
 
+//Must be called with content->m_ held
+static void verify_download(download_content_ptr content, agenda_ptr agenda)
+{
+	uint32_t crc=0;
+	uint64_t seg_size=agenda->segment_size();
+	for(size_t f=0;f<content->num_segments_;++f)
+	{
+		uint64_t len=std::min(seg_size,
+							  uint64_t(content->remote_size_)-f*seg_size);
+		uint32_t cur=content->seg_crcs_.at(f);
+		if (!content->have_seg_crcs_.at(f))
+		{
+			//This segment came from an earlier attempt, read it back
+			std::vector<char> buf(safe_cast<size_t>(len));
+			transfer_file fl(content->local_file_, O_RDONLY,
+							 content->ctx_->direct_io_);
+			if (len && fl.read_at(&buf[0], len, f*seg_size)!=len)
+				err(errFatal) << "File " << content->local_file_
+							  << " was truncated during the download";
+			cur=len ? crc32c(0, &buf[0], len) : 0;
+		}
+		crc=crc32c_combine(crc, cur, len);
+	}
+
+	if (crc!=content->crc32c_)
+	{
+		if (content->resume_)
+			content->resume_->discard();
+		content->resume_.reset();
+		err(errFatal) << "Checksum mismatch for " << content->remote_path_
+					  << ", expected CRC32C " << content->crc32c_
+					  << " but got " << crc;
+	}
+}
+
+//Must be called with content->m_ held
+static void finish_download(download_content_ptr content, agenda_ptr agenda)
+{
+	content->out_file_.reset();
+	if (content->has_crc32c_)
+		verify_download(content, agenda);
+	if (content->resume_)
+		content->resume_->discard();
+
+	//Check if we need to decompress the file
+	if (content->compressed_)
+	{
+		//Yep, we do need to decompress it
+		sync_task_ptr dl(new file_decompressor(content->ctx_,
+			content->local_file_, content->target_file_,
+			content->mtime_, content->mode_, true));
+		//file decompressor will delete it
+		content->delete_temp_file_=false;
+		agenda->schedule(dl);
+	} else if (content->out_)
+	{
+		content->out_->commit(content->mtime_, content->mode_);
+	} else
+	{
+		std::string local_nm=content->local_file_.string();
+		std::string tgt_nm=content->target_file_.string();
+		bf::last_write_time(local_nm, content->mtime_);
+		chmod(local_nm.c_str(), content->mode_)
+				| libc_die2("Failed to set mode on "+tgt_nm);
+		rename(local_nm.c_str(), tgt_nm.c_str())
+				| libc_die2("Failed to replace "+tgt_nm);
+	}
+}
+
+//Compressed files are downloaded to the scratch directory first,
+//the rest are created in place (see pending_file)
+static void create_output(download_content_ptr dc, bool direct)
+{
+	if (dc->compressed_)
+	{
+		dc->local_file_=dc->ctx_->scratch_dir_ /
+				bf::unique_path("scratchy-%%%%-%%%%-%%%%-%%%%-dl");
+		dc->out_file_.reset(new transfer_file(dc->local_file_,
+			O_RDWR|O_CREAT|O_EXCL, direct));
+	} else
+	{
+		dc->out_.reset(new pending_file(dc->target_file_));
+		dc->local_file_=dc->target_file_;
+		dc->out_file_.reset(new transfer_file(dc->out_->get(), direct));
+	}
+}
+
+//The downloads are started well ahead of their transfers, so the output
+//is opened only when the first segment arrives. Otherwise every queued
+//download would hold its descriptors.
+static transfer_file& open_output(download_content_ptr dc)
+{
+	guard_t lock(dc->m_);
+	if (dc->out_file_)
+		return *dc->out_file_;
+
+	bool direct=dc->ctx_->direct_io_;
+	if (dc->resume_ && dc->resume_->reused())
+	{
+		dc->out_file_.reset(new transfer_file(dc->local_file_, O_RDWR,
+											  direct));
+		return *dc->out_file_;
+	}
+	if (dc->resume_)
+	{
+		unlink(dc->local_file_.c_str()); //Prevent some access right foulups
+		dc->out_file_.reset(new transfer_file(dc->local_file_,
+			O_RDWR|O_CREAT, direct));
+	} else
+		create_output(dc, direct);
+	preallocate(dc->out_file_->get(), dc->remote_size_);
+	return *dc->out_file_;
+}
+
 class write_segment_task: public sync_task,
 		public boost::enable_shared_from_this<write_segment_task>
 {
@@ -95,51 +299,30 @@ public:
 
 	virtual void operator()(agenda_ptr agenda)
 	{
-		context_ptr ctx = content_->ctx_;
+		uint32_t crc=seg_->data_.empty() ? 0 :
+			crc32c(0, &seg_->data_[0], seg_->data_.size());
 		do_write(agenda);
 
 		guard_t lock(content_->m_);
+		content_->seg_crcs_.at(cur_segment_)=crc;
+		content_->have_seg_crcs_.at(cur_segment_)=true;
 		content_->segments_read_++;
 		if (content_->segments_read_==content_->num_segments_)
-		{
-			//Check if we need to decompress the file
-			if (content_->compressed_)
-			{
-				//Yep, we do need to decompress it
-				sync_task_ptr dl(new file_decompressor(ctx,
-					content_->local_file_, content_->target_file_,
-					content_->mtime_, content_->mode_, true));
-				//file decompressor will delete it
-				content_->delete_temp_file_=false;
-				agenda->schedule(dl);
-			} else
-			{
-				std::string local_nm=content_->local_file_.string();
-				std::string tgt_nm=content_->target_file_.string();
-				bf::last_write_time(local_nm, content_->mtime_);
-				chmod(local_nm.c_str(), content_->mode_)
-						| libc_die2("Failed to set mode on "+tgt_nm);
-				rename(local_nm.c_str(), tgt_nm.c_str())
-						| libc_die2("Failed to replace "+tgt_nm);
-			}
-		}
+			finish_download(content_, agenda);
 	}
 
 	void do_write(agenda_ptr agenda)
 	{
-		context_ptr ctx = content_->ctx_;
 		uint64_t start_offset = agenda->segment_size()*cur_segment_;
-		handle_t fl(open(content_->local_file_.c_str(), O_RDWR) | libc_die);
-		lseek64(fl.get(), start_offset, SEEK_SET) | libc_die;
+		transfer_file &fl=open_output(content_);
+		if (!seg_->data_.empty())
+			fl.write_at(&seg_->data_[0], seg_->data_.size(), start_offset);
 
-		size_t offset = 0;
-		while(offset<seg_->data_.size())
+		if (content_->resume_)
 		{
-			size_t chunk=std::min(seg_->data_.size()-offset, size_t(1024*1024));
-			size_t res=write(fl.get(), &seg_->data_[offset],
-							 chunk) | libc_die;
-			assert(res!=0);
-			offset+=res;
+			//The segment must be on disk before it's marked as done
+			fdatasync(fl.get()) | libc_die;
+			content_->resume_->mark_done(cur_segment_);
 		}
 	}
 };
@@ -165,6 +348,12 @@ public:
 
 	virtual void operator()(agenda_ptr agenda,
 							const std::vector<segment_ptr> &segments)
+	{
+		execute(agenda, segments) | die;
+	}
+
+	virtual result_code_t execute(agenda_ptr agenda,
+								  const std::vector<segment_ptr> &segments)
 	{
 		segment_ptr seg=segments.at(0);
 		size_t segment_size=agenda->segment_size();
@@ -179,9 +368,11 @@ public:
 
 		s3_connection conn(content_->ctx_);
 		seg->data_.resize(safe_cast<size_t>(size));
-		conn.download_data(content_->remote_path_, start_offset,
-						   &seg->data_[0], safe_cast<size_t>(size));
-		agenda->add_stat_counter("downloaded", size);
+		result_code_t res=conn.try_download_data(content_->remote_path_,
+			start_offset, &seg->data_[0], safe_cast<size_t>(size));
+		if (!res.ok())
+			return res;
+		agenda->add_stat_counter(statDownloaded, size);
 
 		VLOG(2) << "Finished downloading part " << cur_segment_ << " out of "
 				<< content_->num_segments_ << " of " << content_->remote_path_;
@@ -189,9 +380,33 @@ public:
 		//Now write the resulting segment
 		sync_task_ptr dl(new write_segment_task(content_, cur_segment_, seg));
 		agenda->schedule(dl);
+		return sok;
 	}
 };
 
+static download_content_ptr new_content(const context_ptr &ctx,
+	const file_desc &mod, const s3_path &remote, const bf::path &target,
+	size_t seg_num)
+{
+	download_content_ptr dc(new download_content());
+	dc->ctx_=ctx;
+	dc->mtime_=mod.mtime_;
+	dc->mode_=mod.mode_;
+	dc->num_segments_=seg_num;
+	dc->segments_read_=0;
+	dc->remote_size_=mod.remote_size_;
+	dc->raw_size_=mod.raw_size_;
+	dc->compressed_=mod.compressed_;
+	dc->has_crc32c_=mod.has_crc32c_;
+	dc->crc32c_=mod.crc32c_;
+	dc->seg_crcs_.resize(seg_num);
+	dc->have_seg_crcs_.resize(seg_num);
+
+	dc->remote_path_=remote;
+	dc->target_file_=target;
+	return dc;
+}
+
 void file_downloader::operator()(agenda_ptr agenda)
 {
 	if (delete_dir_)
@@ -221,10 +436,62 @@ void file_downloader::operator()(agenda_ptr agenda)
 			return; //TODO: add an optional MD5 check?
 	}
 
-	//We need to download the file
-	download_content_ptr dc(new download_content());
-	dc->ctx_=conn_;
+	download(agenda, mod);
+}
+
+void file_downloader::operator()(agenda_ptr agenda,
+								 const std::vector<segment_ptr> &segments)
+{
+	execute(agenda, segments) | die;
+}
+
+result_code_t file_downloader::execute(agenda_ptr agenda,
+									   const std::vector<segment_ptr> &segments)
+{
+	if (!fetch_whole_)
+	{
+		(*this)(agenda);
+		return sok;
+	}
+	if (delete_dir_)
+		bf::remove_all(path_);
 
+	//The metadata comes with the data, there's no need for a HEAD
+	segment_ptr seg=segments.at(0);
+	file_desc mod;
+	s3_connection conn(conn_);
+	result_code_t res=conn.try_download_object(remote_,
+		agenda->segment_size(), &seg->data_, &mod);
+	if (!res.ok())
+		return res;
+	if (!mod.found_)
+		err(errFatal) << "Document not found at: " << remote_;
+	if (seg->data_.size()!=mod.remote_size_)
+	{
+		VLOG(2) << remote_ << " has grown since it was listed";
+		download(agenda, mod);
+		return sok;
+	}
+	agenda->add_stat_counter(statDownloaded, seg->data_.size());
+
+	VLOG(2) << "Downloaded " << path_ << " from " << remote_
+			<< " with a single request";
+	download_content_ptr dc=new_content(conn_, mod, remote_, path_, 1);
+	create_output(dc, false);
+	if (!seg->data_.empty())
+		dc->out_file_->write_at(&seg->data_[0], seg->data_.size(), 0);
+
+	guard_t lock(dc->m_);
+	dc->seg_crcs_[0]=seg->data_.empty() ? 0 :
+		crc32c(0, &seg->data_[0], seg->data_.size());
+	dc->have_seg_crcs_[0]=true;
+	dc->segments_read_=1;
+	finish_download(dc, agenda);
+	return sok;
+}
+
+void file_downloader::download(agenda_ptr agenda, const file_desc &mod)
+{
 	size_t seg_size = agenda->segment_size();
 	size_t seg_num = safe_cast<size_t>(mod.remote_size_/seg_size +
 				((mod.remote_size_%seg_size)==0?0:1));
@@ -235,50 +502,57 @@ void file_downloader::operator()(agenda_ptr agenda)
 		assert(mod.remote_size_==0);
 		seg_num=1;
 	}
-
-	dc->mtime_=mod.mtime_;
-	dc->mode_=mod.mode_;
-	dc->num_segments_=seg_num;
-	dc->segments_read_=0;
-	dc->remote_size_=mod.remote_size_;
-	dc->raw_size_=mod.raw_size_;
-	dc->compressed_=mod.compressed_;
-
-	dc->remote_path_=remote_;
-	dc->target_file_=path_;
+	download_content_ptr dc=new_content(conn_, mod, remote_, path_, seg_num);
 
 	VLOG(2) << "Downloading " << path_ << " from " << remote_;
 
-	if (mod.compressed_)
-	{
-		path tmp_nm = conn_->scratch_dir_ /
-				bf::unique_path("scratchy-%%%%-%%%%-%%%%-%%%%-dl");
-		dc->local_file_=tmp_nm.c_str();
-	} else
+	if (conn_->resume_downloads_)
 	{
-		path tmp_nm = path_.string()+"-%%%%%%%%-es3tmp";
-		dc->local_file_=bf::unique_path(tmp_nm);
+		//Temp names must be stable, so that the next attempt finds them
+		if (mod.compressed_)
+		{
+			std::string key=remote_.bucket_+remote_.path_;
+			dc->local_file_=conn_->scratch_dir_ / ("scratchy-"+
+				compute_digest(key.c_str(), key.size()).md5_hex()+"-dl");
+		} else
+			dc->local_file_=path_.string()+"-es3tmp";
+
+		std::string header="es3-resume 1\n"+mod.etag_+"\n"
+				+int_to_string(mod.remote_size_)+"\n"
+				+int_to_string(seg_size)+"\n"
+				+int_to_string(seg_num)+"\n";
+		dc->resume_.reset(new resume_map(
+							  dc->local_file_.string()+".es3part",
+							  header, seg_num));
+
+		//The map is useless if the partial file is gone or truncated
+		uint64_t partial_size=0;
+		try
+		{
+			partial_size=file_size(dc->local_file_);
+		} catch(const bf::filesystem_error&) {}
+		if (dc->resume_->reused() && partial_size!=dc->remote_size_)
+			dc->resume_->reset();
 	}
 
+	if (dc->resume_ && dc->resume_->reused())
 	{
-		unlink(dc->local_file_.c_str()); //Prevent some access right foulups
-		handle_t fl(open(dc->local_file_.c_str(), O_RDWR|O_CREAT, 0600)
-					| libc_die2("Failed to create file "
-							   +dc->local_file_.string()));
-#ifndef __MACH__		
-		fallocate64(fl.get(), 0, 0, dc->remote_size_);
-#else
-		fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)dc->remote_size_};
-		// OK, perhaps we are too fragmented, allocate non-continuous
-	    store.fst_flags = F_ALLOCATEALL;
-	    int ret = fcntl(fl.get(), F_PREALLOCATE, &store);
-	    if (ret!=-1)
-			ftruncate(fl.get(), (off_t)dc->remote_size_);
-#endif
+		dc->segments_read_=dc->resume_->num_done();
+		VLOG(2) << "Resuming " << path_ << " from " << remote_ << ", "
+				<< dc->segments_read_ << " out of " << seg_num
+				<< " segments are already present";
+		if (dc->segments_read_==seg_num)
+		{
+			guard_t lock(dc->m_);
+			finish_download(dc, agenda);
+			return;
+		}
 	}
 
 	for(size_t f=0;f<seg_num;++f)
 	{
+		if (dc->resume_ && dc->resume_->is_done(f))
+			continue;
 		sync_task_ptr dl(new download_segment_task(dc, f));
 		agenda->schedule(dl);
 	}
@@ -32,6 +32,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "connection.h"
 #include "common.h"
 #include "agenda.h"
+#include "context.h"
 
 namespace es3 {
 
@@ -41,6 +42,7 @@ namespace es3 {
 		const bool delete_dir_;
 		const bf::path path_;
 		const s3_path remote_;
+		bool fetch_whole_;
 
 	public:
 		file_downloader(const context_ptr &conn,
@@ -48,10 +50,22 @@ namespace es3 {
 					  const s3_path &remote,
 					  bool delete_dir = false)
 			: conn_(conn), path_(path), remote_(remote),
-			  delete_dir_(delete_dir)
+			  delete_dir_(delete_dir), fetch_whole_()
 		{
 		}
 
+		//Called for the objects that are missing locally. Small ones are
+		//fetched with a single GET that also brings their metadata.
+		void set_listed_size(uint64_t size)
+		{
+			fetch_whole_=size<uint64_t(conn_->small_file_size_);
+		}
+
+		virtual size_t needs_segments() const { return fetch_whole_ ? 1 : 0; }
+		virtual void operator()(agenda_ptr agenda,
+								const std::vector<segment_ptr> &segments);
+		virtual result_code_t execute(agenda_ptr agenda,
+									  const std::vector<segment_ptr> &segments);
 		virtual void operator()(agenda_ptr agenda);
 		virtual void print_to(std::ostream &str)
 		{
@@ -59,6 +73,7 @@ namespace es3 {
 		}
 
 	private:
+		void download(agenda_ptr agenda, const file_desc &mod);
 	};
 
 	class local_file_deleter : public sync_task
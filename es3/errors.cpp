@@ -36,22 +36,33 @@ extern ES3LIB_PUBLIC const die_t es3::die=die_t();
 extern ES3LIB_PUBLIC const libc_die_t es3::libc_die=libc_die_t();
 extern ES3LIB_PUBLIC const result_code_t es3::sok=result_code_t();
 
+const char* es3::error_kind_name(error_kind_e kind)
+{
+	switch(kind)
+	{
+	case kindGeneric: return "generic";
+	case kindThrottled: return "throttled";
+	case kindServer: return "server";
+	case kindTimeout: return "timeout";
+	case kindNetwork: return "network";
+	case kindNoSuchUpload: return "no_such_upload";
+	default: return "unknown";
+	}
+}
+
 es3_exception::es3_exception(const result_code_t &code) : code_(code)
 {
-	std::stringstream s;
-	std::string lvl;
+	const char *lvl="INFO";
 	if (code.code()==errFatal)
 		lvl="ERROR";
 	else if (code.code()==errWarn)
 		lvl="WARN";
-	else
-		lvl="INFO";
-	s<<lvl<<": '"<<code_.desc()<<"'";
-	s.flush();
-	what_=s.str();
+	what_=std::string(lvl)+": '"+code_.desc()+"'";
 
-	//Backtrace exception
-	backtrace_it();
+	//Warnings are expected and retried, only real failures are worth
+	//the cost of a backtrace
+	if (code.code()==errFatal)
+		backtrace_it();
 }
 
 void es3::throw_libc_err(const std::string &desc)
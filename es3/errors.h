@@ -55,18 +55,34 @@ namespace es3 {
 		errNone,
 	};
 
+	//What has failed, the expected failures are retried
+	enum error_kind_e
+	{
+		kindGeneric,
+		kindThrottled, //The server asked us to slow down
+		kindServer, //Other 5xx responses
+		kindTimeout, //Request timeouts, idle connections closed by S3
+		kindNetwork, //Connection failures and other curl errors
+		kindNoSuchUpload, //The multipart upload has disappeared
+		errorKindsNum,
+	};
+	ES3LIB_PUBLIC const char* error_kind_name(error_kind_e kind);
+
 	class result_code_t
 	{
 	public:
-		result_code_t() : code_(errNone), desc_()
+		result_code_t() : code_(errNone), desc_(), retry_after_(-1),
+			kind_(kindGeneric)
 		{
 		}
 		result_code_t(const result_code_t &other) :
-			code_(other.code_), desc_(other.desc_)
+			code_(other.code_), desc_(other.desc_),
+			retry_after_(other.retry_after_), kind_(other.kind_)
 		{
 		}
-		result_code_t(code_e code, const std::string &desc="None") :
-			code_(code), desc_(desc)
+		result_code_t(code_e code, const std::string &desc="None",
+					  int retry_after=-1, error_kind_e kind=kindGeneric) :
+			code_(code), desc_(desc), retry_after_(retry_after), kind_(kind)
 		{
 
 		}
@@ -76,9 +92,15 @@ namespace es3 {
 		code_e code() const { return code_; }
 		std::string desc() const { return desc_; }
 		bool ok() const {return code_==errNone;}
+		//Non-negative if the server asked us to slow down, in that case
+		//it's the number of seconds to wait (0 - not specified)
+		int retry_after() const { return retry_after_; }
+		error_kind_e kind() const { return kind_; }
 	private:
 		code_e code_;
 		std::string desc_;
+		int retry_after_;
+		error_kind_e kind_;
 	};
 	extern ES3LIB_PUBLIC const result_code_t sok;
 
@@ -105,11 +127,14 @@ namespace es3 {
 	/**
 	  Usage - err(sOk) << "This is a description"
 	  */
-	struct err : public std::stringstream
+	struct err
 	{
-		err(code_e code) : code_(code) {}
+		err(code_e code, int retry_after=-1) :
+			code_(code), retry_after_(retry_after) {}
 
-		~err()
+		//Destructors are implicitly noexcept since C++11, so this can't
+		//inherit from std::stringstream
+		~err() noexcept(false)
 		{
 			//Yes, we're throwing from a destructor, but that's OK since
 			//if there's an exception already started then we have other
@@ -117,12 +142,26 @@ namespace es3 {
 			if (code_!=errNone)
 			{
 				boost::throw_exception(es3_exception(
-										   result_code_t(code_, str())));
+					result_code_t(code_, str_.str(), retry_after_)));
 			}
 		}
 
+		template<class T> err& operator << (const T &val)
+		{
+			str_ << val;
+			return *this;
+		}
+		err& operator << (std::ostream& (*manip)(std::ostream&))
+		{
+			str_ << manip;
+			return *this;
+		}
+		std::string str() const { return str_.str(); }
+
 	private:
 		code_e code_;
+		int retry_after_;
+		std::stringstream str_;
 	};
 
 	inline void operator | (const result_code_t &code, const die_t &)
@@ -0,0 +1,609 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "inventory.h"
+#include "sync.h"
+#include "errors.h"
+#include <boost/bind.hpp>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <zlib.h>
+
+using namespace es3;
+
+#define DEFAULT_SCHEMA "Bucket, Key, Size, LastModifiedDate, ETag"
+#define ARN_PREFIX "arn:aws:s3:::"
+
+static bool ends_with(const std::string &str, const std::string &suffix)
+{
+	return str.size()>=suffix.size() &&
+		str.compare(str.size()-suffix.size(), suffix.size(), suffix)==0;
+}
+
+static stringvec split_schema(const std::string &schema)
+{
+	stringvec res;
+	size_t start=0;
+	while(true)
+	{
+		size_t pos=schema.find(',', start);
+		res.push_back(trim(schema.substr(start, pos-start)));
+		if (pos==std::string::npos)
+			break;
+		start=pos+1;
+	}
+	return res;
+}
+
+//Inventory reports have their keys URL-encoded
+static std::string url_decode(const std::string &str)
+{
+	std::string res;
+	res.reserve(str.size());
+	for(size_t f=0;f<str.size();++f)
+	{
+		char c=str[f];
+		if (c=='+')
+			res.push_back(' ');
+		else if (c=='%' && f+2<str.size() &&
+				 isxdigit(str[f+1]) && isxdigit(str[f+2]))
+		{
+			res.push_back(char(strtol(str.substr(f+1, 2).c_str(), 0, 16)));
+			f+=2;
+		} else
+			res.push_back(c);
+	}
+	return res;
+}
+
+static void split_csv(const std::string &line, stringvec *res)
+{
+	res->clear();
+	std::string cur;
+	bool quoted=false;
+	for(size_t f=0;f<line.size();++f)
+	{
+		char c=line[f];
+		if (quoted)
+		{
+			if (c!='"')
+				cur.push_back(c);
+			else if (f+1<line.size() && line[f+1]=='"')
+			{
+				cur.push_back('"');
+				++f;
+			} else
+				quoted=false;
+		} else if (c=='"')
+			quoted=true;
+		else if (c==',')
+		{
+			res->push_back(cur);
+			cur.clear();
+		} else
+			cur.push_back(c);
+	}
+	res->push_back(cur);
+}
+
+namespace es3 {
+	struct inventory_schema
+	{
+		int bucket_, key_, size_, mtime_, is_latest_, is_delete_marker_;
+
+		explicit inventory_schema(const std::string &schema)
+			: bucket_(-1), key_(-1), size_(-1), mtime_(-1),
+			  is_latest_(-1), is_delete_marker_(-1)
+		{
+			stringvec cols=split_schema(schema);
+			for(size_t f=0;f<cols.size();++f)
+			{
+				if (cols[f]=="Bucket")
+					bucket_=f;
+				else if (cols[f]=="Key")
+					key_=f;
+				else if (cols[f]=="Size")
+					size_=f;
+				else if (cols[f]=="LastModifiedDate")
+					mtime_=f;
+				else if (cols[f]=="IsLatest")
+					is_latest_=f;
+				else if (cols[f]=="IsDeleteMarker")
+					is_delete_marker_=f;
+			}
+			if (key_<0 || size_<0 || mtime_<0)
+				err(errFatal) << "Inventory schema '" << schema
+							  << "' lacks Key, Size or LastModifiedDate";
+		}
+	};
+
+	struct inventory_file
+	{
+		bool remote_;
+		s3_path path_;
+		bf::path local_;
+		bool gzipped_;
+		std::string schema_;
+	};
+
+	/**
+	  Splits the (possibly gzipped) stream of a data file into rows and
+	  adds the objects under the root to the tree.
+	  */
+	class inventory_parser
+	{
+		const s3_directory_ptr root_;
+		const std::string prefix_;
+		const inventory_schema schema_;
+		const bool gzipped_;
+		z_stream zs_;
+		bool member_done_;
+
+		std::string line_;
+		stringvec fields_;
+		std::string last_dir_path_;
+		s3_directory_ptr last_dir_;
+	public:
+		uint64_t rows_, objects_;
+
+		inventory_parser(s3_directory_ptr root, const std::string &prefix,
+						 const std::string &schema, bool gzipped)
+			: root_(root), prefix_(prefix), schema_(schema),
+			  gzipped_(gzipped), member_done_(true), rows_(), objects_()
+		{
+			memset(&zs_, 0, sizeof(zs_));
+			//16+ makes zlib expect the gzip wrapper
+			if (gzipped_ && inflateInit2(&zs_, 16+MAX_WBITS)!=Z_OK)
+				err(errFatal) << "Can't initialize zlib";
+		}
+
+		~inventory_parser()
+		{
+			if (gzipped_)
+				inflateEnd(&zs_);
+		}
+
+		void feed(const char *data, size_t len)
+		{
+			if (!gzipped_)
+			{
+				feed_text(data, len);
+				return;
+			}
+
+			char buf[65536];
+			zs_.next_in=(Bytef*)data;
+			zs_.avail_in=len;
+			while(true)
+			{
+				zs_.next_out=(Bytef*)buf;
+				zs_.avail_out=sizeof(buf);
+				int res=inflate(&zs_, Z_NO_FLUSH);
+				if (res!=Z_OK && res!=Z_STREAM_END && res!=Z_BUF_ERROR)
+					err(errFatal) << "Corrupted gzip data in inventory";
+				if (zs_.avail_out!=sizeof(buf))
+					member_done_=false;
+				feed_text(buf, sizeof(buf)-zs_.avail_out);
+
+				if (res==Z_STREAM_END)
+				{
+					//Data files can consist of several gzip members
+					inflateReset(&zs_);
+					member_done_=true;
+					if (zs_.avail_in==0)
+						break;
+				} else if (zs_.avail_out!=0 || res==Z_BUF_ERROR)
+					break;
+			}
+		}
+
+		void finish()
+		{
+			if (gzipped_ && !member_done_)
+				err(errFatal) << "Truncated gzip data in inventory";
+			if (!line_.empty())
+				on_line(line_);
+			line_.clear();
+		}
+	private:
+		void feed_text(const char *data, size_t len)
+		{
+			const char *end=data+len;
+			while(data!=end)
+			{
+				const char *eol=(const char*)memchr(data, '\n', end-data);
+				if (!eol)
+				{
+					line_.append(data, end);
+					break;
+				}
+				line_.append(data, eol);
+				on_line(line_);
+				line_.clear();
+				data=eol+1;
+			}
+		}
+
+		void on_line(std::string &line)
+		{
+			if (!line.empty() && *line.rbegin()=='\r')
+				line.resize(line.size()-1);
+			if (line.empty())
+				return;
+			rows_++;
+
+			split_csv(line, &fields_);
+			if (fields_.size()<=size_t(schema_.key_) ||
+					fields_.size()<=size_t(schema_.size_) ||
+					fields_.size()<=size_t(schema_.mtime_))
+				err(errFatal) << "Bad inventory row: " << line;
+			//A report for another bucket would describe a foreign tree
+			if (schema_.bucket_>=0 &&
+					(fields_.size()<=size_t(schema_.bucket_) ||
+					 fields_[schema_.bucket_]!=root_->absolute_name_.bucket_))
+				err(errFatal) << "Inventory row is not from the bucket "
+							  << root_->absolute_name_.bucket_ << ": " << line;
+			//Only the current versions of the objects are of interest
+			if (schema_.is_latest_>=0 &&
+					size_t(schema_.is_latest_)<fields_.size() &&
+					fields_[schema_.is_latest_]=="false")
+				return;
+			if (schema_.is_delete_marker_>=0 &&
+					size_t(schema_.is_delete_marker_)<fields_.size() &&
+					fields_[schema_.is_delete_marker_]=="true")
+				return;
+
+			std::string path="/"+url_decode(fields_[schema_.key_]);
+			if (path.compare(0, prefix_.size(), prefix_)!=0 ||
+					*path.rbegin()=='/')
+				return;
+
+			const std::string &root_path=root_->absolute_name_.path_;
+			size_t leaf=path.find_last_of('/');
+			std::string dir_path=path.substr(root_path.size(),
+											 leaf+1-root_path.size());
+			//Reports are sorted by key, so the rows mostly come in runs
+			//from the same directory
+			if (!last_dir_ || dir_path!=last_dir_path_)
+			{
+				last_dir_=find_dir(dir_path);
+				last_dir_path_=dir_path;
+			}
+
+			s3_file_ptr fl(new s3_file());
+			fl->name_=path.substr(leaf+1);
+			fl->absolute_name_=derive(last_dir_->absolute_name_, fl->name_);
+			fl->size_=strtoull(fields_[schema_.size_].c_str(), 0, 10);
+			fl->mtime_str_=fields_[schema_.mtime_];
+			fl->parent_=last_dir_;
+			last_dir_->files_[fl->name_]=fl;
+			objects_++;
+		}
+
+		s3_directory_ptr find_dir(const std::string &rel_path)
+		{
+			s3_directory_ptr cur=root_;
+			size_t start=0;
+			while(start<rel_path.size())
+			{
+				size_t pos=rel_path.find('/', start);
+				std::string name=rel_path.substr(start, pos-start);
+				start=pos+1;
+				if (name.empty())
+					continue;
+
+				s3_directory_ptr next=try_get(cur->subdirs_, name);
+				if (!next)
+				{
+					next.reset(new s3_directory());
+					next->name_=name;
+					next->absolute_name_=derive(cur->absolute_name_,
+												name+"/");
+					next->parent_=cur;
+					cur->subdirs_[name]=next;
+				}
+				cur=next;
+			}
+			return cur;
+		}
+	};
+
+	class inventory_file_task : public sync_task
+	{
+		const inventory_loader_ptr loader_;
+		const inventory_file file_;
+	public:
+		inventory_file_task(const inventory_loader_ptr &loader,
+							const inventory_file &file)
+			: loader_(loader), file_(file)
+		{
+		}
+
+		virtual task_type_e get_class() const { return taskUnbound; }
+
+		virtual void operator()(agenda_ptr agenda)
+		{
+			s3_directory_ptr part=loader_->new_part();
+			inventory_parser parser(part, loader_->root().path_,
+									file_.schema_, file_.gzipped_);
+			if (file_.remote_)
+			{
+				VLOG(2) << "Reading inventory " << source();
+				s3_connection conn(loader_->context());
+				conn.read_object(file_.path_, boost::bind(
+					&inventory_parser::feed, &parser, _1, _2));
+			} else
+			{
+				VLOG(2) << "Reading inventory " << source();
+				handle_t fl(open(file_.local_.c_str(), O_RDONLY)
+							| libc_die2("Failed to open "+
+										file_.local_.string()));
+				std::vector<char> buf(1024*1024);
+				while(true)
+				{
+					ssize_t ln=read(fl.get(), &buf[0], buf.size()) | libc_die;
+					if (ln==0)
+						break;
+					parser.feed(&buf[0], ln);
+				}
+			}
+			parser.finish();
+			VLOG(1) << "Inventory " << source() << ": " << parser.rows_
+					<< " rows, " << parser.objects_ << " objects under "
+					<< loader_->root();
+			//Add the part only now, a retried task starts it afresh
+			loader_->add_part(part);
+		}
+
+		virtual void print_to(std::ostream &str)
+		{
+			str << "Read inventory " << source();
+		}
+
+		std::string source() const
+		{
+			std::ostringstream str;
+			if (file_.remote_)
+				str << file_.path_;
+			else
+				str << file_.local_.string();
+			return str.str();
+		}
+	};
+}; //namespace es3
+
+/**
+  Calls the callback for each "name": "value" pair with a string value
+  in the document. Good enough for the flat manifests of the reports.
+  */
+static void scan_json_strings(const std::string &doc,
+	const boost::function<void(const std::string&, const std::string&)> &cb)
+{
+	std::string last, cur;
+	bool after_colon=false, have_name=false;
+	for(size_t f=0;f<doc.size();++f)
+	{
+		char c=doc[f];
+		if (c==':')
+		{
+			after_colon=have_name;
+			continue;
+		}
+		if (c!='"')
+		{
+			if (!isspace(c))
+				after_colon=have_name=false;
+			continue;
+		}
+
+		cur.clear();
+		for(++f;f<doc.size() && doc[f]!='"';++f)
+		{
+			if (doc[f]=='\\' && f+1<doc.size())
+				++f;
+			cur.push_back(doc[f]);
+		}
+		if (after_colon)
+		{
+			cb(last, cur);
+			after_colon=have_name=false;
+		} else
+		{
+			last=cur;
+			have_name=true;
+		}
+	}
+}
+
+struct manifest_info
+{
+	std::string bucket_, source_bucket_, schema_, format_;
+	stringvec keys_;
+
+	void on_value(const std::string &name, const std::string &value)
+	{
+		if (name=="sourceBucket")
+			source_bucket_=value;
+		else if (name=="destinationBucket")
+			bucket_=value.find(ARN_PREFIX)==0 ?
+						value.substr(strlen(ARN_PREFIX)) : value;
+		else if (name=="fileSchema")
+			schema_=value;
+		else if (name=="fileFormat")
+			format_=value;
+		else if (name=="key")
+			keys_.push_back(value);
+	}
+};
+
+inventory_loader::inventory_loader(const context_ptr &ctx, const s3_path &root)
+	: ctx_(ctx), root_(root)
+{
+}
+
+s3_directory_ptr inventory_loader::new_part() const
+{
+	//Mirrors list_files_shallow: the tree starts at the directory
+	//containing the root
+	s3_directory_ptr res(new s3_directory());
+	res->absolute_name_=root_;
+	if (*root_.path_.rbegin()!='/')
+		res->absolute_name_.path_=
+				root_.path_.substr(0, root_.path_.find_last_of('/')+1);
+	return res;
+}
+
+void inventory_loader::add_part(s3_directory_ptr part)
+{
+	guard_t lock(m_);
+	parts_.push_back(part);
+}
+
+void inventory_loader::schedule(const std::string &source, agenda_ptr ag)
+{
+	inventory_file file;
+	file.remote_=source.find("s3://")==0;
+	file.gzipped_=ends_with(source, ".gz");
+	file.schema_=DEFAULT_SCHEMA;
+	if (file.remote_)
+	{
+		file.path_=parse_path(source);
+		file.path_.zone_=s3_connection(ctx_).find_region(file.path_.bucket_);
+	} else
+		file.local_=source;
+
+	if (!ends_with(source, ".json"))
+	{
+		ag->schedule(sync_task_ptr(new inventory_file_task(
+			shared_from_this(), file)));
+		return;
+	}
+
+	//A manifest, it's small enough to be read right away
+	std::string doc;
+	if (file.remote_)
+		doc=s3_connection(ctx_).read_fully("GET", file.path_);
+	else
+	{
+		std::ifstream in(source.c_str());
+		if (!in)
+			err(errFatal) << "Failed to open " << source;
+		doc.assign(std::istreambuf_iterator<char>(in),
+				   std::istreambuf_iterator<char>());
+	}
+
+	manifest_info info;
+	scan_json_strings(doc, boost::bind(&manifest_info::on_value,
+									   &info, _1, _2));
+	if (!info.format_.empty() && info.format_!="CSV")
+		err(errFatal) << "Unsupported inventory format " << info.format_
+					  << " in " << source << ", only CSV can be read";
+	if (info.bucket_.empty())
+		err(errFatal) << "No destinationBucket in " << source;
+	if (!info.source_bucket_.empty() && info.source_bucket_!=root_.bucket_)
+		err(errFatal) << "Inventory " << source << " is for the bucket "
+					  << info.source_bucket_ << ", not for " << root_.bucket_;
+
+	s3_path data_root;
+	data_root.bucket_=info.bucket_;
+	data_root.zone_=s3_connection(ctx_).find_region(info.bucket_);
+	for(auto iter=info.keys_.begin();iter!=info.keys_.end();++iter)
+	{
+		inventory_file data;
+		data.gzipped_=ends_with(*iter, ".gz");
+		data.schema_=info.schema_.empty() ? DEFAULT_SCHEMA : info.schema_;
+		data.remote_=true;
+		data.path_=derive(data_root, "/"+*iter);
+
+		//A local manifest may have been downloaded with its data files
+		if (!file.remote_)
+		{
+			bf::path dir=file.local_.parent_path();
+			bf::path leaf=bf::path(*iter).filename();
+			if (bf::exists(dir / leaf))
+				data.local_=dir / leaf;
+			else if (bf::exists(dir / "files" / leaf))
+				data.local_=dir / "files" / leaf;
+			data.remote_=data.local_.empty();
+		}
+		ag->schedule(sync_task_ptr(new inventory_file_task(
+			shared_from_this(), data)));
+	}
+}
+
+//Unlike merge_to_left, this allows the same object in several parts
+static void merge_parts(s3_directory_ptr left, s3_directory_ptr right)
+{
+	for(auto iter=right->files_.begin();iter!=right->files_.end();++iter)
+	{
+		iter->second->parent_=left;
+		left->files_[iter->first]=iter->second;
+	}
+	for(auto iter=right->subdirs_.begin();iter!=right->subdirs_.end();++iter)
+	{
+		s3_directory_ptr cur=try_get(left->subdirs_, iter->first);
+		if (cur)
+			merge_parts(cur, iter->second);
+		else
+		{
+			iter->second->parent_=left;
+			left->subdirs_[iter->first]=iter->second;
+		}
+	}
+}
+
+s3_directory_ptr inventory_loader::result()
+{
+	guard_t lock(m_);
+	if (parts_.empty())
+		return new_part();
+	for(size_t f=1;f<parts_.size();++f)
+		merge_parts(parts_[0], parts_[f]);
+	parts_.resize(1);
+	return parts_[0];
+}
+
+s3_directory_ptr es3::load_inventory(const context_ptr &ctx, agenda_ptr ag,
+	const s3_path &root, const stringvec &sources, const stringvec &relist,
+	path_filter_ptr filter)
+{
+	inventory_loader_ptr loader(new inventory_loader(ctx, root));
+	for(auto iter=sources.begin();iter!=sources.end();++iter)
+		loader->schedule(*iter, ag);
+	if (ag->run() || ag->tasks_count())
+		return s3_directory_ptr();
+
+	s3_directory_ptr res=loader->result();
+	//The objects written after the report was made
+	for(auto iter=relist.begin();iter!=relist.end();++iter)
+		schedule_relist(res, *iter, ctx, ag, filter);
+	if (ag->run() || ag->tasks_count())
+		return s3_directory_ptr();
+	return res;
+}
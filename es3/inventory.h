@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include "common.h"
+#include "agenda.h"
+#include "connection.h"
+#include "path_filter.h"
+#include <boost/enable_shared_from_this.hpp>
+
+namespace es3 {
+	/**
+	  Builds the remote tree from S3 Inventory reports instead of listing
+	  it. The data files of a report are read in parallel, each of them
+	  into its own tree, and merged at the end.
+	  */
+	class inventory_loader :
+		public boost::enable_shared_from_this<inventory_loader>
+	{
+		context_ptr ctx_;
+		const s3_path root_;
+
+		mutex_t m_;
+		std::vector<s3_directory_ptr> parts_;
+	public:
+		inventory_loader(const context_ptr &ctx, const s3_path &root);
+
+		/**
+		  The source is either the manifest.json of a report or a single
+		  CSV data file (gzipped if its name ends with .gz), on the local
+		  disk or in S3.
+		  */
+		void schedule(const std::string &source, agenda_ptr ag);
+		s3_directory_ptr result();
+
+		const s3_path& root() const { return root_; }
+		context_ptr context() const { return ctx_; }
+		s3_directory_ptr new_part() const;
+		void add_part(s3_directory_ptr part);
+	};
+	typedef boost::shared_ptr<inventory_loader> inventory_loader_ptr;
+
+	/**
+	  Reads the inventory and lists again the directories under the root
+	  that have changed since the report was made. Returns an empty
+	  pointer if some of the tasks have failed.
+	  */
+	s3_directory_ptr load_inventory(const context_ptr &ctx, agenda_ptr ag,
+		const s3_path &root, const stringvec &sources,
+		const stringvec &relist, path_filter_ptr filter=path_filter_ptr());
+}; //namespace es3
+
+#endif //INVENTORY_H
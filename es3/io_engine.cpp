@@ -0,0 +1,585 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "io_engine.h"
+#include "errors.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define URING_ENTRIES 256
+//Max number of requests passed to the kernel in one system call
+#define URING_BATCH 32
+
+using namespace es3;
+
+size_t pread_engine::read_at(int fd, char *buf, size_t len, uint64_t offset)
+{
+	size_t done=0;
+	while(done<len)
+	{
+		ssize_t res=pread64(fd, buf+done, len-done, offset+done);
+		if (res<0 && errno==EINTR)
+			continue;
+		res | libc_die2("Failed to read a file");
+		if (res==0)
+			break; //End of file
+		done+=res;
+	}
+	return done;
+}
+
+void pread_engine::write_at(int fd, const char *buf, size_t len,
+							uint64_t offset)
+{
+	size_t done=0;
+	while(done<len)
+	{
+		ssize_t res=pwrite64(fd, buf+done, len-done, offset+done);
+		if (res<0 && errno==EINTR)
+			continue;
+		res | libc_die2("Failed to write a file");
+		done+=res;
+	}
+}
+
+#ifdef HAVE_IO_URING
+namespace es3
+{
+	/**
+	  io_uring backend, talking to the kernel directly. Requests are split
+	  into chunks that are all submitted at once, so a single thread keeps
+	  many I/Os in flight. A dedicated thread reaps the completions and
+	  wakes up the submitters.
+	  */
+	class uring_engine : public io_engine
+	{
+		struct request_batch
+		{
+			mutex_t m_;
+			boost::condition_variable done_;
+			size_t pending_;
+		};
+		struct request
+		{
+			request_batch *batch_;
+			int fd_;
+			char *buf_;
+			size_t len_;
+			uint64_t offset_;
+			int res_;
+		};
+
+		int ring_fd_;
+		unsigned sq_entries_;
+		unsigned *sq_head_, *sq_tail_, *sq_mask_, *sq_array_;
+		unsigned *cq_head_, *cq_tail_, *cq_mask_;
+		struct io_uring_sqe *sqes_;
+		struct io_uring_cqe *cqes_;
+
+		mutex_t sq_m_; //Protects the submission queue {
+		boost::condition_variable space_;
+		size_t in_flight_;
+		//}
+
+		pread_engine fallback_;
+		boost::scoped_ptr<boost::thread> reaper_;
+	public:
+		uring_engine() : ring_fd_(-1), in_flight_() {}
+		//The engine lives until the process exits, so there's no teardown
+		bool init();
+
+		virtual size_t read_at(int fd, char *buf, size_t len,
+							   uint64_t offset);
+		virtual void write_at(int fd, const char *buf, size_t len,
+							  uint64_t offset);
+		virtual const char* name() const { return "io_uring"; }
+	private:
+		void submit_all(std::vector<request> &reqs, int opcode);
+		void reap();
+	};
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+							  unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+				   NULL, 0);
+}
+
+bool uring_engine::init()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_fd_=syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring_fd_<0)
+		return false;
+
+	//Positional reads and writes are needed (Linux 5.6+)
+	size_t probe_sz=sizeof(struct io_uring_probe)+
+			256*sizeof(struct io_uring_probe_op);
+	std::vector<char> probe_buf(probe_sz, 0);
+	struct io_uring_probe *probe=(struct io_uring_probe*)&probe_buf[0];
+	if (syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PROBE,
+				probe, 256)<0 || probe->last_op<IORING_OP_WRITE ||
+			!(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+			!(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+	{
+		close(ring_fd_);
+		return false;
+	}
+
+	sq_entries_=params.sq_entries;
+	size_t sq_size=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+	size_t cq_size=params.cq_off.cqes+
+			params.cq_entries*sizeof(struct io_uring_cqe);
+	bool single=params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		sq_size=cq_size=std::max(sq_size, cq_size);
+
+	char *sq_ptr=(char*)mmap(0, sq_size, PROT_READ|PROT_WRITE,
+							 MAP_SHARED|MAP_POPULATE, ring_fd_,
+							 IORING_OFF_SQ_RING);
+	if (sq_ptr==MAP_FAILED)
+	{
+		close(ring_fd_);
+		return false;
+	}
+	char *cq_ptr=sq_ptr;
+	if (!single)
+	{
+		cq_ptr=(char*)mmap(0, cq_size, PROT_READ|PROT_WRITE,
+						   MAP_SHARED|MAP_POPULATE, ring_fd_,
+						   IORING_OFF_CQ_RING);
+		if (cq_ptr==MAP_FAILED)
+		{
+			close(ring_fd_);
+			return false;
+		}
+	}
+	sqes_=(struct io_uring_sqe*)mmap(0,
+		params.sq_entries*sizeof(struct io_uring_sqe),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd_,
+		IORING_OFF_SQES);
+	if (sqes_==MAP_FAILED)
+	{
+		close(ring_fd_);
+		return false;
+	}
+
+	sq_head_=(unsigned*)(sq_ptr+params.sq_off.head);
+	sq_tail_=(unsigned*)(sq_ptr+params.sq_off.tail);
+	sq_mask_=(unsigned*)(sq_ptr+params.sq_off.ring_mask);
+	sq_array_=(unsigned*)(sq_ptr+params.sq_off.array);
+	cq_head_=(unsigned*)(cq_ptr+params.cq_off.head);
+	cq_tail_=(unsigned*)(cq_ptr+params.cq_off.tail);
+	cq_mask_=(unsigned*)(cq_ptr+params.cq_off.ring_mask);
+	cqes_=(struct io_uring_cqe*)(cq_ptr+params.cq_off.cqes);
+
+	reaper_.reset(new boost::thread(boost::bind(&uring_engine::reap, this)));
+	return true;
+}
+
+void uring_engine::submit_all(std::vector<request> &reqs, int opcode)
+{
+	request_batch batch;
+	batch.pending_=reqs.size();
+	size_t unsubmitted=0;
+	int error=0;
+
+	for(size_t pos=0;pos<reqs.size() && !error;)
+	{
+		size_t num=std::min<size_t>(reqs.size()-pos, URING_BATCH);
+
+		u_guard_t lock(sq_m_);
+		//The completion queue is twice as large, so it can't overflow
+		while(in_flight_+num>sq_entries_)
+			space_.wait(lock);
+
+		unsigned tail=*sq_tail_;
+		for(size_t f=0;f<num;++f)
+		{
+			request &req=reqs[pos+f];
+			req.batch_=&batch;
+			unsigned idx=(tail+f) & *sq_mask_;
+			struct io_uring_sqe *sqe=&sqes_[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode=opcode;
+			sqe->fd=req.fd_;
+			sqe->off=req.offset_;
+			sqe->addr=(uint64_t)(uintptr_t)req.buf_;
+			sqe->len=req.len_;
+			sqe->user_data=(uint64_t)(uintptr_t)&req;
+			sq_array_[idx]=idx;
+		}
+		__atomic_store_n(sq_tail_, tail+num, __ATOMIC_RELEASE);
+		in_flight_+=num;
+
+		unsigned submitted=0;
+		while(submitted<num)
+		{
+			int res=sys_io_uring_enter(ring_fd_, num-submitted, 0, 0);
+			if (res<0 && (errno==EINTR || errno==EAGAIN || errno==EBUSY))
+				continue;
+			if (res<0)
+			{
+				//Take back the entries that the kernel hasn't consumed,
+				//nobody else can add entries while we hold the lock
+				error=errno;
+				__atomic_store_n(sq_tail_, tail+submitted, __ATOMIC_RELEASE);
+				in_flight_-=num-submitted;
+				space_.notify_all();
+				unsubmitted=reqs.size()-pos-submitted;
+				break;
+			}
+			submitted+=res;
+		}
+		pos+=num;
+	}
+
+	//The requests in flight point into the buffers and the batch, they
+	//must complete even if the rest couldn't be submitted
+	{
+		u_guard_t lock(batch.m_);
+		batch.pending_-=unsubmitted;
+		while(batch.pending_)
+			batch.done_.wait(lock);
+	}
+	if (error)
+	{
+		errno=error;
+		throw_libc_err("Failed to submit I/O requests");
+	}
+}
+
+void uring_engine::reap()
+{
+	while(true)
+	{
+		int res=sys_io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS);
+		if (res<0 && errno!=EINTR)
+		{
+			VLOG(0) << "io_uring wait failed: " << strerror(errno);
+			sleep(1);
+		}
+
+		unsigned head=*cq_head_;
+		unsigned tail=__atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+		size_t reaped=0;
+		for(;head!=tail;++head, ++reaped)
+		{
+			struct io_uring_cqe *cqe=&cqes_[head & *cq_mask_];
+			request *req=(request*)(uintptr_t)cqe->user_data;
+			req->res_=cqe->res;
+
+			guard_t lock(req->batch_->m_);
+			if (--req->batch_->pending_==0)
+				req->batch_->done_.notify_all();
+		}
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+		if (reaped)
+		{
+			guard_t lock(sq_m_);
+			in_flight_-=reaped;
+			space_.notify_all();
+		}
+	}
+}
+
+size_t uring_engine::read_at(int fd, char *buf, size_t len, uint64_t offset)
+{
+	std::vector<request> reqs;
+	for(size_t pos=0;pos<len;pos+=IO_ENGINE_CHUNK)
+	{
+		request req={0, fd, buf+pos, std::min<size_t>(len-pos,
+			IO_ENGINE_CHUNK), offset+pos, 0};
+		reqs.push_back(req);
+	}
+	submit_all(reqs, IORING_OP_READ);
+
+	size_t done=0;
+	for(auto iter=reqs.begin();iter!=reqs.end();++iter)
+	{
+		if (iter->res_<0)
+		{
+			errno=-iter->res_;
+			throw_libc_err("Failed to read a file");
+		}
+		done+=iter->res_;
+		//Short reads are normal only at the end of the file, the rest is
+		//read synchronously and returns quickly if it's the EOF
+		if (size_t(iter->res_)<iter->len_)
+			return done+fallback_.read_at(fd, buf+done, len-done,
+										  offset+done);
+	}
+	return done;
+}
+
+void uring_engine::write_at(int fd, const char *buf, size_t len,
+							uint64_t offset)
+{
+	std::vector<request> reqs;
+	for(size_t pos=0;pos<len;pos+=IO_ENGINE_CHUNK)
+	{
+		request req={0, fd, const_cast<char*>(buf+pos),
+			std::min<size_t>(len-pos, IO_ENGINE_CHUNK), offset+pos, 0};
+		reqs.push_back(req);
+	}
+	submit_all(reqs, IORING_OP_WRITE);
+
+	for(auto iter=reqs.begin();iter!=reqs.end();++iter)
+	{
+		if (iter->res_<0)
+		{
+			errno=-iter->res_;
+			throw_libc_err("Failed to write a file");
+		}
+		if (size_t(iter->res_)<iter->len_)
+			fallback_.write_at(fd, iter->buf_+iter->res_,
+							   iter->len_-iter->res_,
+							   iter->offset_+iter->res_);
+	}
+}
+#endif //HAVE_IO_URING
+
+namespace es3
+{
+	//Aligned buffers for O_DIRECT requests are expensive to allocate, so
+	//they are reused
+	class bounce_pool
+	{
+		mutex_t m_;
+		std::vector<char*> free_;
+	public:
+		char* get()
+		{
+			{
+				guard_t lock(m_);
+				if (!free_.empty())
+				{
+					char *res=free_.back();
+					free_.pop_back();
+					return res;
+				}
+			}
+			void *res=0;
+			if (posix_memalign(&res, DIRECT_IO_ALIGN, DIRECT_IO_BUFFER))
+				err(errFatal) << "Can't allocate an aligned buffer";
+			return (char*)res;
+		}
+
+		void put(char *buf)
+		{
+			guard_t lock(m_);
+			free_.push_back(buf);
+		}
+	};
+
+	struct bounce_buffer
+	{
+		bounce_pool &pool_;
+		char *data_;
+
+		bounce_buffer(bounce_pool &pool) : pool_(pool), data_(pool.get()) {}
+		~bounce_buffer() { pool_.put(data_); }
+	};
+}
+
+static bounce_pool& get_bounce_pool()
+{
+	static bounce_pool pool;
+	return pool;
+}
+
+static uint64_t align_down(uint64_t val)
+{
+	return val & ~uint64_t(DIRECT_IO_ALIGN-1);
+}
+
+static uint64_t align_up(uint64_t val)
+{
+	return align_down(val+DIRECT_IO_ALIGN-1);
+}
+
+transfer_file::transfer_file(const bf::path &path, int flags, bool direct)
+	: owned_(open(path.c_str(), flags, 0600)
+			 | libc_die2("Failed to open "+path.string())),
+	  fd_(owned_.get()), direct_fd_(-1), drop_cache_(direct)
+{
+#ifdef O_DIRECT
+	//Not every filesystem supports O_DIRECT (e.g. tmpfs), it's fine to
+	//fall back to dropping the cache
+	if (direct)
+		direct_fd_=open(path.c_str(), (flags & ~(O_CREAT|O_TRUNC))|O_DIRECT);
+#endif
+}
+
+transfer_file::transfer_file(int fd, bool direct)
+	: fd_(fd), direct_fd_(-1), drop_cache_(direct)
+{
+#if defined(O_DIRECT) && defined(__linux__)
+	//Reopening through /proc gives a separate O_DIRECT description, it
+	//works for unnamed files too
+	if (direct)
+		direct_fd_=open(("/proc/self/fd/"+int_to_string(fd)).c_str(),
+						O_RDWR|O_DIRECT);
+#endif
+}
+
+transfer_file::~transfer_file()
+{
+	if (direct_fd_>=0)
+		close(direct_fd_);
+}
+
+void transfer_file::drop_cached(uint64_t offset, uint64_t len, bool written)
+{
+	if (!drop_cache_ || !len)
+		return;
+#ifdef __linux__
+	//Dirty pages can't be dropped, start the writeback and wait for it
+	if (written)
+		sync_file_range(fd_, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE|
+						SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+	if (written)
+		fdatasync(fd_);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd_, offset, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+size_t transfer_file::read_at(char *buf, size_t len, uint64_t offset)
+{
+	if (!is_direct())
+	{
+		size_t res=get_io_engine().read_at(fd_, buf, len, offset);
+		drop_cached(offset, res, false);
+		return res;
+	}
+
+	//Read the aligned range around the request and copy the data out
+	bounce_buffer bounce(get_bounce_pool());
+	size_t done=0;
+	while(done<len)
+	{
+		uint64_t start=align_down(offset+done);
+		size_t skip=offset+done-start;
+		size_t chunk=std::min<uint64_t>(align_up(skip+len-done),
+										DIRECT_IO_BUFFER);
+		size_t res=get_io_engine().read_at(direct_fd_, bounce.data_, chunk,
+										   start);
+		if (res<=skip)
+			break; //End of file
+		size_t useful=std::min(res-skip, len-done);
+		memcpy(buf+done, bounce.data_+skip, useful);
+		done+=useful;
+		if (res<chunk)
+			break;
+	}
+	return done;
+}
+
+void transfer_file::write_at(const char *buf, size_t len, uint64_t offset)
+{
+	//Only whole aligned blocks can be written directly. The blocks on
+	//the edges might be shared with other writers, so they go through
+	//the cache.
+	uint64_t direct_start=align_up(offset);
+	uint64_t direct_end=align_down(offset+len);
+	if (!is_direct() || direct_start>=direct_end)
+	{
+		get_io_engine().write_at(fd_, buf, len, offset);
+		drop_cached(offset, len, true);
+		return;
+	}
+
+	if (direct_start>offset)
+	{
+		get_io_engine().write_at(fd_, buf, direct_start-offset, offset);
+		drop_cached(offset, direct_start-offset, true);
+	}
+
+	bounce_buffer bounce(get_bounce_pool());
+	for(uint64_t pos=direct_start;pos<direct_end;pos+=DIRECT_IO_BUFFER)
+	{
+		size_t chunk=std::min<uint64_t>(direct_end-pos, DIRECT_IO_BUFFER);
+		memcpy(bounce.data_, buf+(pos-offset), chunk);
+		get_io_engine().write_at(direct_fd_, bounce.data_, chunk, pos);
+	}
+
+	if (direct_end<offset+len)
+	{
+		get_io_engine().write_at(fd_, buf+(direct_end-offset),
+								 offset+len-direct_end, direct_end);
+		drop_cached(direct_end, offset+len-direct_end, true);
+	}
+}
+
+static io_engine *cur_engine=0;
+
+void es3::init_io_engine(io_engine_e type)
+{
+	assert(!cur_engine);
+#ifdef HAVE_IO_URING
+	if (type!=ioEnginePread)
+	{
+		uring_engine *engine=new uring_engine();
+		if (engine->init())
+		{
+			cur_engine=engine;
+			return;
+		}
+		delete engine;
+		if (type==ioEngineUring)
+			err(errFatal) << "io_uring is not supported by the kernel";
+	}
+#else
+	if (type==ioEngineUring)
+		err(errFatal) << "This build doesn't support io_uring";
+#endif
+	cur_engine=new pread_engine();
+}
+
+io_engine& es3::get_io_engine()
+{
+	if (!cur_engine)
+		cur_engine=new pread_engine();
+	return *cur_engine;
+}
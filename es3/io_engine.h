@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include "common.h"
+#include <stdint.h>
+
+//Large requests are split into pieces of this size, so that they are
+//serviced in parallel
+#define IO_ENGINE_CHUNK (1024*1024)
+
+namespace es3 {
+
+	enum io_engine_e
+	{
+		ioEngineAuto, //io_uring if the kernel supports it
+		ioEnginePread,
+		ioEngineUring,
+	};
+
+	/**
+	  Positional file I/O. Both calls block the calling thread until the
+	  whole request is done and throw on errors.
+	  */
+	class io_engine
+	{
+	public:
+		virtual ~io_engine() {}
+
+		//Returns the number of bytes read, which is less than len only
+		//at the end of the file
+		virtual size_t read_at(int fd, char *buf, size_t len,
+							   uint64_t offset) = 0;
+		virtual void write_at(int fd, const char *buf, size_t len,
+							  uint64_t offset) = 0;
+		virtual const char* name() const = 0;
+	};
+
+	//Plain pread/pwrite loops
+	class pread_engine : public io_engine
+	{
+	public:
+		virtual size_t read_at(int fd, char *buf, size_t len,
+							   uint64_t offset);
+		virtual void write_at(int fd, const char *buf, size_t len,
+							  uint64_t offset);
+		virtual const char* name() const { return "pread"; }
+	};
+
+	//O_DIRECT requests must be aligned to the logical block size
+	#define DIRECT_IO_ALIGN 4096
+	#define DIRECT_IO_BUFFER (4*1024*1024)
+
+	/**
+	  A file opened for a bulk transfer. In the direct mode the page cache
+	  is bypassed: aligned requests go through O_DIRECT using pooled bounce
+	  buffers, and the rest is dropped from the cache after it's done. If
+	  the filesystem doesn't support O_DIRECT, everything is done through
+	  the cache and dropped from it (writes are flushed first).
+	  */
+	class transfer_file
+	{
+		handle_t owned_; //Not set if the descriptor is borrowed
+		const int fd_;
+		int direct_fd_; //-1 if O_DIRECT is not used
+		const bool drop_cache_;
+
+		transfer_file(const transfer_file &);
+	public:
+		ES3LIB_PUBLIC transfer_file(const bf::path &path, int flags,
+									bool direct);
+		//Borrows an already open descriptor, it must outlive this object
+		ES3LIB_PUBLIC transfer_file(int fd, bool direct);
+		ES3LIB_PUBLIC ~transfer_file();
+
+		int get() const { return fd_; }
+		bool is_direct() const { return direct_fd_>=0; }
+
+		ES3LIB_PUBLIC size_t read_at(char *buf, size_t len, uint64_t offset);
+		ES3LIB_PUBLIC void write_at(const char *buf, size_t len,
+									uint64_t offset);
+	private:
+		void drop_cached(uint64_t offset, uint64_t len, bool written);
+	};
+
+	//Must be called before any I/O is done
+	ES3LIB_PUBLIC void init_io_engine(io_engine_e type);
+	ES3LIB_PUBLIC io_engine& get_io_engine();
+
+}; //namespace es3
+
+#endif //IO_ENGINE_H
@@ -0,0 +1,258 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "listing_cache.h"
+#include "checksum.h"
+#include "errors.h"
+#include "scope_guard.h"
+#include <fcntl.h>
+#include <fstream>
+#include <limits>
+#include <string.h>
+#include <sys/mman.h>
+
+using namespace es3;
+
+//Snapshot records are:
+//	D <listed at> <path> - a directory, its files follow
+//	F <size> <mtime> <name> <HEAD mtime or -> <HEAD raw size or -> - a file
+#define SNAPSHOT_HEADER "es3-listing\t1"
+
+listing_cache::listing_cache(const bf::path &dir, time_t max_age, bool refresh)
+	: dir_(dir), max_age_(max_age), refresh_(refresh)
+{
+}
+
+time_t listing_cache::fresh_after() const
+{
+	if (refresh_)
+		return std::numeric_limits<time_t>::max();
+	return time(0)-max_age_;
+}
+
+bf::path listing_cache::file_for(const s3_path &root) const
+{
+	std::string key=root.bucket_+root.path_;
+	return dir_ / (compute_digest(key.c_str(), key.size()).md5_hex()+".lst");
+}
+
+static void split_fields(const char *cur, const char *end, stringvec *res)
+{
+	res->clear();
+	while(true)
+	{
+		const char *tab=(const char*)memchr(cur, '\t', end-cur);
+		if (!tab)
+			break;
+		res->push_back(std::string(cur, tab));
+		cur=tab+1;
+	}
+	res->push_back(std::string(cur, end));
+}
+
+s3_directory_ptr listing_cache::load(const s3_path &root)
+{
+	bf::path file=file_for(root);
+	int fd=open(file.c_str(), O_RDONLY);
+	if (fd<0)
+		return s3_directory_ptr(); //No snapshot yet
+	handle_t fl(fd);
+	uint64_t size=fl.size();
+	if (size==0)
+		return s3_directory_ptr();
+
+	void *data=mmap(0, size, PROT_READ, MAP_PRIVATE, fl.get(), 0);
+	if (data==MAP_FAILED)
+	{
+		VLOG(0) << "Can't map listing snapshot " << file;
+		return s3_directory_ptr();
+	}
+	ON_BLOCK_EXIT(&munmap, data, size);
+
+	const char *cur=(const char*)data, *end=cur+size;
+	std::map<std::string, s3_directory_ptr> dirs;
+	s3_directory_ptr res, dir;
+	stringvec fields;
+	bool seen_header=false;
+	while(cur<end)
+	{
+		const char *eol=(const char*)memchr(cur, '\n', end-cur);
+		if (!eol)
+			break; //Truncated record
+		if (!seen_header)
+		{
+			if (std::string(cur, eol)!=SNAPSHOT_HEADER)
+				break;
+			seen_header=true;
+			cur=eol+1;
+			continue;
+		}
+		split_fields(cur, eol, &fields);
+		cur=eol+1;
+
+		if (fields.at(0)=="D" && fields.size()==3)
+		{
+			const std::string &path=fields.at(2);
+			if (path.empty() || *path.rbegin()!='/')
+				break;
+			s3_directory_ptr cur_dir(new s3_directory());
+			cur_dir->absolute_name_=root;
+			cur_dir->absolute_name_.path_=path;
+			cur_dir->listed_at_=atoll(fields.at(1).c_str());
+			if (res)
+			{
+				size_t pos=path.rfind('/', path.size()-2);
+				s3_directory_ptr parent=pos==std::string::npos ?
+					s3_directory_ptr() : try_get(dirs, path.substr(0, pos+1));
+				if (!parent)
+					break;
+				cur_dir->name_=path.substr(pos+1, path.size()-pos-2);
+				cur_dir->parent_=parent;
+				parent->subdirs_[cur_dir->name_]=cur_dir;
+			} else
+				res=cur_dir;
+			dirs[path]=cur_dir;
+			dir=cur_dir;
+		} else if (fields.at(0)=="F" && fields.size()==6 && dir)
+		{
+			s3_file_ptr file(new s3_file());
+			file->name_=fields.at(3);
+			file->absolute_name_=derive(dir->absolute_name_, file->name_);
+			file->size_=strtoull(fields.at(1).c_str(), 0, 10);
+			file->mtime_str_=fields.at(2);
+			file->parent_=dir;
+			if (fields.at(4)!="-")
+			{
+				file->has_desc_=true;
+				file->desc_mtime_=atoll(fields.at(4).c_str());
+				file->desc_raw_size_=strtoull(fields.at(5).c_str(), 0, 10);
+			}
+			dir->files_[file->name_]=file;
+		} else
+			break;
+	}
+
+	if (cur<end || !seen_header)
+	{
+		VLOG(0) << "Ignoring a malformed listing snapshot " << file;
+		return s3_directory_ptr();
+	}
+	VLOG(2) << "Loaded listing snapshot of " << root << " from " << file;
+	return res;
+}
+
+static bool storable(const std::string &name)
+{
+	return name.find_first_of("\t\n")==std::string::npos;
+}
+
+static void write_dir(std::ostream &out, s3_directory_ptr dir)
+{
+	//Entries that can't be stored make the directory stale
+	bool complete=true;
+	std::string files;
+	for(auto iter=dir->files_.begin();iter!=dir->files_.end();++iter)
+	{
+		const s3_file &file=*iter->second;
+		if (!storable(file.name_) || !storable(file.mtime_str_))
+		{
+			complete=false;
+			continue;
+		}
+		files.append("F\t").append(int_to_string(file.size_)).append("\t")
+			.append(file.mtime_str_).append("\t").append(file.name_);
+		if (file.has_desc_)
+			files.append("\t").append(int_to_string(file.desc_mtime_))
+				.append("\t").append(int_to_string(file.desc_raw_size_));
+		else
+			files.append("\t-\t-");
+		files.append("\n");
+	}
+	for(auto iter=dir->subdirs_.begin();iter!=dir->subdirs_.end();++iter)
+		if (!storable(iter->first))
+			complete=false;
+
+	out << "D\t" << (complete ? dir->listed_at_ : 0) << "\t"
+		<< dir->absolute_name_.path_ << "\n" << files;
+	for(auto iter=dir->subdirs_.begin();iter!=dir->subdirs_.end();++iter)
+		if (storable(iter->first))
+			write_dir(out, iter->second);
+}
+
+void listing_cache::save(const s3_path &root, s3_directory_ptr tree)
+{
+	bf::create_directories(dir_);
+	bf::path file=file_for(root);
+	//Written aside and renamed, so that readers never see a partial file
+	bf::path tmp=file.string()+"."+int_to_string(getpid());
+	{
+		std::ofstream out(tmp.c_str());
+		out << SNAPSHOT_HEADER << "\n";
+		write_dir(out, tree);
+		out.flush();
+		if (!out)
+		{
+			VLOG(0) << "Failed to write listing snapshot " << tmp;
+			bf::remove(tmp);
+			return;
+		}
+	}
+	rename(tmp.c_str(), file.c_str())
+			| libc_die2("Failed to save listing snapshot "+file.string());
+	VLOG(2) << "Saved listing snapshot of " << root << " to " << file;
+}
+
+void es3::carry_over_metadata(s3_directory_ptr listed,
+							  s3_directory_ptr snapshot)
+{
+	for(auto iter=listed->files_.begin();iter!=listed->files_.end();++iter)
+	{
+		s3_file_ptr old=try_get(snapshot->files_, iter->first);
+		s3_file &cur=*iter->second;
+		//An overwritten object has a different mtime
+		if (!old || !old->has_desc_ || old->size_!=cur.size_ ||
+				old->mtime_str_!=cur.mtime_str_)
+			continue;
+		cur.has_desc_=true;
+		cur.desc_mtime_=old->desc_mtime_;
+		cur.desc_raw_size_=old->desc_raw_size_;
+	}
+}
+
+void es3::merge_snapshot(s3_directory_ptr listed, s3_directory_ptr snapshot)
+{
+	carry_over_metadata(listed, snapshot);
+	for(auto iter=listed->subdirs_.begin();iter!=listed->subdirs_.end();++iter)
+	{
+		s3_directory_ptr old=try_get(snapshot->subdirs_, iter->first);
+		if (!old)
+			continue;
+		old->parent_=listed;
+		iter->second=old;
+	}
+}
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef LISTING_CACHE_H
+#define LISTING_CACHE_H
+
+#include "common.h"
+#include "connection.h"
+
+namespace es3 {
+	/**
+	  On-disk snapshots of remote directory trees, one file per bucket and
+	  prefix. Every directory remembers when it was listed, so only the
+	  parts that are older than the freshness bound are listed again.
+	  */
+	class listing_cache
+	{
+		const bf::path dir_;
+		const time_t max_age_;
+		const bool refresh_;
+	public:
+		//If refresh is set, every directory is listed again
+		listing_cache(const bf::path &dir, time_t max_age, bool refresh);
+
+		//Directories listed before this time are stale
+		time_t fresh_after() const;
+
+		//Returns an empty pointer if there's no snapshot for the path
+		s3_directory_ptr load(const s3_path &root);
+		void save(const s3_path &root, s3_directory_ptr tree);
+	private:
+		bf::path file_for(const s3_path &root) const;
+	};
+	typedef boost::shared_ptr<listing_cache> listing_cache_ptr;
+
+	//Copies the HEAD metadata of the files that haven't changed since the
+	//snapshot was taken
+	ES3LIB_PUBLIC void carry_over_metadata(s3_directory_ptr listed,
+										   s3_directory_ptr snapshot);
+	//Same, and also puts the snapshot's subtrees under the directory
+	ES3LIB_PUBLIC void merge_snapshot(s3_directory_ptr listed,
+									  s3_directory_ptr snapshot);
+}; //namespace es3
+
+#endif //LISTING_CACHE_H
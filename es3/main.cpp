@@ -34,6 +34,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "agenda.h"
 #include "commands.h"
 #include "errors.h"
+#include "dedup.h"
+#include "listing_cache.h"
+#include "uploader.h"
+#include "tracing.h"
+#include "metrics.h"
+#include "io_engine.h"
 #include <sys/ioctl.h>
 #include <boost/bind.hpp>
 #include <curl/curl.h>
@@ -42,8 +48,6 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 using namespace es3;
 namespace po = boost::program_options;
 
-int es3::term_width = 80;
-
 
 std::vector<po::option> subcommands_parser(stringvec& args,
 										   const stringvec& subcommands)
@@ -97,6 +101,8 @@ int main(int argc, char **argv)
 	init_mimes();
 	context_ptr cd(new conn_context());
 
+	std::string trace_file, metrics_file;
+	int metrics_port=0, metrics_interval=0;
 	po::options_description generic("Generic options", term_width);
 	generic.add_options()
 		("help", "Display this message")
@@ -106,11 +112,25 @@ int main(int argc, char **argv)
 			"Verbosity level [0 - the lowest, 9 - the highest]")
 		("no-progress,q", "Quiet mode (no progress indicator)")
 		("no-stats,t", "Quiet mode (no final stats)")
+		("trace-file", po::value<std::string>(&trace_file),
+			"Write timings of every S3 request to this file as JSON lines")
+		("metrics-port", po::value<int>(&metrics_port)->default_value(0),
+			"Serve metrics in the Prometheus text format on this local "
+			"port [0 - disabled]")
+		("metrics-file", po::value<std::string>(&metrics_file),
+			"Periodically rewrite this file with metrics in the Prometheus "
+			"text format")
+		("metrics-interval", po::value<int>(
+			 &metrics_interval)->default_value(10),
+			"Interval between metrics updates in seconds")
 		("scratch-dir,i", po::value<bf::path>(&cd->scratch_dir_)
 			->default_value(bf::temp_directory_path())->required(),
 			"Path to the scratch directory")
 	;
 
+	std::string checksum, dedup_file, listing_cache_dir;
+	int listing_cache_age=0;
+	bool refresh_listing=false;
 	po::options_description access("Access settings", term_width);
 	access.add_options()
 		("access-key,a", po::value<std::string>(
@@ -124,13 +144,49 @@ int main(int argc, char **argv)
 		("use-ssl,l", po::value<bool>(
 			 &cd->use_ssl_)->default_value(false),
 			"Use SSL for communications with the Amazon S3 servers")
+		("endpoint", po::value<std::string>(&cd->endpoint_),
+			"URL of an S3-compatible server to use instead of Amazon S3 "
+			"(e.g. http://localhost:9000). Buckets are addressed path-style.")
 		("compression,m", po::value<bool>(
 			 &cd->do_compression_)->default_value(true)->required(),
 			"Use GZIP compression")       
+		("compression-level", po::value<int>(
+			 &cd->compression_level_)->default_value(1),
+			"GZIP compression level [1 - the fastest, 9 - the best]")
+		("resume", po::value<bool>(
+			 &cd->resume_downloads_)->default_value(false),
+			"Keep partially downloaded files and fetch only the missing "
+			"segments on the next attempt")
+		("paranoid", po::value<bool>(
+			 &cd->paranoid_checks_)->default_value(false),
+			"Confirm each multipart upload and each uploaded part with "
+			"additional listing requests")
+		("checksum", po::value<std::string>(
+			 &checksum)->default_value("none"),
+			"Additional S3 checksum to send with uploaded data "
+			"[none, crc32c]. MD5 is always checked.")
+		("dedup-index", po::value<std::string>(&dedup_file),
+			"Index of chunks that are already uploaded. If set, chunks of "
+			"uploaded files that are found in the index are copied on the "
+			"server side instead of being uploaded again")
+		("listing-cache", po::value<std::string>(&listing_cache_dir),
+			"Directory for snapshots of remote listings. If set, ls, lsr "
+			"and du list again only the directories that are older than "
+			"listing-cache-age")
+		("listing-cache-age", po::value<int>(
+			 &listing_cache_age)->default_value(300),
+			"Age in seconds after which a directory in a snapshot is stale")
+		("refresh-listing", po::value<bool>(
+			 &refresh_listing)->default_value(false),
+			"List everything again and replace the listing snapshots")
 	;
 	generic.add(access);
 
 	int thread_num=0, io_threads=0, cpu_threads=0, segment_size=0, segments=0;
+	uint64_t queue_limit=0;
+	retry_policy retries;
+	bool numa_affinity=true;
+	std::string io_engine_name;
 	po::options_description tuning("Tuning", term_width);
 	tuning.add_options()
         ("concurrent-list,t", po::value<int>(&cd->concurrent_list_req_)->default_value(2),
@@ -149,6 +205,44 @@ int main(int argc, char **argv)
 		("segments-in-flight,f", po::value<int>(
 			 &segments)->default_value(0),
 			"Number of segments in-flight [0 - autodetect]")
+		("io-engine", po::value<std::string>(
+			 &io_engine_name)->default_value("auto"),
+			"Local file I/O engine [auto, uring, pread]")
+		("direct-io", po::value<bool>(
+			 &cd->direct_io_)->default_value(false),
+			"Bypass the page cache (O_DIRECT) for bulk file transfers, so "
+			"that large syncs don't evict the working set")
+		("numa-affinity", po::value<bool>(
+			 &numa_affinity)->default_value(true),
+			"Pin the thread pools to NUMA nodes, so that data buffers are "
+			"allocated node-locally (only if there are several nodes)")
+		("small-file-size", po::value<int>(
+			 &cd->small_file_size_)->default_value(262144),
+			"Files up to this size are uploaded in batches over kept-alive "
+			"connections, and downloaded with a single request if they're "
+			"missing locally [0 - disable, 1048576 - maximum]")
+		("small-file-batch", po::value<int>(
+			 &cd->small_file_batch_)->default_value(64),
+			"Number of small files in one upload batch")
+		("retries", po::value<int>(
+			 &retries.max_attempts_[retryTransient])->default_value(10),
+			"Number of attempts for a task failing with network errors or "
+			"server failures")
+		("throttle-retries", po::value<int>(
+			 &retries.max_attempts_[retryThrottled])->default_value(20),
+			"Number of attempts for a task throttled by the server")
+		("retry-delay", po::value<uint64_t>(
+			 &retries.base_delay_ms_)->default_value(1000),
+			"Initial delay before retrying a failed task in milliseconds, "
+			"doubled with every attempt")
+		("max-retry-delay", po::value<uint64_t>(
+			 &retries.max_delay_ms_)->default_value(60000),
+			"Maximum delay before retrying a failed task in milliseconds")
+		("max-queued-tasks", po::value<uint64_t>(
+			 &queue_limit)->default_value(0),
+			"Maximum number of queued tasks of each kind. The tree walk and "
+			"the listing are paused while the queue is full, so memory "
+			"stays flat for huge trees [0 - unlimited]")
 	;
 	generic.add(tuning);
 
@@ -293,7 +387,43 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (checksum=="crc32c")
+		cd->checksum_=checksumCRC32C;
+	else if (checksum!="none")
+	{
+		std::cerr << "Unknown checksum type: " << checksum << std::endl;
+		return 2;
+	}
+	if (!cd->endpoint_.empty() && *cd->endpoint_.rbegin()=='/')
+		cd->endpoint_.erase(cd->endpoint_.size()-1);
+	if (!dedup_file.empty())
+		cd->dedup_.reset(new dedup_index(dedup_file));
+	if (!listing_cache_dir.empty())
+		cd->listing_cache_.reset(new listing_cache(listing_cache_dir,
+			listing_cache_age, refresh_listing));
+	if (!trace_file.empty())
+		get_tracer().open_trace(trace_file);
+	try
+	{
+		if (io_engine_name=="auto")
+			init_io_engine(ioEngineAuto);
+		else if (io_engine_name=="uring")
+			init_io_engine(ioEngineUring);
+		else if (io_engine_name=="pread")
+			init_io_engine(ioEnginePread);
+		else
+		{
+			std::cerr << "Unknown I/O engine: " << io_engine_name << std::endl;
+			return 2;
+		}
+	} catch(const es3_exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 2;
+	}
+
 	logger::set_verbosity(verbosity);
+	VLOG(2) << "Using " << get_io_engine().name() << " for file I/O";
 	curl_global_init(CURL_GLOBAL_ALL);
 	ON_BLOCK_EXIT(&curl_global_cleanup);
 
@@ -303,9 +433,20 @@ int main(int argc, char **argv)
 		segments=40;
 	if (segment_size<MIN_SEGMENT_SIZE)
 		segment_size=MIN_SEGMENT_SIZE;
+	//Small files are never compressed, so they can be sent as-is
+	if (cd->small_file_size_>MAX_SMALL_FILE_SIZE)
+		cd->small_file_size_=MAX_SMALL_FILE_SIZE;
+	if (cd->small_file_batch_<=0)
+		cd->small_file_batch_=1;
+	if (cd->compression_level_<1 || cd->compression_level_>9)
+		cd->compression_level_=1;
 	if (cpu_threads<=0)
 		cpu_threads=sysconf(_SC_NPROCESSORS_ONLN)+2;
-	if (io_threads<=0)
+	//Each reader thread keeps many requests in flight with io_uring, so
+	//fewer threads are needed
+	if (io_threads<=0 && std::string(get_io_engine().name())=="io_uring")
+		io_threads=sysconf(_SC_NPROCESSORS_ONLN)+2;
+	else if (io_threads<=0)
 		io_threads=sysconf(_SC_NPROCESSORS_ONLN)*2+2;
 	if (thread_num<=0)
 		thread_num=sysconf(_SC_NPROCESSORS_ONLN)*6+40;
@@ -318,9 +459,17 @@ int main(int argc, char **argv)
 	agenda_ptr ag(new agenda(thread_num, cpu_threads, io_threads,
 							 no_progress, no_stats,
 							 segment_size, segments));
+	ag->set_retry_policy(retries);
+	ag->set_affinity(numa_affinity);
+	ag->set_queue_limit(queue_limit);
 
 	try
 	{
+		boost::scoped_ptr<metrics_exporter> metrics;
+		if (metrics_port>0 || !metrics_file.empty())
+			metrics.reset(new metrics_exporter(ag, cd, metrics_file,
+											   metrics_port,
+											   metrics_interval));
 		return subcommands_map[cur_subcommand](cd, cur_sub_params, ag, false);
 	} catch(const es3_exception &ex)
 	{
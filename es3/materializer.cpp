@@ -0,0 +1,145 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "materializer.h"
+#include "errors.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Directories with open descriptors, the cache is simply dropped when
+//it's full (the descriptors in use stay open)
+#define MAX_OPEN_DIRS 256
+
+using namespace es3;
+
+static mutex_t dirs_mutex;
+static std::map<std::string, dir_handle_ptr> open_dirs;
+
+dir_handle_ptr es3::open_dir(const bf::path &dir)
+{
+	std::string key=dir.empty() ? std::string(".") : dir.string();
+	guard_t lock(dirs_mutex);
+	dir_handle_ptr res=try_get(open_dirs, key);
+	//The directory might have been removed and created again
+	struct stat st;
+	if (res && fstat(res->get(), &st)==0 && st.st_nlink>0)
+		return res;
+
+	if (open_dirs.size()>=MAX_OPEN_DIRS)
+		open_dirs.clear();
+	res.reset(new handle_t(open(key.c_str(), O_RDONLY|O_DIRECTORY)
+						   | libc_die2("Failed to open directory "+key)));
+	open_dirs[key]=res;
+	return res;
+}
+
+void es3::preallocate(int fd, uint64_t size)
+{
+#ifndef __MACH__
+	fallocate64(fd, 0, 0, size);
+#else
+	fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)size};
+	// OK, perhaps we are too fragmented, allocate non-continuous
+	store.fst_flags = F_ALLOCATEALL;
+	int ret = fcntl(fd, F_PREALLOCATE, &store);
+	if (ret!=-1)
+		ftruncate(fd, (off_t)size);
+#endif
+}
+
+static std::string fd_link(int fd)
+{
+	return "/proc/self/fd/"+int_to_string(fd);
+}
+
+pending_file::pending_file(const bf::path &target)
+	: dir_(open_dir(target.parent_path())),
+	  name_(target.filename().string()),
+	  fd_(open_unnamed()), committed_()
+{
+}
+
+int pending_file::open_unnamed()
+{
+#ifdef O_TMPFILE
+	int fd=openat(dir_->get(), ".", O_TMPFILE|O_RDWR, 0600);
+	if (fd>=0)
+		return fd;
+	//Older kernels and some filesystems (e.g. NFS) don't support it
+	if (errno!=EOPNOTSUPP && errno!=EISDIR && errno!=EINVAL)
+		fd | libc_die2("Failed to create a file for "+name_);
+#endif
+	temp_name_=bf::unique_path(name_+"-%%%%%%%%-es3tmp").string();
+	return openat(dir_->get(), temp_name_.c_str(),
+				  O_RDWR|O_CREAT|O_EXCL, 0600)
+			| libc_die2("Failed to create file "+temp_name_);
+}
+
+pending_file::~pending_file()
+{
+	if (!committed_ && !temp_name_.empty())
+		unlinkat(dir_->get(), temp_name_.c_str(), 0);
+}
+
+void pending_file::commit(time_t mtime, mode_t mode)
+{
+	fchmod(fd_.get(), mode) | libc_die2("Failed to set mode on "+name_);
+	struct timespec times[2];
+	times[0].tv_sec=0;
+	times[0].tv_nsec=UTIME_OMIT;
+	times[1].tv_sec=mtime;
+	times[1].tv_nsec=0;
+	futimens(fd_.get(), times)
+			| libc_die2("Failed to set the modification time on "+name_);
+
+	if (temp_name_.empty())
+	{
+		//Linking through /proc doesn't need CAP_DAC_READ_SEARCH, unlike
+		//AT_EMPTY_PATH
+		if (linkat(AT_FDCWD, fd_link(fd_.get()).c_str(), dir_->get(),
+				   name_.c_str(), AT_SYMLINK_FOLLOW)==0)
+		{
+			committed_=true;
+			return;
+		}
+		if (errno!=EEXIST)
+			(-1) | libc_die2("Failed to create "+name_);
+
+		//Replace the existing file atomically
+		temp_name_=bf::unique_path(name_+"-%%%%%%%%-es3tmp").string();
+		linkat(AT_FDCWD, fd_link(fd_.get()).c_str(), dir_->get(),
+			   temp_name_.c_str(), AT_SYMLINK_FOLLOW)
+				| libc_die2("Failed to create "+temp_name_);
+	}
+	renameat(dir_->get(), temp_name_.c_str(), dir_->get(), name_.c_str())
+			| libc_die2("Failed to replace "+name_);
+	committed_=true;
+}
@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef MATERIALIZER_H
+#define MATERIALIZER_H
+
+#include "common.h"
+#include <stdint.h>
+
+namespace es3 {
+	typedef boost::shared_ptr<handle_t> dir_handle_ptr;
+
+	//Descriptors of the recently used directories are kept open, so the
+	//files in them are created without resolving the whole path
+	ES3LIB_PUBLIC dir_handle_ptr open_dir(const bf::path &dir);
+
+	ES3LIB_PUBLIC void preallocate(int fd, uint64_t size);
+
+	/**
+	  A file that is being downloaded. It's created unnamed (O_TMPFILE)
+	  in the target's directory if the filesystem supports that, or under
+	  a temporary name otherwise. The file appears under the target name
+	  only when it's committed, and is discarded if it never is.
+	  */
+	class pending_file
+	{
+		dir_handle_ptr dir_;
+		const std::string name_;
+		std::string temp_name_; //Empty for an unnamed file
+		handle_t fd_;
+		bool committed_;
+
+		pending_file(const pending_file&);
+	public:
+		ES3LIB_PUBLIC explicit pending_file(const bf::path &target);
+		ES3LIB_PUBLIC ~pending_file();
+
+		int get() const { return fd_.get(); }
+		//Sets the metadata through the descriptor and moves the file
+		//into place, replacing the existing one
+		ES3LIB_PUBLIC void commit(time_t mtime, mode_t mode);
+	private:
+		int open_unnamed();
+	};
+	typedef boost::shared_ptr<pending_file> pending_file_ptr;
+}; //namespace es3
+
+#endif //MATERIALIZER_H
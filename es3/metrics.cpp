@@ -0,0 +1,285 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "metrics.h"
+#include "errors.h"
+#include "tracing.h"
+#include <sstream>
+#include <fstream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace es3;
+
+static const char* class_names[taskTypesNum] = {"unbound", "cpu", "io"};
+
+metrics_exporter::metrics_exporter(agenda_ptr agenda, context_ptr context,
+								   const bf::path &file, int port,
+								   int interval) :
+	agenda_(agenda), context_(context), file_(file),
+	interval_(interval>0 ? interval : 1), listen_fd_(-1), stop_(),
+	last_elapsed_(), last_done_(), last_up_(), last_down_(),
+	up_rate_(), down_rate_(), task_rate_(), last_progress_(time(NULL))
+{
+	if (port>0)
+	{
+		listen_fd_=socket(AF_INET, SOCK_STREAM, 0) | libc_die2(
+			"Can't create the metrics socket");
+		int one=1;
+		setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		//Metrics are only served locally
+		struct sockaddr_in addr={0};
+		addr.sin_family=AF_INET;
+		addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+		addr.sin_port=htons(port);
+		if (bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) ||
+				listen(listen_fd_, 16))
+		{
+			int code=errno;
+			close(listen_fd_);
+			listen_fd_=-1;
+			err(errFatal) << "Can't listen for metrics on port " << port
+						  << ": " << strerror(code);
+		}
+	}
+
+	thread_.reset(new boost::thread(boost::bind(
+		&metrics_exporter::run, this)));
+}
+
+metrics_exporter::~metrics_exporter()
+{
+	stop_=true;
+	thread_->join();
+	if (listen_fd_>=0)
+		close(listen_fd_);
+}
+
+void metrics_exporter::run()
+{
+	time_t next_sample=time(NULL)+interval_;
+	while(!stop_)
+	{
+		if (listen_fd_>=0)
+		{
+			struct pollfd pfd={listen_fd_, POLLIN, 0};
+			if (poll(&pfd, 1, 200)>0 && (pfd.revents & POLLIN))
+			{
+				int fd=accept(listen_fd_, NULL, NULL);
+				if (fd>=0)
+					serve_client(fd);
+			}
+		} else
+			usleep(200000);
+
+		if (time(NULL)>=next_sample)
+		{
+			sample();
+			write_file();
+			next_sample=time(NULL)+interval_;
+		}
+	}
+
+	//The final state, so that the file shows the completed operation
+	sample();
+	write_file();
+}
+
+void metrics_exporter::sample()
+{
+	agenda_metrics cur=agenda_->get_metrics();
+	uint64_t done=0;
+	for(int f=0;f<taskTypesNum;++f)
+		done+=cur.done_[f];
+	uint64_t up=cur.stats_[statUploaded];
+	uint64_t down=cur.stats_[statDownloaded];
+
+	guard_t lock(m_);
+	if (cur.elapsed_millis_>last_elapsed_)
+	{
+		double secs=(cur.elapsed_millis_-last_elapsed_)/1000.0;
+		up_rate_=(up-last_up_)/secs;
+		down_rate_=(down-last_down_)/secs;
+		task_rate_=(done-last_done_)/secs;
+	}
+	if (done!=last_done_ || up!=last_up_ || down!=last_down_)
+		last_progress_=time(NULL);
+	last_elapsed_=cur.elapsed_millis_;
+	last_done_=done;
+	last_up_=up;
+	last_down_=down;
+}
+
+std::string metrics_exporter::render()
+{
+	agenda_metrics cur=agenda_->get_metrics();
+	size_t busy=0;
+	size_t open=context_->count_connections(&busy);
+
+	std::stringstream str;
+	str << "# TYPE es3_tasks_queued gauge\n";
+	for(int f=0;f<taskTypesNum;++f)
+		str << "es3_tasks_queued{class=\"" << class_names[f] << "\"} "
+			<< cur.queued_[f] << "\n";
+	str << "# TYPE es3_tasks_running gauge\n";
+	for(int f=0;f<taskTypesNum;++f)
+		str << "es3_tasks_running{class=\"" << class_names[f] << "\"} "
+			<< cur.running_[f] << "\n";
+	str << "# TYPE es3_tasks_done_total counter\n";
+	for(int f=0;f<taskTypesNum;++f)
+		str << "es3_tasks_done_total{class=\"" << class_names[f] << "\"} "
+			<< cur.done_[f] << "\n";
+	str << "# TYPE es3_tasks_failed_total counter\n";
+	for(int f=0;f<taskTypesNum;++f)
+		str << "es3_tasks_failed_total{class=\"" << class_names[f] << "\"} "
+			<< cur.failed_[f] << "\n";
+	str << "# TYPE es3_tasks_submitted_total counter\n"
+		<< "es3_tasks_submitted_total " << cur.submitted_ << "\n";
+	str << "# TYPE es3_task_retries_total counter\n"
+		<< "es3_task_retries_total " << cur.retries_ << "\n";
+	str << "# TYPE es3_tasks_retrying gauge\n"
+		<< "es3_tasks_retrying " << cur.retrying_ << "\n";
+	str << "# TYPE es3_errors_total counter\n";
+	for(int f=0;f<errorKindsNum;++f)
+		str << "es3_errors_total{kind=\""
+			<< error_kind_name(error_kind_e(f)) << "\"} "
+			<< cur.errors_[f] << "\n";
+
+	str << "# TYPE es3_segments_in_flight gauge\n"
+		<< "es3_segments_in_flight " << cur.segments_in_flight_ << "\n"
+		<< "# TYPE es3_segments_in_flight_max gauge\n"
+		<< "es3_segments_in_flight_max " << cur.max_segments_in_flight_
+		<< "\n";
+	str << "# TYPE es3_connections_open gauge\n"
+		<< "es3_connections_open " << open << "\n"
+		<< "# TYPE es3_connections_busy gauge\n"
+		<< "es3_connections_busy " << busy << "\n";
+
+	str << "# TYPE es3_bytes_total counter\n";
+	for(int f=0;f<statCountersNum;++f)
+		str << "es3_bytes_total{stat=\""
+			<< stat_counter_name(stat_counter_e(f)) << "\"} "
+			<< cur.stats_[f] << "\n";
+
+	uint64_t remaining=cur.submitted_;
+	for(int f=0;f<taskTypesNum;++f)
+		remaining-=cur.done_[f];
+	{
+		guard_t lock(m_);
+		str << "# TYPE es3_bytes_per_second gauge\n"
+			<< "es3_bytes_per_second{direction=\"upload\"} "
+			<< up_rate_ << "\n"
+			<< "es3_bytes_per_second{direction=\"download\"} "
+			<< down_rate_ << "\n";
+		str << "# TYPE es3_last_progress_timestamp_seconds gauge\n"
+			<< "es3_last_progress_timestamp_seconds " << last_progress_
+			<< "\n";
+		//The ETA is based on the recent task completion rate, so it's
+		//only a rough estimate since tasks spawn more tasks
+		str << "# TYPE es3_eta_seconds gauge\n" << "es3_eta_seconds ";
+		if (remaining==0)
+			str << "0\n";
+		else if (task_rate_>0)
+			str << uint64_t(remaining/task_rate_) << "\n";
+		else
+			str << "NaN\n";
+	}
+	str << "# TYPE es3_elapsed_seconds gauge\n"
+		<< "es3_elapsed_seconds " << cur.elapsed_millis_/1000.0 << "\n";
+
+	get_tracer().write_metrics(str);
+	return str.str();
+}
+
+void metrics_exporter::write_file()
+{
+	if (file_.empty())
+		return;
+
+	std::string data=render();
+	bf::path tmp=file_;
+	tmp+=".tmp";
+	{
+		std::ofstream out(tmp.c_str(), std::ios_base::trunc);
+		out << data;
+		out.close();
+		if (!out)
+		{
+			VLOG(1) << "WARN: Can't write metrics to " << tmp;
+			return;
+		}
+	}
+	if (rename(tmp.c_str(), file_.c_str()))
+		VLOG(1) << "WARN: Can't rename " << tmp << " to " << file_ << ": "
+				<< strerror(errno);
+}
+
+void metrics_exporter::serve_client(int fd)
+{
+	//Don't let a stuck client block the metrics thread
+	struct timeval tv={1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	//The request itself doesn't matter, every path returns the metrics
+	std::string request;
+	char buf[1024];
+	while(request.find("\r\n\r\n")==std::string::npos &&
+		  request.size()<16384)
+	{
+		ssize_t ln=recv(fd, buf, sizeof(buf), 0);
+		if (ln<=0)
+			break;
+		request.append(buf, ln);
+	}
+
+	std::string body=render();
+	std::string response="HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: "+int_to_string(body.size())+"\r\n"
+		"Connection: close\r\n\r\n"+body;
+
+	size_t sent=0;
+	while(sent<response.size())
+	{
+		ssize_t ln=send(fd, response.data()+sent, response.size()-sent,
+						MSG_NOSIGNAL);
+		if (ln<=0)
+			break;
+		sent+=ln;
+	}
+	close(fd);
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+#include "agenda.h"
+#include "context.h"
+#include <boost/scoped_ptr.hpp>
+
+namespace es3 {
+
+	/**
+	  Exports the progress of a long-running operation in the Prometheus
+	  text format. Metrics can be served over HTTP on a local port,
+	  periodically written to a file (atomically, via rename), or both.
+	  */
+	class metrics_exporter
+	{
+		const agenda_ptr agenda_;
+		const context_ptr context_;
+		const bf::path file_;
+		const int interval_;
+		int listen_fd_;
+		volatile bool stop_;
+		boost::scoped_ptr<boost::thread> thread_;
+
+		mutex_t m_; //Protects the rate data
+		uint64_t last_elapsed_, last_done_, last_up_, last_down_;
+		double up_rate_, down_rate_, task_rate_;
+		time_t last_progress_;
+	public:
+		metrics_exporter(agenda_ptr agenda, context_ptr context,
+						 const bf::path &file, int port, int interval);
+		~metrics_exporter();
+
+		std::string render();
+	private:
+		metrics_exporter(const metrics_exporter &);
+
+		void run();
+		void sample();
+		void write_file();
+		void serve_client(int fd);
+	};
+
+}; //namespace es3
+
+#endif //METRICS_H
@@ -0,0 +1,395 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "path_filter.h"
+#include "errors.h"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string.h>
+
+//Pathological pattern sets are matched by simulating the NFA instead
+#define MAX_DFA_STATES 4096
+//States that loop on at least this many bytes are skipped over with a
+//table lookup instead of being stepped through
+#define MIN_SKIP_BYTES 128
+//More prefixes than this take more requests than listing everything
+#define MAX_LIST_PREFIXES 32
+
+using namespace es3;
+
+glob_set::glob_set(const stringvec &patterns)
+	: num_patterns_(patterns.size()), have_dfa_()
+{
+	std::vector<int> starts;
+	for(size_t f=0;f<patterns.size();++f)
+	{
+		starts.push_back(positions_.size());
+		add_pattern(patterns[f], f);
+	}
+	for(auto iter=starts.begin();iter!=starts.end();++iter)
+		add_closure(*iter, &start_);
+	std::sort(start_.begin(), start_.end());
+	start_.erase(std::unique(start_.begin(), start_.end()), start_.end());
+
+	build_dfa();
+}
+
+void glob_set::add_pattern(const std::string &ptn, int idx)
+{
+	size_t first=positions_.size();
+	for(size_t f=0;f<ptn.size();)
+	{
+		position pos=position();
+		pos.pattern_=idx;
+
+		char c=ptn[f++];
+		if (c=='*')
+		{
+			if (positions_.size()>first && positions_.back().star_)
+				continue; //'**' is the same as '*'
+			pos.star_=true;
+		} else if (c=='?')
+			pos.chars_.set();
+		else if (c=='\\')
+		{
+			if (f==ptn.size())
+				err(errFatal) << "Unterminated escape in pattern " << ptn;
+			pos.chars_.set((unsigned char)ptn[f++]);
+		} else if (c=='[')
+		{
+			//A ']' right after the bracket is a part of the class
+			size_t end=f;
+			if (end<ptn.size() && ptn[end]==']')
+				end++;
+			end=ptn.find(']', end);
+			if (end==std::string::npos)
+				err(errFatal) << "Unterminated character class in pattern "
+							  << ptn;
+
+			bool flip=ptn[f]=='^';
+			if (flip)
+				f++;
+			while(f<end)
+			{
+				unsigned char from=ptn[f++];
+				if (f<end && ptn[f]=='-')
+				{
+					if (++f==end)
+						err(errFatal) << "Unterminated range in pattern "
+									  << ptn;
+					unsigned char to=ptn[f++];
+					for(int ch=from;ch<=to;++ch)
+						pos.chars_.set(ch);
+				} else
+					pos.chars_.set(from);
+			}
+			if (flip)
+				pos.chars_.flip();
+			f=end+1;
+		} else
+			pos.chars_.set((unsigned char)c);
+
+		positions_.push_back(pos);
+	}
+
+	position fin=position();
+	fin.final_=true;
+	fin.pattern_=idx;
+	positions_.push_back(fin);
+
+	std::string literal;
+	for(size_t f=first; !positions_[f].final_ &&
+			positions_[f].chars_.count()==1; ++f)
+	{
+		int ch=0;
+		while(!positions_[f].chars_.test(ch))
+			ch++;
+		literal.push_back(char(ch));
+	}
+	literals_.push_back(literal);
+
+	//Stars at the very end match anything that follows
+	for(size_t f=positions_.size()-1; f>first && positions_[f-1].star_; --f)
+		positions_[f-1].tail_stars_=true;
+}
+
+void glob_set::add_closure(int pos, pos_set_t *res) const
+{
+	res->push_back(pos);
+	//A star can match an empty string
+	if (positions_[pos].star_)
+		add_closure(pos+1, res);
+}
+
+glob_set::pos_set_t glob_set::step(const pos_set_t &cur, unsigned char c) const
+{
+	pos_set_t res;
+	for(auto iter=cur.begin();iter!=cur.end();++iter)
+	{
+		const position &pos=positions_[*iter];
+		if (pos.star_)
+			add_closure(*iter, &res);
+		else if (!pos.final_ && pos.chars_.test(c))
+			add_closure(*iter+1, &res);
+	}
+	std::sort(res.begin(), res.end());
+	res.erase(std::unique(res.begin(), res.end()), res.end());
+	return res;
+}
+
+glob_set::state_info glob_set::describe(const pos_set_t &set) const
+{
+	state_info res=state_info();
+	res.first_match_=-1;
+	res.skip_=-1;
+	res.exit_byte_=-1;
+	for(auto iter=set.begin();iter!=set.end();++iter)
+	{
+		const position &pos=positions_[*iter];
+		if (!pos.final_)
+			res.extendable_=true;
+		else if (res.first_match_<0 || pos.pattern_<res.first_match_)
+			res.first_match_=pos.pattern_;
+		if (pos.tail_stars_)
+			res.universal_=true;
+	}
+	return res;
+}
+
+void glob_set::build_dfa()
+{
+	//Bytes that no pattern tells apart share one column of the table
+	std::map<std::string, int> signatures;
+	std::vector<unsigned char> samples;
+	for(int c=0;c<256;++c)
+	{
+		std::string sig;
+		for(auto iter=positions_.begin();iter!=positions_.end();++iter)
+			if (!iter->star_ && !iter->final_)
+				sig.push_back(iter->chars_.test(c) ? '1' : '0');
+		auto found=signatures.find(sig);
+		if (found==signatures.end())
+		{
+			found=signatures.insert(std::make_pair(sig, samples.size())).first;
+			samples.push_back(c);
+		}
+		classes_[c]=found->second;
+	}
+	num_classes_=samples.size();
+
+	std::map<pos_set_t, int> ids;
+	std::vector<pos_set_t> sets;
+	ids[start_]=0;
+	sets.push_back(start_);
+	for(size_t cur=0;cur<sets.size();++cur)
+	{
+		if (sets.size()>MAX_DFA_STATES)
+		{
+			VLOG(1) << "Patterns are too complex for a DFA, "
+					<< "falling back to the NFA simulation";
+			trans_.clear();
+			states_.clear();
+			return;
+		}
+
+		pos_set_t set=sets[cur];
+		states_.push_back(describe(set));
+		for(int cls=0;cls<num_classes_;++cls)
+		{
+			pos_set_t next=step(set, samples[cls]);
+			auto found=ids.find(next);
+			if (found==ids.end())
+			{
+				found=ids.insert(std::make_pair(next, sets.size())).first;
+				sets.push_back(next);
+			}
+			//Row offsets instead of state numbers keep the multiplication
+			//out of the matching loop
+			trans_.push_back(found->second*num_classes_);
+		}
+	}
+
+	//Once the DFA gets into an absorbing state (nothing or everything
+	//matches from there on) the rest of the name can't change the result,
+	//and a state looping on most bytes is left only on a few of them.
+	//Transitions into such states are negated, so the plain steps cost
+	//only a sign check.
+	for(size_t st=0;st<states_.size();++st)
+	{
+		std::vector<unsigned char> stay(256);
+		size_t num_stay=0;
+		for(int c=0;c<256;++c)
+			if (trans_[st*num_classes_+classes_[c]]==int(st*num_classes_))
+			{
+				stay[c]=1;
+				num_stay++;
+			}
+		if (num_stay==256)
+			states_[st].absorbing_=true;
+		else if (num_stay>=MIN_SKIP_BYTES)
+		{
+			states_[st].skip_=stay_.size();
+			stay_.insert(stay_.end(), stay.begin(), stay.end());
+			if (num_stay==255)
+				states_[st].exit_byte_=
+						std::find(stay.begin(), stay.end(), 0)-stay.begin();
+		}
+	}
+	for(size_t f=0;f<trans_.size();++f)
+	{
+		const state_info &to=states_[trans_[f]/num_classes_];
+		if (to.absorbing_ || to.skip_>=0)
+			trans_[f]=~trans_[f];
+	}
+	have_dfa_=true;
+}
+
+glob_set::state_info glob_set::run(const std::string &str) const
+{
+	if (!have_dfa_)
+	{
+		pos_set_t cur=start_;
+		for(size_t f=0;f<str.size() && !cur.empty();++f)
+			cur=step(cur, str[f]);
+		return describe(cur);
+	}
+
+	const int *trans=&trans_[0];
+	const unsigned char *cur=(const unsigned char*)str.data();
+	const unsigned char *end=cur+str.size();
+	int row=0;
+	const state_info *state=&states_[0];
+	while(!state->absorbing_)
+	{
+		if (state->exit_byte_>=0)
+		{
+			//Typically the star before a suffix like '*.bam'
+			cur=(const unsigned char*)memchr(cur, state->exit_byte_,
+											 end-cur);
+			if (!cur)
+				break;
+		} else if (state->skip_>=0)
+		{
+			const unsigned char *stay=&stay_[state->skip_];
+			while(cur!=end && stay[*cur])
+				++cur;
+		}
+
+		int next=0;
+		while(cur!=end && (next=trans[row+classes_[*cur++]])>=0)
+			row=next;
+		if (next>=0)
+			break; //The end of the name
+		row=~next;
+		state=&states_[row/num_classes_];
+	}
+	return states_[row/num_classes_];
+}
+
+int glob_set::find(const std::string &name) const
+{
+	return run(name).first_match_;
+}
+
+bool glob_set::matches(const std::string &name) const
+{
+	return run(name).first_match_>=0;
+}
+
+bool glob_set::can_match_under(const std::string &prefix) const
+{
+	return run(prefix).extendable_;
+}
+
+bool glob_set::matches_all_under(const std::string &prefix) const
+{
+	return run(prefix).universal_;
+}
+
+path_filter::path_filter(const stringvec &included, const stringvec &excluded)
+	: included_(included), excluded_(excluded)
+{
+}
+
+bool path_filter::matches(const std::string &name) const
+{
+	if (name.find(' ')!=std::string::npos) //Skip filenames with spaces
+		return false;
+	if (excluded_.matches(name))
+		return false;
+	return included_.empty() || included_.matches(name);
+}
+
+bool path_filter::may_match_under(const std::string &dir) const
+{
+	assert(!dir.empty() && *dir.rbegin()=='/');
+	if (dir.find(' ')!=std::string::npos)
+		return false;
+	if (excluded_.matches_all_under(dir))
+		return false;
+	return included_.empty() || included_.can_match_under(dir);
+}
+
+bool path_filter::list_prefixes(const std::string &dir, stringvec *res) const
+{
+	assert(!dir.empty() && *dir.rbegin()=='/');
+	if (included_.empty())
+		return false;
+
+	std::set<std::string> names;
+	const stringvec &literals=included_.literal_prefixes();
+	for(auto iter=literals.begin();iter!=literals.end();++iter)
+	{
+		const std::string &lit=*iter;
+		if (lit.size()<dir.size())
+		{
+			//A wildcard within the directory path matches any name in it
+			if (dir.compare(0, lit.size(), lit)==0)
+				return false;
+			continue;
+		}
+		if (lit.compare(0, dir.size(), dir)!=0)
+			continue; //Nothing in this directory
+
+		size_t end=lit.find('/', dir.size());
+		std::string name=lit.substr(dir.size(), end==std::string::npos ?
+										std::string::npos : end-dir.size());
+		if (name.empty())
+			return false;
+		names.insert(name);
+	}
+
+	//Prefixes of other prefixes cover them
+	res->clear();
+	for(auto iter=names.begin();iter!=names.end();++iter)
+		if (res->empty() || iter->compare(0, res->back().size(),
+										  res->back())!=0)
+			res->push_back(*iter);
+	return res->size()<=MAX_LIST_PREFIXES;
+}
@@ -0,0 +1,126 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+
+#include "common.h"
+#include <bitset>
+
+namespace es3 {
+	/**
+	  A set of glob patterns (the pattern_match syntax: '*', '?', '[...]'
+	  and '\' escapes) compiled into one DFA, so that a name is checked
+	  against all of them in a single pass without backtracking.
+	  */
+	class ES3LIB_PUBLIC glob_set
+	{
+		struct position
+		{
+			bool star_, final_, tail_stars_;
+			int pattern_;
+			std::bitset<256> chars_;
+		};
+		struct state_info
+		{
+			int first_match_;
+			bool extendable_, universal_;
+			//The DFA never leaves this state, whatever follows
+			bool absorbing_;
+			//Offset of the table of bytes that keep the DFA in this state
+			//in stay_, -1 if there are too few of them to skip over
+			int skip_;
+			//The only byte that leaves the state, -1 if there are more
+			int exit_byte_;
+		};
+		typedef std::vector<int> pos_set_t;
+
+		std::vector<position> positions_;
+		pos_set_t start_;
+		stringvec literals_;
+		size_t num_patterns_;
+
+		//The DFA, it's not built if it gets too large
+		bool have_dfa_;
+		int classes_[256];
+		int num_classes_;
+		std::vector<int> trans_;
+		std::vector<state_info> states_;
+		std::vector<unsigned char> stay_;
+	public:
+		glob_set() : num_patterns_(), have_dfa_() {}
+		explicit glob_set(const stringvec &patterns);
+
+		bool empty() const { return num_patterns_==0; }
+		//Index of the first pattern matching the name, -1 if none
+		int find(const std::string &name) const;
+		bool matches(const std::string &name) const;
+
+		//Whether some pattern matches a name that is longer than the prefix
+		bool can_match_under(const std::string &prefix) const;
+		//Whether some pattern matches all names longer than the prefix
+		bool matches_all_under(const std::string &prefix) const;
+		//The literal text each pattern starts with
+		const stringvec& literal_prefixes() const { return literals_; }
+	private:
+		void add_pattern(const std::string &ptn, int idx);
+		void add_closure(int pos, pos_set_t *res) const;
+		pos_set_t step(const pos_set_t &cur, unsigned char c) const;
+		state_info describe(const pos_set_t &set) const;
+		void build_dfa();
+		state_info run(const std::string &str) const;
+	};
+
+	/**
+	  The compiled form of the --include-path/--exclude-path options. It
+	  can also tell if anything in a directory can match, so that excluded
+	  subtrees are not scanned or listed at all.
+	  */
+	class ES3LIB_PUBLIC path_filter
+	{
+		glob_set included_, excluded_;
+	public:
+		path_filter() {}
+		path_filter(const stringvec &included, const stringvec &excluded);
+
+		//Names with spaces are never included
+		bool matches(const std::string &name) const;
+		//The directory name must end with '/'
+		bool may_match_under(const std::string &dir) const;
+		/**
+		  Finds the name prefixes in the directory that the included
+		  names can start with, so that only they need to be listed.
+		  Returns false if the whole directory has to be listed.
+		  */
+		bool list_prefixes(const std::string &dir, stringvec *res) const;
+	};
+	typedef boost::shared_ptr<const path_filter> path_filter_ptr;
+
+}; //namespace es3
+
+#endif //PATH_FILTER_H
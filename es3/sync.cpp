@@ -27,15 +27,16 @@ NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include "sync.h"
+#include "inventory.h"
 #include "uploader.h"
 #include "downloader.h"
 #include "context.h"
 #include "errors.h"
+#include "listing_cache.h"
 #include <set>
 #include <iostream>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include "pattern_match.hpp"
 
 using namespace es3;
 
@@ -46,6 +47,7 @@ namespace es3
 		bf::path absolute_name_;
 		std::string name_;
 		bool unsyncable_;
+		uint64_t size_;
 	};
 
 	struct local_dir
@@ -59,7 +61,7 @@ namespace es3
 }; //namespace es3
 
 static void check_entry(local_dir_ptr parent,
-				   const bf::directory_entry &dent, synchronizer *sync)
+				   const bf::directory_entry &dent, const path_filter *filter)
 {
 	if (dent.path().string().find(" ")!=std::string::npos)
 		return;
@@ -73,10 +75,18 @@ static void check_entry(local_dir_ptr parent,
 		target->name_ = dent.path().filename().string();
 		parent->subdirs_[target->name_]=target;
 
+		//The directory is kept, so that its remote side is left alone
+		if (filter && !filter->may_match_under(
+				target->absolute_name_.string()+"/"))
+		{
+			VLOG(2) << "Skipping excluded directory " << dent.path();
+			return;
+		}
+
 		for(bf::directory_iterator iter=bf::directory_iterator(dent.path());
 			iter!=bf::directory_iterator(); ++iter)
 		{
-			check_entry(target, *iter, sync);
+			check_entry(target, *iter, filter);
 		}
 	} else
 	{
@@ -89,6 +99,7 @@ static void check_entry(local_dir_ptr parent,
 				dent.symlink_status().type()!=bf::symlink_file)
 		{
 			file->unsyncable_ = false;
+			file->size_ = bf::file_size(dent.path());
 		} else if (dent.symlink_status().type()==bf::symlink_file)
 		{
 			file->unsyncable_ = true;
@@ -101,8 +112,9 @@ static void check_entry(local_dir_ptr parent,
 	}
 }
 
+//Subtrees are pruned with the filter, if it's given
 static local_dir_ptr build_local_dir(const std::string &start_path,
-									 synchronizer *sync, bool upload)
+									 const path_filter *filter, bool upload)
 {
 	local_dir_ptr res(new local_dir());
 	bf::path start(bf::absolute(start_path));
@@ -115,7 +127,7 @@ static local_dir_ptr build_local_dir(const std::string &start_path,
 		res->absolute_name_ = start.parent_path();
 		res->name_ = res->absolute_name_.filename().string();
 		check_entry(res, bf::directory_entry(start, bf::status(start)),
-					sync);
+					filter);
 	} else
 	{
 		res->absolute_name_ = start;
@@ -123,95 +135,122 @@ static local_dir_ptr build_local_dir(const std::string &start_path,
 		for(bf::directory_iterator iter=bf::directory_iterator(start);
 			iter!=bf::directory_iterator(); ++iter)
 		{
-			check_entry(res, *iter, sync);
+			check_entry(res, *iter, filter);
 		}
 	}
 
 	return res;
 }
 
-template<class dir_ptr_t, class file_ptr_t>
-	static void merge_to_left(dir_ptr_t left, dir_ptr_t right)
+synchronizer::synchronizer(agenda_ptr agenda, const context_ptr &ctx,
+						   std::vector<s3_path> remote,stringvec local,
+						   bool do_upload, bool delete_missing,
+						   const stringvec &included, const stringvec &excluded)
+	: agenda_(agenda), ctx_(ctx), remote_(remote), local_(local),
+	  do_upload_(do_upload), delete_missing_(delete_missing),
+	  filter_(new path_filter(included, excluded)), small_batch_ordinal_()
 {
-	//Merge files
-	for(auto iter=right->files_.begin(), iend=right->files_.end();
-		iter!=iend; ++iter)
-	{
-		file_ptr_t right_file = iter->second;
-		if (left->files_.count(right_file->name_))
-		{
-			err(errFatal) << "File name collision: "
-						  << right_file->absolute_name_
-						  << " collides with  "
-						  << left->files_[right_file->name_]->absolute_name_;
-		}
+}
 
-		if (left->subdirs_.count(right_file->name_))
-		{
-			//Uh-oh.
-			err(errFatal) << "File "
-						  << right_file->absolute_name_
-						  << " shadows directory "
-						  << left->subdirs_[right_file->name_]->absolute_name_;
-		}
+//Ordinals are made of the priority in the upper bits and the policy's key
+//in the lower bits
+#define ORDINAL_KEY_BITS 48
+#define MAX_ORDINAL_KEY ((int64_t(1)<<ORDINAL_KEY_BITS)-1)
+#define MAX_PRIORITY 10000
 
-		left->files_[right_file->name_] = right_file;
-	}
+static std::pair<std::string, int64_t> parse_rule(const std::string &rule)
+{
+	size_t pos=rule.rfind(':');
+	if (pos==std::string::npos || pos==0 || pos+1==rule.size())
+		err(errFatal) << "Rule " << rule << " is not in PATTERN:NUMBER format";
+	std::string num=rule.substr(pos+1);
+	char *end=0;
+	int64_t val=strtoll(num.c_str(), &end, 10);
+	if (*end)
+		err(errFatal) << "Incorrect number in rule " << rule;
+	return std::make_pair(rule.substr(0, pos), val);
+}
 
-	//Merge directories
-	for(auto iter=right->subdirs_.begin(), iend=right->subdirs_.end();
-		iter!=iend; ++iter)
-	{
-		dir_ptr_t right_dir= iter->second;
+static bool find_rule(const glob_set &patterns,
+					  const std::vector<int64_t> &values,
+					  const std::string &name, int64_t *val)
+{
+	int idx=patterns.find(name);
+	if (idx<0)
+		return false;
+	*val=values.at(idx);
+	return true;
+}
 
-		if (left->files_.count(right_dir->name_))
-		{
-			//Uh-oh.
-			err(errFatal) << "Directory "
-						  << right_dir->absolute_name_
-						  << " is shadowed by "
-						  << left->files_[right_dir->name_]->absolute_name_;
-		}
+void schedule_policy::add_priority(const std::string &rule)
+{
+	std::pair<std::string, int64_t> res=parse_rule(rule);
+	if (res.second>MAX_PRIORITY || res.second<-MAX_PRIORITY)
+		err(errFatal) << "Priority in rule " << rule << " is out of range";
+	priority_patterns_.push_back(res.first);
+	priorities_.push_back(res.second);
+	priority_set_=glob_set(priority_patterns_);
+}
 
-		if (left->subdirs_.count(right_dir->name_))
-		{
-			merge_to_left<dir_ptr_t, file_ptr_t>(
-						left->subdirs_[right_dir->name_], right_dir);
-		} else
-			left->subdirs_[right_dir->name_] = right_dir;
-	}
+void schedule_policy::add_deadline(const std::string &rule)
+{
+	std::pair<std::string, int64_t> res=parse_rule(rule);
+	if (res.second<0)
+		err(errFatal) << "Deadline in rule " << rule << " is negative";
+	deadline_patterns_.push_back(res.first);
+	deadlines_.push_back(res.second);
+	deadline_set_=glob_set(deadline_patterns_);
 }
 
-synchronizer::synchronizer(agenda_ptr agenda, const context_ptr &ctx,
-						   std::vector<s3_path> remote,stringvec local,
-						   bool do_upload, bool delete_missing,
-						   const stringvec &included, const stringvec &excluded)
-	: agenda_(agenda), ctx_(ctx), remote_(remote), local_(local),
-	  do_upload_(do_upload), delete_missing_(delete_missing),
-	  included_(included), excluded_(excluded)
+int64_t schedule_policy::ordinal_for(const std::string &name, uint64_t size)
 {
+	int64_t priority=0;
+	find_rule(priority_set_, priorities_, name, &priority);
+
+	int64_t key=0;
+	switch(order_)
+	{
+	case orderFifo:
+		break;
+	case orderFiles:
+		key=seq_++;
+		break;
+	case orderSmallest:
+		key=size;
+		break;
+	case orderDeadline:
+		//Files without a deadline are done last
+		if (!find_rule(deadline_set_, deadlines_, name, &key))
+			key=MAX_ORDINAL_KEY;
+		break;
+	}
+	if (key>MAX_ORDINAL_KEY || key<0)
+		key=MAX_ORDINAL_KEY;
+
+	return key-priority*(int64_t(1)<<ORDINAL_KEY_BITS);
 }
 
-static bool check_included(const std::string &name, 
-						   const stringvec &included, const stringvec &excluded)
+//Lists only the names in the directory that the included paths can start
+//with, the filter may be empty
+static s3_directory_ptr list_matching(s3_connection &conn, const s3_path &path,
+	s3_directory_ptr target, bool try_to_root, const path_filter_ptr &filter)
 {
-	if (name.find(" ")!=std::string::npos) //Skip filenames with spaces
-		return false;
+	stringvec prefixes;
+	if (!filter || *path.path_.rbegin()!='/' ||
+			!filter->list_prefixes(path.path_, &prefixes))
+		return conn.list_files_shallow(path, target, try_to_root);
 
-	if (!excluded.empty())
+	if (!target)
 	{
-		for(auto f = excluded.begin();f!=excluded.end();++f)
-			if (pattern_match(*f)(name))
-				return false;
+		target.reset(new s3_directory());
+		target->absolute_name_=path;
 	}
-	if (!included.empty())
+	for(auto iter=prefixes.begin();iter!=prefixes.end();++iter)
 	{
-		for(auto f = included.begin();f!=included.end();++f)
-			if (pattern_match(*f)(name))
-				return true;
-		return false;
+		VLOG(2) << "Listing " << path << *iter << "*";
+		conn.list_files_shallow(path, target, false, *iter);
 	}
-	return true;
+	return target;
 }
 
 class list_subdir_task : public sync_task,
@@ -219,9 +258,18 @@ class list_subdir_task : public sync_task,
 {
 	s3_directory_ptr dir_;
 	context_ptr ctx_;
+	path_filter_ptr filter_;
+	s3_directory_ptr snapshot_;
+	time_t fresh_after_;
 public:
-	list_subdir_task(s3_directory_ptr dir, context_ptr ctx) :
-		dir_(dir), ctx_(ctx) {}
+	//Subdirectories where nothing passes the filter are not listed. The
+	//subdirectories of the snapshot listed after fresh_after are reused.
+	list_subdir_task(s3_directory_ptr dir, context_ptr ctx,
+					 path_filter_ptr filter,
+					 s3_directory_ptr snapshot=s3_directory_ptr(),
+					 time_t fresh_after=0) :
+		dir_(dir), ctx_(ctx), filter_(filter), snapshot_(snapshot),
+		fresh_after_(fresh_after) {}
 
 	virtual void print_to(std::ostream &str)
 	{
@@ -233,31 +281,115 @@ public:
 	virtual void operator()(agenda_ptr agenda)
 	{
 		s3_connection conn(ctx_);
-		conn.list_files_shallow(dir_->absolute_name_, dir_, false);
+		list_matching(conn, dir_->absolute_name_, dir_, false, filter_);
+		if (snapshot_)
+			carry_over_metadata(dir_, snapshot_);
+		schedule_subdirs(agenda, dir_, ctx_, filter_, snapshot_, fresh_after_);
+	}
 
-		for(auto iter=dir_->subdirs_.begin();
-			iter!=dir_->subdirs_.end();++iter)
+	static void schedule_subdirs(agenda_ptr agenda, s3_directory_ptr dir,
+								 context_ptr ctx, path_filter_ptr filter,
+								 s3_directory_ptr snapshot=s3_directory_ptr(),
+								 time_t fresh_after=0);
+};
+
+//Schedules the listings of the subdirectories one by one, so that a wide
+//tree doesn't flood the queue with them
+class subdir_fanout_task : public producer_task
+{
+	s3_directory_ptr dir_;
+	context_ptr ctx_;
+	path_filter_ptr filter_;
+	s3_directory_ptr snapshot_;
+	time_t fresh_after_;
+	subdir_map_t::iterator next_;
+public:
+	subdir_fanout_task(s3_directory_ptr dir, context_ptr ctx,
+					   path_filter_ptr filter, s3_directory_ptr snapshot,
+					   time_t fresh_after) :
+		dir_(dir), ctx_(ctx), filter_(filter), snapshot_(snapshot),
+		fresh_after_(fresh_after), next_(dir->subdirs_.begin()) {}
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Read subdirs of " << dir_->absolute_name_;
+	}
+
+	virtual task_type_e get_class() const { return taskUnbound; }
+	virtual task_type_e produced_class() const { return taskUnbound; }
+
+	virtual bool produce_next(agenda_ptr agenda)
+	{
+		if (next_==dir_->subdirs_.end())
+			return false;
+		subdir_map_t::iterator iter=next_++;
+
+		s3_directory_ptr old=snapshot_ ?
+			try_get(snapshot_->subdirs_, iter->first) : s3_directory_ptr();
+		if (filter_ && !filter_->may_match_under(
+				iter->second->absolute_name_.path_))
 		{
-			agenda->schedule(sync_task_ptr(
-								  new list_subdir_task(iter->second, ctx_)));
+			//Keep what we know about the skipped subtree
+			if (old)
+			{
+				old->parent_=dir_;
+				iter->second=old;
+			}
+			return true;
+		}
+
+		if (old && old->listed_at_ && old->listed_at_>=fresh_after_)
+		{
+			//Only the stale parts of a fresh subtree are listed again
+			old->parent_=dir_;
+			iter->second=old;
+			list_subdir_task::schedule_subdirs(agenda, old, ctx_, filter_,
+											   old, fresh_after_);
+			return true;
 		}
+
+		s3_directory_ptr target=iter->second;
+		if (target==old)
+		{
+			//A stale part of the snapshot itself, list it from scratch
+			target.reset(new s3_directory());
+			target->name_=old->name_;
+			target->absolute_name_=old->absolute_name_;
+			target->parent_=dir_;
+			iter->second=target;
+		}
+		agenda->schedule(sync_task_ptr(new list_subdir_task(
+			target, ctx_, filter_, old, fresh_after_)));
+		return true;
 	}
 };
 
+void list_subdir_task::schedule_subdirs(agenda_ptr agenda,
+	s3_directory_ptr dir, context_ptr ctx, path_filter_ptr filter,
+	s3_directory_ptr snapshot, time_t fresh_after)
+{
+	//Runs right here unless the queue is full, then it's parked
+	boost::shared_ptr<subdir_fanout_task> fanout(new subdir_fanout_task(
+		dir, ctx, filter, snapshot, fresh_after));
+	(*fanout)(agenda);
+}
+
 class prepare_remote_list : public sync_task
 {
     context_ptr ctx_;
     bool do_upload_, delete_mode_;
+    path_filter_ptr filter_;
 
     const s3_path remote_;
     std::vector<s3_directory_ptr> &remote_lists_;
     mutex_t &m_;
 public:
     prepare_remote_list(context_ptr ctx, bool do_upload, bool delete_mode,
+                        path_filter_ptr filter,
                         s3_path remote, std::vector<s3_directory_ptr> &remote_lists,
                         mutex_t &m) :
         ctx_(ctx), do_upload_(do_upload), delete_mode_(delete_mode),
-        remote_(remote), remote_lists_(remote_lists),
+        filter_(filter), remote_(remote), remote_lists_(remote_lists),
         m_(m)
     {
     }
@@ -270,15 +402,9 @@ public:
     virtual void operator()(agenda_ptr agenda)
     {
         s3_connection conn(ctx_);
-        s3_directory_ptr cur_root=conn.list_files_shallow(
-                remote_, s3_directory_ptr(), !do_upload_ || delete_mode_);
-
-        for(auto iter=cur_root->subdirs_.begin();
-            iter!=cur_root->subdirs_.end();++iter)
-        {
-            agenda->schedule(sync_task_ptr(
-                                  new list_subdir_task(iter->second, ctx_)));
-        }
+        s3_directory_ptr cur_root=list_matching(conn,
+                remote_, s3_directory_ptr(), !do_upload_ || delete_mode_, filter_);
+        list_subdir_task::schedule_subdirs(agenda, cur_root, ctx_, filter_);
 
         guard_t g(m_);
         remote_lists_.push_back(cur_root);
@@ -293,7 +419,9 @@ bool synchronizer::create_schedule(bool check_mode, bool delete_mode,
 	for(auto iter=local_.begin();iter!=local_.end();++iter)
 	{
 		assert(!delete_mode);
-		local_dir_ptr cur(build_local_dir(*iter, this, do_upload_));
+		//Uploads match the filter against the local names
+		local_dir_ptr cur(build_local_dir(*iter,
+			do_upload_ ? filter_.get() : 0, do_upload_));
 		if (locals)
 			merge_to_left<local_dir_ptr, local_file_ptr>(locals, cur);
 		else
@@ -303,14 +431,32 @@ bool synchronizer::create_schedule(bool check_mode, bool delete_mode,
 	VLOG(1)<<"Preparing S3 file list.";
 	std::vector<s3_directory_ptr> remote_lists;
     mutex_t m;
-    for (int f=0;f<3;++f)
+    if (!inventory_.empty() && !delete_mode)
+    {
+        for(auto iter=remote_.begin();iter!=remote_.end();++iter)
+        {
+            s3_directory_ptr tree=load_inventory(ctx_, agenda_,
+                *iter, inventory_, relist_,
+                do_upload_ ? path_filter_ptr() : filter_);
+            if (!tree)
+            {
+                //Syncing against a part of the remote tree would treat
+                //the rest of it as missing
+                agenda_->print_epilog();
+                err(errFatal) << "Failed to load the inventory of " << *iter;
+            }
+            remote_lists.push_back(tree);
+        }
+    } else for (int f=0;f<3;++f)
     {
         remote_lists.clear();
         for(auto iter=remote_.begin();iter!=remote_.end();++iter)
         {
             agenda_->schedule(sync_task_ptr(
-                                  new prepare_remote_list(ctx_, do_upload_, delete_mode, *iter,
-                                                          remote_lists, m)));
+                                  new prepare_remote_list(ctx_, do_upload_, delete_mode,
+                                                          do_upload_ && !delete_mode ?
+                                                              path_filter_ptr() : filter_,
+                                                          *iter, remote_lists, m)));
         }
         int res=agenda_->run();
         if (!res)
@@ -325,7 +471,11 @@ bool synchronizer::create_schedule(bool check_mode, bool delete_mode,
     }
     VLOG(1)<<"Preparing file list - done.";
 
-	ctx_->reset(); //Reset CURLs	
+	//With a bounded queue the transfers start while the rest of the tree
+	//is walked, the walk waits whenever the queue is full
+	if (agenda_->queue_limit())
+		agenda_->begin_run();
+
 	if (delete_mode)
 	{
 		for(auto iter=remote_lists.begin();iter!=remote_lists.end();++iter)
@@ -345,6 +495,7 @@ bool synchronizer::create_schedule(bool check_mode, bool delete_mode,
 	if (do_upload_)
 	{
 		process_upload(locals, remotes, remotes->absolute_name_, check_mode);
+		flush_small_files();
 		return true;
 	} else
 	{
@@ -361,15 +512,50 @@ void synchronizer::delete_possibly_recursive(s3_directory_ptr dir,
 
 	for(auto iter=dir->files_.begin();iter!=dir->files_.end();++iter)
 	{
-		if (!check_included(iter->second->absolute_name_.path_, 
-							included_, excluded_))
-			continue;		
+		if (!filter_->matches(iter->second->absolute_name_.path_))
+			continue;
 		sync_task_ptr task
 				(new remote_file_deleter(ctx_, iter->second->absolute_name_));
 		agenda_->schedule(task);
 	}
 	for(auto iter=dir->subdirs_.begin();iter!=dir->subdirs_.end();++iter)
-		delete_possibly_recursive(iter->second, false);
+		if (filter_->may_match_under(iter->second->absolute_name_.path_))
+			delete_possibly_recursive(iter->second, false);
+}
+
+void synchronizer::schedule_upload(local_file_ptr file,
+								   const s3_path &remote, bool remote_absent)
+{
+	int64_t ordinal=policy_.ordinal_for(file->absolute_name_.string(),
+										file->size_);
+	if (file->size_>=uint64_t(ctx_->small_file_size_))
+	{
+		sync_task_ptr task(new file_uploader(
+			ctx_, file->absolute_name_, remote));
+		task->set_ordinal(ordinal);
+		agenda_->schedule(task);
+		return;
+	}
+
+	//The batch goes with its most urgent file
+	if (!small_batch_)
+	{
+		small_batch_.reset(new small_file_batch(ctx_));
+		small_batch_ordinal_=ordinal;
+	} else if (ordinal<small_batch_ordinal_)
+		small_batch_ordinal_=ordinal;
+	small_batch_->add(file->absolute_name_, remote, remote_absent);
+	if (small_batch_->size()>=size_t(ctx_->small_file_batch_))
+		flush_small_files();
+}
+
+void synchronizer::flush_small_files()
+{
+	if (!small_batch_)
+		return;
+	small_batch_->set_ordinal(small_batch_ordinal_);
+	agenda_->schedule(small_batch_);
+	small_batch_.reset();
 }
 
 void synchronizer::process_upload(local_dir_ptr locals,
@@ -391,7 +577,7 @@ void synchronizer::process_upload(local_dir_ptr locals,
 		unseen_dirs.erase(file->name_);
 		if (file->unsyncable_) //Skip bad files
 			continue;
-		if (!check_included(file->absolute_name_.string(), included_, excluded_))
+		if (!filter_->matches(file->absolute_name_.string()))
 			continue;
 
 		s3_path cur_remote_path = derive(remote_path, file->name_);
@@ -402,6 +588,8 @@ void synchronizer::process_upload(local_dir_ptr locals,
 				delete_possibly_recursive(remotes->subdirs_[file->name_], false);
 				sync_task_ptr task(new file_uploader(
 					ctx_, file->absolute_name_, cur_remote_path));
+				task->set_ordinal(policy_.ordinal_for(
+					file->absolute_name_.string(), file->size_));
 				agenda_->schedule(task);
 			} else
 			{
@@ -411,12 +599,9 @@ void synchronizer::process_upload(local_dir_ptr locals,
 			}
 		} else
 		{
-			if (!check_mode || !remotes->files_.count(file->name_))
-			{
-				sync_task_ptr task(new file_uploader(
-					ctx_, file->absolute_name_, cur_remote_path));
-				agenda_->schedule(task);
-			}
+			bool remote_absent=!remotes || !remotes->files_.count(file->name_);
+			if (!check_mode || remote_absent)
+				schedule_upload(file, cur_remote_path, remote_absent);
 		}
 	}
 
@@ -425,6 +610,9 @@ void synchronizer::process_upload(local_dir_ptr locals,
 		local_dir_ptr dir = iter->second;
 		unseen.erase(dir->name_);
 		unseen_dirs.erase(dir->name_);
+		//Excluded subtrees were not scanned, leave both sides alone
+		if (!filter_->may_match_under(dir->absolute_name_.string()+"/"))
+			continue;
 		s3_path cur_remote_path = derive(remote_path, dir->name_);
 
 		if (remotes && remotes->files_.count(dir->name_))
@@ -477,7 +665,7 @@ void synchronizer::process_downloads(s3_directory_ptr remotes,
 	{
 		s3_file_ptr file = iter->second;
 		unseen.erase(file->name_);
-		if (!check_included(file->absolute_name_.path_, included_, excluded_))
+		if (!filter_->matches(file->absolute_name_.path_))
 			continue;
 
 		bf::path cur_local_path = local_path / file->name_;
@@ -491,8 +679,13 @@ void synchronizer::process_downloads(s3_directory_ptr remotes,
 		{
 			if (!check_mode || !locals->files_.count(file->name_))
 			{
-				sync_task_ptr task(new file_downloader(
-					ctx_, cur_local_path, file->absolute_name_, shadowed));
+				file_downloader *dl=new file_downloader(
+					ctx_, cur_local_path, file->absolute_name_, shadowed);
+				sync_task_ptr task(dl);
+				if (!locals || !locals->files_.count(file->name_))
+					dl->set_listed_size(file->size_);
+				task->set_ordinal(policy_.ordinal_for(
+					file->absolute_name_.path_, file->size_));
 				agenda_->schedule(task);
 			}
 		}
@@ -502,6 +695,9 @@ void synchronizer::process_downloads(s3_directory_ptr remotes,
 	{
 		s3_directory_ptr dir = iter->second;
 		unseen.erase(dir->name_);
+		//Excluded subtrees were not listed, leave both sides alone
+		if (!filter_->may_match_under(dir->absolute_name_.path_))
+			continue;
 
 		bf::path cur_local_path = local_path / dir->name_;
 
@@ -536,24 +732,75 @@ void synchronizer::process_downloads(s3_directory_ptr remotes,
 	if (delete_missing_)
 	{
 		for(auto iter=unseen.begin();iter!=unseen.end();++iter)
+		{
+			//Names outside of the filter might not have been listed
+			std::string remote_name=derive(remotes->absolute_name_,
+										   iter->first).path_;
+			bool is_dir=locals->subdirs_.count(iter->first);
+			if (is_dir ? !filter_->may_match_under(remote_name+"/") :
+					!filter_->matches(remote_name))
+				continue;
 			agenda_->schedule(sync_task_ptr(
 								  new local_file_deleter(iter->second)));
+		}
 	}
 }
 
 s3_directory_ptr es3::schedule_recursive_walk(const s3_path &remote,
-											  context_ptr ctx, agenda_ptr ag)
+	context_ptr ctx, agenda_ptr ag, path_filter_ptr filter)
 {
-	s3_connection conn(ctx);
-	s3_directory_ptr cur_root=conn.list_files_shallow(remote, 
-													  s3_directory_ptr(), true);
-	for(auto iter=cur_root->subdirs_.begin();
-		iter!=cur_root->subdirs_.end();++iter)
+	s3_directory_ptr snapshot;
+	time_t fresh_after=0;
+	if (ctx->listing_cache_)
 	{
-		ag->schedule(sync_task_ptr(
-							  new list_subdir_task(iter->second, ctx)));
+		snapshot=ctx->listing_cache_->load(remote);
+		fresh_after=ctx->listing_cache_->fresh_after();
+	}
+
+	s3_directory_ptr cur_root;
+	if (snapshot && snapshot->listed_at_ && snapshot->listed_at_>=fresh_after)
+		cur_root=snapshot;
+	else
+	{
+		s3_connection conn(ctx);
+		cur_root=list_matching(conn, remote, s3_directory_ptr(), true, filter);
+		if (snapshot)
+			carry_over_metadata(cur_root, snapshot);
 	}
-	return cur_root;	
+	list_subdir_task::schedule_subdirs(ag, cur_root, ctx, filter,
+									   snapshot, fresh_after);
+	return cur_root;
+}
+
+void es3::schedule_relist(s3_directory_ptr root, const std::string &subdir,
+	context_ptr ctx, agenda_ptr ag, path_filter_ptr filter)
+{
+	s3_directory_ptr dir=root;
+	size_t start=0;
+	while(start<subdir.size())
+	{
+		size_t pos=subdir.find('/', start);
+		std::string name=subdir.substr(start, pos-start);
+		start=pos==std::string::npos ? subdir.size() : pos+1;
+		if (name.empty())
+			continue;
+
+		s3_directory_ptr next=try_get(dir->subdirs_, name);
+		if (!next)
+		{
+			next.reset(new s3_directory());
+			next->name_=name;
+			next->absolute_name_=derive(dir->absolute_name_, name+"/");
+			next->parent_=dir;
+			dir->subdirs_[name]=next;
+		}
+		dir=next;
+	}
+
+	VLOG(1) << "Listing " << dir->absolute_name_ << " again";
+	dir->files_.clear();
+	dir->subdirs_.clear();
+	ag->schedule(sync_task_ptr(new list_subdir_task(dir, ctx, filter)));
 }
 
 class publish_file_task : public sync_task,
@@ -562,13 +809,11 @@ class publish_file_task : public sync_task,
 	s3_file_ptr fl_;
 	context_ptr ctx_;
 	size_t *result_;
-	const stringvec &included_;
-	const stringvec &excluded_;	
+	path_filter_ptr filter_;
 public:
 	publish_file_task(s3_file_ptr fl, context_ptr ctx, size_t *result,
-					  const stringvec &included, const stringvec &excluded) :
-		fl_(fl), ctx_(ctx), result_(result), 
-		included_(included), excluded_(excluded) {}
+					  path_filter_ptr filter) :
+		fl_(fl), ctx_(ctx), result_(result), filter_(filter) {}
 
 	virtual void print_to(std::ostream &str)
 	{
@@ -579,13 +824,12 @@ public:
 
 	virtual void operator()(agenda_ptr agenda)
 	{
-		if (!check_included(fl_->absolute_name_.path_, included_, excluded_))
+		if (!filter_->matches(fl_->absolute_name_.path_))
 			return;
 		
 		s3_connection conn(ctx_);
 		conn.set_acl(fl_->absolute_name_, "public-read");
-		//We don't care about signedness - it's informational data only, anyway
-		boost::detail::atomic_increment((int*)result_);
+		__sync_fetch_and_add(result_, 1);
 	}
 };
 
@@ -595,13 +839,11 @@ class publish_subdir_task : public sync_task,
 	s3_directory_ptr dir_;
 	context_ptr ctx_;
 	size_t *result_;
-	const stringvec &included_;
-	const stringvec &excluded_;
+	path_filter_ptr filter_;
 public:
 	publish_subdir_task(s3_directory_ptr dir, context_ptr ctx, size_t *result,
-						const stringvec &included, const stringvec &excluded) :
-		dir_(dir), ctx_(ctx), result_(result),
-		included_(included), excluded_(excluded) {}
+						path_filter_ptr filter) :
+		dir_(dir), ctx_(ctx), result_(result), filter_(filter) {}
 
 	virtual void print_to(std::ostream &str)
 	{
@@ -613,15 +855,17 @@ public:
 	virtual void operator()(agenda_ptr agenda)
 	{
 		s3_connection conn(ctx_);
-		conn.list_files_shallow(dir_->absolute_name_, dir_, false);
+		list_matching(conn, dir_->absolute_name_, dir_, false, filter_);
 		for(auto iter=dir_->files_.begin(); iter!=dir_->files_.end();++iter)
 			agenda->schedule(sync_task_ptr(
-								  new publish_file_task(iter->second, ctx_, result_, included_, excluded_)));
+								  new publish_file_task(iter->second, ctx_, result_, filter_)));
 		for(auto iter=dir_->subdirs_.begin();
 			iter!=dir_->subdirs_.end();++iter)
 		{
+			if (!filter_->may_match_under(iter->second->absolute_name_.path_))
+				continue;
 			agenda->schedule(sync_task_ptr(
-								  new publish_subdir_task(iter->second, ctx_, result_, included_, excluded_)));
+								  new publish_subdir_task(iter->second, ctx_, result_, filter_)));
 		}
 	}
 };
@@ -630,18 +874,22 @@ void es3::schedule_recursive_publication(const s3_path &remote,
 	context_ptr ctx, agenda_ptr ag, 
 	const stringvec &included, const stringvec &excluded, size_t *num_files)
 {
+	path_filter_ptr filter(new path_filter(included, excluded));
 	s3_connection conn(ctx);
-	s3_directory_ptr cur_root=conn.list_files_shallow(remote, s3_directory_ptr(), true);
+	s3_directory_ptr cur_root=list_matching(conn, remote, s3_directory_ptr(),
+											true, filter);
 	for(auto iter=cur_root->files_.begin(); iter!=cur_root->files_.end();++iter)
 		ag->schedule(sync_task_ptr(new publish_file_task(iter->second, ctx, 
-														 num_files, included, excluded)));
+														 num_files, filter)));
 	
 	for(auto iter=cur_root->subdirs_.begin();
 		iter!=cur_root->subdirs_.end();++iter)
 	{
+		if (!filter->may_match_under(iter->second->absolute_name_.path_))
+			continue;
 		ag->schedule(sync_task_ptr(
 						   new publish_subdir_task(iter->second, ctx, 
-												   num_files, included, excluded)));
+												   num_files, filter)));
 	}
 }
 
@@ -651,13 +899,11 @@ class print_subdir_task : public sync_task,
     s3_path dir_;
     context_ptr ctx_;
     size_t *result_;
-    const stringvec &included_;
-    const stringvec &excluded_;
+    path_filter_ptr filter_;
 public:
     print_subdir_task(const s3_path &dir, context_ptr ctx, size_t *result,
-                        const stringvec &included, const stringvec &excluded) :
-        dir_(dir), ctx_(ctx), result_(result),
-        included_(included), excluded_(excluded) {}
+                      path_filter_ptr filter) :
+        dir_(dir), ctx_(ctx), result_(result), filter_(filter) {}
 
     virtual void print_to(std::ostream &str)
     {
@@ -669,17 +915,21 @@ public:
     virtual void operator()(agenda_ptr agenda)
     {
         s3_connection conn(ctx_);
-        s3_directory_ptr ptr=conn.list_files_shallow(dir_, s3_directory_ptr(), false);
+        s3_directory_ptr ptr=list_matching(conn, dir_, s3_directory_ptr(), false, filter_);
         for(auto iter=ptr->subdirs_.begin();
             iter!=ptr->subdirs_.end();++iter)
         {
+            if (!filter_->may_match_under(iter->second->absolute_name_.path_))
+                continue;
             agenda->schedule(sync_task_ptr(
-                                  new print_subdir_task(iter->second->absolute_name_, ctx_, result_, included_, excluded_)));
+                                  new print_subdir_task(iter->second->absolute_name_, ctx_, result_, filter_)));
         }
 
         for(auto iter=ptr->files_.begin(); iter!=ptr->files_.end();++iter)
         {
             s3_path remote_name = iter->second->absolute_name_;
+            if (!filter_->matches(remote_name.path_))
+                continue;
             file_desc mod=conn.find_mtime_and_size(remote_name);
             guard_t out_guard(get_logger_lock());
             std::cout << mod.mtime_
@@ -695,5 +945,6 @@ void es3::schedule_recursive_list(const s3_path &remote,
     const stringvec &included, const stringvec &excluded, size_t *num_files)
 {
     s3_connection conn(ctx);
-    ag->schedule(sync_task_ptr(new print_subdir_task(remote, ctx, num_files, included, excluded)));
+    path_filter_ptr filter(new path_filter(included, excluded));
+    ag->schedule(sync_task_ptr(new print_subdir_task(remote, ctx, num_files, filter)));
 }
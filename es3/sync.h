@@ -32,6 +32,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <common.h>
 #include "agenda.h"
 #include "connection.h"
+#include "errors.h"
+#include "path_filter.h"
 #include <stdint.h>
 
 namespace es3 {
@@ -39,6 +41,40 @@ namespace es3 {
 	struct local_dir;
 	typedef boost::shared_ptr<local_file> local_file_ptr;
 	typedef boost::shared_ptr<local_dir> local_dir_ptr;
+	class small_file_batch;
+	typedef boost::shared_ptr<small_file_batch> small_file_batch_ptr;
+
+	enum task_order_e
+	{
+		orderFifo, //Everything in the order of discovery
+		orderFiles, //Finish files one by one in the order of discovery
+		orderSmallest, //Smallest files first
+		orderDeadline, //Files with the earliest deadline first
+	};
+
+	/**
+	  Assigns ordinals to the per-file tasks. Files with a higher priority
+	  always go first, the order within one priority is set by the policy.
+	  */
+	class schedule_policy
+	{
+		task_order_e order_;
+		stringvec priority_patterns_, deadline_patterns_;
+		std::vector<int64_t> priorities_, deadlines_;
+		//Rules are recompiled as they are added, there are only a few
+		glob_set priority_set_, deadline_set_;
+		uint64_t seq_;
+	public:
+		schedule_policy() : order_(orderFifo), seq_() {}
+
+		void set_order(task_order_e order) { order_=order; }
+		//Rules are in the "PATTERN:NUMBER" format, the first matching rule
+		//wins. Deadlines are in seconds from the start.
+		void add_priority(const std::string &rule);
+		void add_deadline(const std::string &rule);
+
+		int64_t ordinal_for(const std::string &name, uint64_t size);
+	};
 
 	class synchronizer
 	{
@@ -48,25 +84,104 @@ namespace es3 {
 		stringvec local_;
 		bool do_upload_;
 		bool delete_missing_;
-		stringvec included_, excluded_;
+		path_filter_ptr filter_;
+		small_file_batch_ptr small_batch_;
+		int64_t small_batch_ordinal_;
+		schedule_policy policy_;
+		stringvec inventory_, relist_;
 	public:
 		synchronizer(agenda_ptr agenda, const context_ptr &ctx,
 					 std::vector<s3_path> remote, stringvec local,
 					 bool do_upload, bool delete_missing,
 					 const stringvec &included, const stringvec &excluded);
+		void set_policy(const schedule_policy &policy) { policy_=policy; }
+		//Read the remote tree from the inventory reports instead of
+		//listing it, see inventory.h
+		void set_inventory(const stringvec &sources, const stringvec &relist)
+		{
+			inventory_=sources;
+			relist_=relist;
+		}
 		bool create_schedule(bool check_mode, bool delete_mode, 
 							 bool non_recursive_delete);
 	private:
 		void process_upload(local_dir_ptr locals, s3_directory_ptr remotes,
 							const s3_path &remote_path, bool check_mode);
+		void schedule_upload(local_file_ptr file, const s3_path &remote,
+							 bool remote_absent);
+		void flush_small_files();
 		void process_downloads(s3_directory_ptr remotes, local_dir_ptr locals,
 							   const bf::path &local_path, bool check_mode);
 
 		void delete_possibly_recursive(s3_directory_ptr dir, bool non_recursive);
 	};
 
-	s3_directory_ptr schedule_recursive_walk(const s3_path &remote, 
-											 context_ptr ctx, agenda_ptr ag);
+	/**
+	  Merges the right tree into the left one, failing on name collisions.
+	  */
+	template<class dir_ptr_t, class file_ptr_t>
+		void merge_to_left(dir_ptr_t left, dir_ptr_t right)
+	{
+		//Merge files
+		for(auto iter=right->files_.begin(), iend=right->files_.end();
+			iter!=iend; ++iter)
+		{
+			file_ptr_t right_file = iter->second;
+			if (left->files_.count(right_file->name_))
+			{
+				err(errFatal) << "File name collision: "
+							  << right_file->absolute_name_
+							  << " collides with  "
+							  << left->files_[right_file->name_]->absolute_name_;
+			}
+
+			if (left->subdirs_.count(right_file->name_))
+			{
+				//Uh-oh.
+				err(errFatal) << "File "
+							  << right_file->absolute_name_
+							  << " shadows directory "
+							  << left->subdirs_[right_file->name_]->absolute_name_;
+			}
+
+			left->files_[right_file->name_] = right_file;
+		}
+
+		//Merge directories
+		for(auto iter=right->subdirs_.begin(), iend=right->subdirs_.end();
+			iter!=iend; ++iter)
+		{
+			dir_ptr_t right_dir= iter->second;
+
+			if (left->files_.count(right_dir->name_))
+			{
+				//Uh-oh.
+				err(errFatal) << "Directory "
+							  << right_dir->absolute_name_
+							  << " is shadowed by "
+							  << left->files_[right_dir->name_]->absolute_name_;
+			}
+
+			if (left->subdirs_.count(right_dir->name_))
+			{
+				merge_to_left<dir_ptr_t, file_ptr_t>(
+							left->subdirs_[right_dir->name_], right_dir);
+			} else
+				left->subdirs_[right_dir->name_] = right_dir;
+		}
+	}
+
+	//Reuses the fresh parts of the listing snapshot, if there's one
+	s3_directory_ptr schedule_recursive_walk(const s3_path &remote,
+		context_ptr ctx, agenda_ptr ag,
+		path_filter_ptr filter=path_filter_ptr());
+	/**
+	  Lists the directory under the root of the tree again, replacing
+	  whatever the tree had for it (e.g. from an inventory report).
+	  */
+	void schedule_relist(s3_directory_ptr root, const std::string &subdir,
+		context_ptr ctx, agenda_ptr ag,
+		path_filter_ptr filter=path_filter_ptr());
 	void schedule_recursive_publication(const s3_path &remote, 
 		context_ptr ctx, agenda_ptr ag, 
 		const stringvec &included, const stringvec &excluded, size_t *num);
@@ -0,0 +1,253 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "tracing.h"
+#include "errors.h"
+#include <iomanip>
+#include <fcntl.h>
+
+using namespace es3;
+
+static const char* op_names[traceOpsNum] = {
+	"LIST", "HEAD", "GET", "PUT", "UPLOAD_PART", "COPY_PART",
+	"INITIATE", "COMPLETE", "LIST_PARTS", "DELETE", "OTHER"
+};
+
+static size_t bucket_of(uint64_t val)
+{
+	if (val<HISTOGRAM_SUB_BUCKETS)
+		return val;
+	int power=63-__builtin_clzll(val);
+	if (power>=HISTOGRAM_MAX_POWER)
+		return HISTOGRAM_BUCKETS-1;
+	size_t sub=(val>>(power-HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS-1);
+	return (power-HISTOGRAM_SUB_BITS+1)*HISTOGRAM_SUB_BUCKETS+sub;
+}
+
+static uint64_t bucket_upper(size_t idx)
+{
+	if (idx<HISTOGRAM_SUB_BUCKETS)
+		return idx;
+	int power=idx/HISTOGRAM_SUB_BUCKETS+HISTOGRAM_SUB_BITS-1;
+	uint64_t sub=idx%HISTOGRAM_SUB_BUCKETS;
+	uint64_t width=uint64_t(1)<<(power-HISTOGRAM_SUB_BITS);
+	return ((HISTOGRAM_SUB_BUCKETS+sub)<<(power-HISTOGRAM_SUB_BITS))+width-1;
+}
+
+latency_histogram::latency_histogram() : count_(), sum_(), max_()
+{
+	for(size_t f=0;f<HISTOGRAM_BUCKETS;++f)
+		buckets_[f]=0;
+}
+
+void latency_histogram::record(uint64_t micros)
+{
+	__sync_fetch_and_add(&buckets_[bucket_of(micros)], 1);
+	__sync_fetch_and_add(&count_, 1);
+	__sync_fetch_and_add(&sum_, micros);
+
+	uint64_t cur=max_;
+	while(micros>cur)
+	{
+		uint64_t prev=__sync_val_compare_and_swap(&max_, cur, micros);
+		if (prev==cur)
+			break;
+		cur=prev;
+	}
+}
+
+uint64_t latency_histogram::percentile(double pct) const
+{
+	uint64_t total=count_;
+	if (!total)
+		return 0;
+	uint64_t rank=uint64_t(total*pct/100.0+0.5);
+	if (rank==0)
+		rank=1;
+
+	uint64_t seen=0;
+	for(size_t f=0;f<HISTOGRAM_BUCKETS;++f)
+	{
+		seen+=buckets_[f];
+		if (seen>=rank && f!=HISTOGRAM_BUCKETS-1)
+			return std::min(bucket_upper(f), uint64_t(max_));
+	}
+	return max_;
+}
+
+request_tracer::request_tracer() : trace_file_()
+{
+	for(int f=0;f<traceOpsNum;++f)
+		ops_[f].errors_=ops_[f].throttled_=
+				ops_[f].bytes_up_=ops_[f].bytes_down_=0;
+}
+
+request_tracer::~request_tracer()
+{
+	if (trace_file_)
+		fclose(trace_file_);
+}
+
+void request_tracer::open_trace(const bf::path &file)
+{
+	guard_t lock(trace_m_);
+	if (trace_file_)
+		fclose(trace_file_);
+	int fd=open(file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644)
+			| libc_die2("Can't open trace file "+file.string());
+	trace_file_=fdopen(fd, "w");
+}
+
+static std::string json_escape(const std::string &str)
+{
+	std::string res;
+	for(size_t f=0;f<str.size();++f)
+	{
+		unsigned char c=str[f];
+		if (c=='"' || c=='\\')
+			res.append(1, '\\').append(1, c);
+		else if (c<0x20)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			res.append(buf);
+		} else
+			res.append(1, c);
+	}
+	return res;
+}
+
+void request_tracer::record(const request_timing &t)
+{
+	op_stats &st=ops_[t.op_];
+	st.total_.record(t.total_);
+	st.dns_.record(t.dns_);
+	st.connect_.record(t.connect_);
+	st.tls_.record(t.tls_);
+	st.wait_.record(t.wait_);
+	st.transfer_.record(t.transfer_);
+	__sync_fetch_and_add(&st.bytes_up_, t.bytes_up_);
+	__sync_fetch_and_add(&st.bytes_down_, t.bytes_down_);
+	if (t.curl_code_!=0 || t.status_>=400)
+		__sync_fetch_and_add(&st.errors_, 1);
+	if (t.status_==503)
+		__sync_fetch_and_add(&st.throttled_, 1);
+
+	if (!trace_file_)
+		return;
+	guard_t lock(trace_m_);
+	fprintf(trace_file_, "{\"ts\": %.6f, \"op\": \"%s\", \"path\": \"%s\", "
+			"\"status\": %ld, \"curl_code\": %d, \"dns_us\": %llu, "
+			"\"connect_us\": %llu, \"tls_us\": %llu, \"wait_us\": %llu, "
+			"\"transfer_us\": %llu, \"total_us\": %llu, \"bytes_up\": %llu, "
+			"\"bytes_down\": %llu}\n", t.start_, op_names[t.op_],
+			json_escape(t.path_).c_str(), t.status_, t.curl_code_,
+			(unsigned long long)t.dns_, (unsigned long long)t.connect_,
+			(unsigned long long)t.tls_, (unsigned long long)t.wait_,
+			(unsigned long long)t.transfer_, (unsigned long long)t.total_,
+			(unsigned long long)t.bytes_up_,
+			(unsigned long long)t.bytes_down_);
+}
+
+static std::string ms(uint64_t micros)
+{
+	std::stringstream str;
+	str << std::fixed << std::setprecision(1) << micros/1000.0;
+	return str.str();
+}
+
+void request_tracer::print_summary(std::ostream &str) const
+{
+	bool header=false;
+	for(int f=0;f<traceOpsNum;++f)
+	{
+		const op_stats &st=ops_[f];
+		if (!st.total_.count())
+			continue;
+		if (!header)
+		{
+			str << "request latency [ms, p50/p90/p99/max]:" << std::endl;
+			header=true;
+		}
+
+		str << "  " << op_names[f] << ": " << st.total_.count() << " req";
+		if (st.errors_)
+			str << ", " << st.errors_ << " failed";
+		if (st.throttled_)
+			str << " (" << st.throttled_ << " throttled)";
+		str << ", total " << ms(st.total_.percentile(50)) << "/"
+			<< ms(st.total_.percentile(90)) << "/"
+			<< ms(st.total_.percentile(99)) << "/" << ms(st.total_.max())
+			<< ", dns p99 " << ms(st.dns_.percentile(99))
+			<< ", connect p99 " << ms(st.connect_.percentile(99))
+			<< ", tls p99 " << ms(st.tls_.percentile(99))
+			<< ", wait " << ms(st.wait_.percentile(50)) << "/"
+			<< ms(st.wait_.percentile(99))
+			<< ", transfer " << ms(st.transfer_.percentile(50)) << "/"
+			<< ms(st.transfer_.percentile(99)) << std::endl;
+	}
+}
+
+void request_tracer::write_metrics(std::ostream &str) const
+{
+	str << "# TYPE es3_s3_requests_total counter\n";
+	for(int f=0;f<traceOpsNum;++f)
+		str << "es3_s3_requests_total{op=\"" << op_names[f] << "\"} "
+			<< ops_[f].total_.count() << "\n";
+	str << "# TYPE es3_s3_request_errors_total counter\n";
+	for(int f=0;f<traceOpsNum;++f)
+		str << "es3_s3_request_errors_total{op=\"" << op_names[f] << "\"} "
+			<< ops_[f].errors_ << "\n";
+	str << "# TYPE es3_s3_throttled_total counter\n";
+	for(int f=0;f<traceOpsNum;++f)
+		str << "es3_s3_throttled_total{op=\"" << op_names[f] << "\"} "
+			<< ops_[f].throttled_ << "\n";
+
+	static const double quantiles[]={0.5, 0.9, 0.99};
+	str << "# TYPE es3_s3_request_duration_seconds summary\n";
+	for(int f=0;f<traceOpsNum;++f)
+	{
+		const latency_histogram &hist=ops_[f].total_;
+		if (!hist.count())
+			continue;
+		for(int q=0;q<3;++q)
+			str << "es3_s3_request_duration_seconds{op=\"" << op_names[f]
+				<< "\",quantile=\"" << quantiles[q] << "\"} "
+				<< hist.percentile(quantiles[q]*100)/1000000.0 << "\n";
+		str << "es3_s3_request_duration_seconds_sum{op=\"" << op_names[f]
+			<< "\"} " << hist.sum()/1000000.0 << "\n";
+		str << "es3_s3_request_duration_seconds_count{op=\"" << op_names[f]
+			<< "\"} " << hist.count() << "\n";
+	}
+}
+
+request_tracer& es3::get_tracer()
+{
+	static request_tracer tracer;
+	return tracer;
+}
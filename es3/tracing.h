@@ -0,0 +1,131 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef TRACING_H
+#define TRACING_H
+
+#include "common.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <ostream>
+
+//Each power of two is split into 2^HISTOGRAM_SUB_BITS buckets, so the
+//relative error of a percentile is about 3%
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1<<HISTOGRAM_SUB_BITS)
+//Values up to 2^40 microseconds (~12 days)
+#define HISTOGRAM_MAX_POWER 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_POWER-HISTOGRAM_SUB_BITS+1)*\
+	HISTOGRAM_SUB_BUCKETS)
+
+namespace es3 {
+
+	/**
+	  Log-linear (HDR-style) histogram of microsecond values. Recording
+	  is lock-free, so it's safe to call from any number of threads.
+	  */
+	class latency_histogram
+	{
+		volatile uint64_t buckets_[HISTOGRAM_BUCKETS];
+		volatile uint64_t count_, sum_, max_;
+	public:
+		latency_histogram();
+
+		void record(uint64_t micros);
+
+		uint64_t count() const { return count_; }
+		uint64_t max() const { return max_; }
+		uint64_t sum() const { return sum_; }
+		uint64_t mean() const { return count_ ? sum_/count_ : 0; }
+		//Returns the upper bound of the bucket with the percentile
+		uint64_t percentile(double pct) const;
+	};
+
+	enum trace_op_e
+	{
+		traceList,
+		traceHead,
+		traceGet,
+		tracePut,
+		traceUploadPart,
+		traceCopyPart,
+		traceInitiate,
+		traceComplete,
+		traceListParts,
+		traceDelete,
+		traceOther,
+
+		traceOpsNum
+	};
+
+	struct request_timing
+	{
+		trace_op_e op_;
+		std::string path_;
+		long status_;
+		int curl_code_;
+		double start_; //Seconds since the epoch
+
+		//Durations of the request phases, in microseconds. The wait is
+		//from connecting to the first response byte, so it includes
+		//sending the request body.
+		uint64_t dns_, connect_, tls_, wait_, transfer_, total_;
+		uint64_t bytes_up_, bytes_down_;
+	};
+
+	class request_tracer
+	{
+		struct op_stats
+		{
+			latency_histogram total_, dns_, connect_, tls_, wait_, transfer_;
+			volatile uint64_t errors_, throttled_, bytes_up_, bytes_down_;
+		};
+		op_stats ops_[traceOpsNum];
+
+		mutex_t trace_m_;
+		FILE *trace_file_;
+	public:
+		request_tracer();
+		~request_tracer();
+
+		//Writes every request to the file as a JSON line
+		void open_trace(const bf::path &file);
+
+		void record(const request_timing &timing);
+		void print_summary(std::ostream &str) const;
+		//Prometheus text format
+		void write_metrics(std::ostream &str) const;
+	private:
+		request_tracer(const request_tracer &);
+	};
+
+	ES3LIB_PUBLIC request_tracer& get_tracer();
+
+}; //namespace es3
+
+#endif //TRACING_H
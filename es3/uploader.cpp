@@ -41,7 +41,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <unistd.h>
 #include <boost/bind.hpp>
 #include "compressor.h"
+#include "checksum.h"
+#include "dedup.h"
 #include "mimes.h"
+#include "io_engine.h"
 
 #define MIN_PART_SIZE (16*1024*1024)
 #define MIN_ALLOWED_PART_SIZE (16*1024*1024)
@@ -61,19 +64,94 @@ struct es3::upload_content
 	size_t num_parts_;
 	size_t num_completed_;
     std::vector<std::string> etags_;
+	std::vector<part_digest> digests_;
+	std::vector<uint64_t> part_sizes_;
     header_map_t hmap_;
+	//Content-defined chunks, if the file is uploaded with deduplication
+	std::vector<dedup_chunk> chunks_;
+
+	uint32_t whole_crc32c() const
+	{
+		uint32_t res=0;
+		for(size_t f=0;f<digests_.size();++f)
+			res=crc32c_combine(res, digests_.at(f).crc32c_,
+							   part_sizes_.at(f));
+		return res;
+	}
 };
 
+static void ensure_multipart(upload_content_ptr content)
+{
+	guard_t g(content->lock_);
+	if (!content->upload_id_.empty())
+		return;
+
+	header_map_t init_opts=content->hmap_;
+	if (content->conn_->checksum_==checksumCRC32C)
+		init_opts["x-amz-checksum-algorithm"]="CRC32C";
+	s3_connection up_prep(content->conn_);
+	content->upload_id_=up_prep.initiate_multipart(content->remote_,
+												   init_opts);
+}
+
+static void register_part(upload_content_ptr content, size_t num,
+						  const std::string &etag, const part_digest &digest,
+						  uint64_t size)
+{
+	//Check if the upload is completed. The part might have been sent
+	//already if we're retrying a failed assembly.
+	guard_t g(content->lock_);
+	if (content->etags_.at(num).empty())
+		content->num_completed_++;
+	content->etags_.at(num) = etag;
+	content->digests_.at(num) = digest;
+	content->part_sizes_.at(num) = size;
+
+	VLOG(2) << "Uploaded part " << num << " of "<< content->remote_
+			<< " with etag=" << etag
+			<< ", total=" << content->num_parts_
+			<< ", sent=" << content->num_completed_ << ".";
+
+	if (content->num_completed_ != content->num_parts_)
+		return;
+
+	if (!content->upload_id_.empty())
+	{
+		VLOG(2) << "Assembling "<< content->remote_ <<".";
+		std::vector<std::string> checksums;
+		if (content->conn_->checksum_==checksumCRC32C)
+			for(size_t f=0;f<content->digests_.size();++f)
+				checksums.push_back(
+							content->digests_.at(f).crc32c_base64());
+
+		//We've completed the upload!
+		s3_connection up2(content->conn_);
+		up2.complete_multipart(content->remote_, content->upload_id_,
+							   content->etags_, checksums);
+	}
+	if (!content->chunks_.empty())
+		content->conn_->dedup_->record_object(content->remote_,
+											  content->chunks_);
+	VLOG(2) << "Uploaded " << content->remote_ << ", CRC32C="
+			<< content->whole_crc32c();
+}
+
 class part_upload_task : public sync_task
 {
 	size_t num_;
 	upload_content_ptr content_;
 
 	segment_ptr segment_;
+	part_digest digest_;
+	//Segments that are accounted for the data, but not used directly
+	std::vector<segment_ptr> reserved_;
 public:
 	part_upload_task(size_t num, upload_content_ptr content,
-					 segment_ptr segment)
-		: num_(num), content_(content), segment_(segment)
+					 segment_ptr segment, const part_digest &digest,
+					 const std::vector<segment_ptr> &reserved=
+						std::vector<segment_ptr>())
+		: num_(num), content_(content), segment_(segment), digest_(digest),
+		  reserved_(reserved)
 	{
 	}
 
@@ -83,51 +161,41 @@ public:
 	}
 
 	virtual void operator()(agenda_ptr agenda)
+	{
+		execute(agenda, std::vector<segment_ptr>()) | die;
+	}
+
+	virtual result_code_t execute(agenda_ptr agenda,
+								  const std::vector<segment_ptr> &segments)
 	{
 		VLOG(2) << "Starting upload of a part " << num_ << " of "
 				<< content_->remote_;
 
         bool is_multipart=content_->num_parts_>1;
         if (is_multipart)
-        {
-            guard_t g(content_->lock_);
-            if (content_->upload_id_.empty())
-            {
-                s3_connection up_prep(content_->conn_);
-                content_->upload_id_=up_prep.initiate_multipart(content_->remote_, content_->hmap_);
-            }
-        }
-
-		struct sched_param param;
-		param.sched_priority = 1+num_*90/content_->num_parts_;
-		pthread_setschedparam(pthread_self(), SCHED_RR, &param);
+			ensure_multipart(content_);
+
+		//Single-part objects carry their whole-file checksum
+		header_map_t opts;
+		if (!is_multipart)
+		{
+			opts=content_->hmap_;
+			opts["x-amz-meta-crc32c"]=int_to_string(digest_.crc32c_);
+		}
 
 		s3_path part_path=content_->remote_;
 		s3_connection up(content_->conn_);
-        std::string etag=up.upload_data(part_path, content_->upload_id_, num_+1,
-                &segment_->data_[0], segment_->data_.size(),
-                is_multipart?header_map_t():content_->hmap_);
+		std::string etag;
+		result_code_t res=up.try_upload_data(part_path, content_->upload_id_,
+			num_+1, &segment_->data_[0], segment_->data_.size(), &etag,
+			opts, digest_);
+		if (!res.ok())
+			return res;
 		assert(!etag.empty());
-		agenda->add_stat_counter("uploaded", segment_->data_.size());
-
-		//Check if the upload is completed
-		guard_t g(content_->lock_);
-		content_->num_completed_++;
-		content_->etags_.at(num_) = etag;
+		agenda->add_stat_counter(statUploaded, segment_->data_.size());
 
-		VLOG(2) << "Uploaded part " << num_ << " of "<< content_->remote_
-				<< " with etag=" << etag
-				<< ", total=" << content_->num_parts_
-				<< ", sent=" << content_->num_completed_ << ".";
-
-        if (content_->num_completed_ == content_->num_parts_ && !content_->upload_id_.empty())
-		{
-			VLOG(2) << "Assembling "<< content_->remote_ <<".";
-			//We've completed the upload!
-			s3_connection up2(content_->conn_);
-			up2.complete_multipart(content_->remote_, content_->upload_id_,
-								   content_->etags_);
-		}
+		register_part(content_, num_, etag, digest_, segment_->data_.size());
+		return sok;
 	}
 };
 
@@ -187,33 +255,35 @@ public:
 		{
 			segment_ptr seg = segments.at(f);
 			seg->data_.resize(segment_size, 0);
+			//Hash the data while it's still in cache
+			digest_builder digest;
 
 			uint64_t segment_read_so_far=0;
 			while(segment_read_so_far<seg->data_.size())
 			{
 				//Note that we're duplicating the handle because other
 				//file pumps might be using it
-				handle_t cur_fl(open(
-									files_->files_.at(cur_piece).c_str(), O_RDONLY));
-				lseek64(cur_fl.get(), offset_within_, SEEK_SET) | libc_die;
+				transfer_file cur_fl(files_->files_.at(cur_piece), O_RDONLY,
+									 content_->conn_->direct_io_);
 				uint64_t cur_piece_size=files_->sizes_.at(cur_piece);
 
-				uint64_t remaining_size =
+				//Read the whole piece at once, the I/O engine splits it
+				//into parallel requests
+				size_t remaining_size = safe_cast<size_t>(
 						std::min(segment_size-segment_read_so_far,
-								 cur_piece_size-offset_within_);
-				while(remaining_size>0)
+								 cur_piece_size-offset_within_));
+				if (remaining_size>0)
 				{
-					char buf[65536*8];
-					//No overflow is possible since sizeof(buf)<MAX_SIZE_T.
-					size_t chunk=std::min(remaining_size,
-										  uint64_t(sizeof(buf)));
-					size_t res=read(cur_fl.get(), buf, chunk) | libc_die;
-					assert(res!=0);
-					memcpy(&seg->data_[segment_read_so_far], buf, res);
+					char *dest=&seg->data_[segment_read_so_far];
+					size_t res=cur_fl.read_at(dest, remaining_size,
+											  offset_within_);
+					if (res!=remaining_size)
+						err(errFatal) << "File " << files_->files_.at(cur_piece)
+									  << " was truncated during the upload";
+					digest.update(dest, res);
 
 					segment_read_so_far+=res;
 					offset_within_+=res;
-					remaining_size-=res;
 				}
 
 				//We've run out of file piece, switch to the next one
@@ -237,14 +307,222 @@ public:
 				   || f==number_of_segments_-1);
 
 			if (update_log_)
-				agenda->add_stat_counter("read", seg->data_.size());
+				agenda->add_stat_counter(statRead, seg->data_.size());
 			sync_task_ptr task(new part_upload_task(cur_segment_+f,
-													content_, seg));
+													content_, seg,
+													digest.finish()));
+			agenda->schedule(task);
+		}
+	}
+};
+
+class chunk_reader : public sync_task
+{
+	size_t num_;
+	upload_content_ptr content_;
+	bf::path path_;
+	size_t segments_needed_;
+public:
+	chunk_reader(size_t num, upload_content_ptr content,
+				 const bf::path &path, size_t segment_size)
+		: num_(num), content_(content), path_(path)
+	{
+		uint64_t size=content_->chunks_.at(num_).size_;
+		segments_needed_=size/segment_size + (size%segment_size ? 1 : 0);
+		if (segments_needed_==0)
+			segments_needed_=1;
+	}
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Read chunk " << num_ << " of " << content_->remote_;
+	}
+
+	virtual task_type_e get_class() const { return taskIOBound; }
+
+	virtual size_t needs_segments() const
+	{
+		return segments_needed_;
+	}
+
+	virtual void operator()(agenda_ptr agenda,
+							const std::vector<segment_ptr> &segments)
+	{
+		const dedup_chunk &chunk=content_->chunks_.at(num_);
+		segment_ptr seg=segments.at(0);
+		seg->data_.resize(chunk.size_);
+
+		transfer_file fl(path_, O_RDONLY, content_->conn_->direct_io_);
+		if (fl.read_at(&seg->data_[0], chunk.size_,
+					   chunk.offset_)!=chunk.size_)
+			err(errFatal) << "File " << path_ << " was truncated "
+						  << "during the upload";
+		agenda->add_stat_counter(statRead, chunk.size_);
+
+		std::vector<segment_ptr> reserved(segments.begin()+1,
+										  segments.end());
+		sync_task_ptr task(new part_upload_task(num_, content_, seg,
+												chunk.digest_, reserved));
+		agenda->schedule(task);
+	}
+};
+
+//The errors that tell that the indexed chunk is no longer where the
+//index says it is
+static bool is_source_gone(const result_code_t &code)
+{
+	static const char *codes[]={"NoSuchKey", "InvalidRange",
+								"PreconditionFailed"};
+	std::string desc=code.desc();
+	for(size_t f=0;f<sizeof(codes)/sizeof(codes[0]);++f)
+		if (desc.compare(0, strlen(codes[f]), codes[f])==0)
+			return true;
+	return false;
+}
+
+class part_copy_task : public sync_task
+{
+	size_t num_;
+	upload_content_ptr content_;
+	chunk_location source_;
+	bf::path path_;
+public:
+	part_copy_task(size_t num, upload_content_ptr content,
+				   const chunk_location &source, const bf::path &path)
+		: num_(num), content_(content), source_(source), path_(path)
+	{
+	}
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Copy chunk " << num_ << " of " << content_->remote_
+			<< " from s3://" << source_.bucket_ << source_.path_;
+	}
+
+	virtual void operator()(agenda_ptr agenda)
+	{
+		const dedup_chunk &chunk=content_->chunks_.at(num_);
+		ensure_multipart(content_);
+
+		s3_path src;
+		src.bucket_=source_.bucket_;
+		src.path_=source_.path_;
+
+		std::string etag;
+		bool stale=false;
+		try
+		{
+			s3_connection up(content_->conn_);
+			etag=up.upload_part_copy(content_->remote_, content_->upload_id_,
+									 num_+1, src, source_.offset_,
+									 chunk.size_);
+		} catch(const es3_exception &ex)
+		{
+			//Throttling and server failures are retried by the agenda
+			if (ex.err().code()!=errFatal)
+				throw;
+			stale=is_source_gone(ex.err());
+			VLOG(1) << "Failed to copy chunk " << num_ << " of "
+					<< content_->remote_ << " (" << ex.err().desc()
+					<< "), uploading it instead";
+		}
+
+		//Part ETags are MD5 of their data, so a stale index entry
+		//(the source has been overwritten) can't sneak in
+		std::string expected="\""+chunk.digest_.md5_hex()+"\"";
+		if (strcasecmp(etag.c_str(), expected.c_str())!=0)
+		{
+			if (!etag.empty())
+			{
+				VLOG(1) << "Chunk " << num_ << " of " << content_->remote_
+						<< " has changed in s3://" << source_.bucket_
+						<< source_.path_ << ", uploading it instead";
+				stale=true;
+			}
+			if (stale)
+				content_->conn_->dedup_->forget(chunk.hash_);
+			sync_task_ptr task(new chunk_reader(num_, content_, path_,
+												agenda->segment_size()));
 			agenda->schedule(task);
+			return;
+		}
+
+		agenda->add_stat_counter(statDeduplicated, chunk.size_);
+		register_part(content_, num_, etag, chunk.digest_, chunk.size_);
+	}
+};
+
+class dedup_planner : public sync_task
+{
+	upload_content_ptr content_;
+	bf::path path_;
+public:
+	dedup_planner(upload_content_ptr content, const bf::path &path)
+		: content_(content), path_(path)
+	{
+	}
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Find chunks of " << path_;
+	}
+
+	virtual task_type_e get_class() const { return taskIOBound; }
+
+	virtual void operator()(agenda_ptr agenda)
+	{
+		//A chunk has to fit into the segments that we can get at once
+		uint64_t max_chunk=std::min(uint64_t(MAX_DEDUP_CHUNK),
+			uint64_t(agenda->segment_size())*(agenda->max_in_flight()/2));
+		if (max_chunk<=MIN_DEDUP_CHUNK)
+			max_chunk=MIN_DEDUP_CHUNK+agenda->segment_size();
+
+		std::vector<dedup_chunk> chunks=split_into_chunks(path_, max_chunk);
+		if (chunks.size()>MAX_PART_NUM)
+			err(errFatal) << "File "<<content_->remote_ <<" is too big";
+
+		content_->chunks_=chunks;
+		content_->num_parts_=chunks.size();
+		content_->etags_.resize(chunks.size());
+		content_->digests_.resize(chunks.size());
+		content_->part_sizes_.resize(chunks.size());
+
+		dedup_index_ptr index=content_->conn_->dedup_;
+		for(size_t f=0;f<chunks.size();++f)
+		{
+			chunk_location loc;
+			//Server-side copies are possible only for multipart uploads
+			if (chunks.size()>1 && index->find(chunks.at(f).hash_, &loc)
+					&& loc.size_==chunks.at(f).size_)
+			{
+				sync_task_ptr task(new part_copy_task(f, content_, loc,
+													  path_));
+				agenda->schedule(task);
+			} else
+			{
+				sync_task_ptr task(new chunk_reader(f, content_, path_,
+													agenda->segment_size()));
+				agenda->schedule(task);
+			}
 		}
 	}
 };
 
+static header_map_t file_metadata(const bf::path &path, time_t mtime,
+								  uint64_t size, mode_t mode, bool compressed)
+{
+	header_map_t hmap;
+	hmap["x-amz-meta-compressed"] = compressed ? "true" : "false";
+	//hmap["Content-Type"] = "application/x-binary";
+	hmap["Content-Type"] = find_mime(path.extension().c_str());
+	if (compressed)
+		hmap["Content-Encoding"] = "gzip";
+	hmap["x-amz-meta-last-modified"] = int_to_string(mtime);
+	hmap["x-amz-meta-size"] = int_to_string(size);
+	hmap["x-amz-meta-file-mode"] = int_to_string(mode);
+	return hmap;
+}
+
 void file_uploader::operator()(agenda_ptr agenda)
 {
 	uint64_t file_sz=file_size(path_);
@@ -277,18 +555,13 @@ void file_uploader::operator()(agenda_ptr agenda)
 	bool do_compress = should_compress(path_, file_sz) &&
 			conn_->do_compression_;
 	//Prepare upload
-	header_map_t hmap;
-	hmap["x-amz-meta-compressed"] = do_compress ? "true" : "false";
-	//hmap["Content-Type"] = "application/x-binary";
-	hmap["Content-Type"] = find_mime(path_.extension().c_str());
-	if (do_compress)
-		hmap["Content-Encoding"] = "gzip";
-	hmap["x-amz-meta-last-modified"] = int_to_string(mtime);
-	hmap["x-amz-meta-size"] = int_to_string(file_sz);
-	hmap["x-amz-meta-file-mode"] = int_to_string(mode);	
-    up_data->hmap_=hmap;
+	up_data->hmap_=file_metadata(path_, mtime, file_sz, mode, do_compress);
 
-	if (do_compress)
+	if (conn_->dedup_ && !do_compress && file_sz>=2*MIN_DEDUP_CHUNK)
+	{
+		sync_task_ptr task(new dedup_planner(up_data, path_));
+		agenda->schedule(task);
+	} else if (do_compress)
 	{
 		files_finished_callback on_finish=boost::bind(
 					&file_uploader::start_upload, shared_from_this(),
@@ -326,6 +599,8 @@ void file_uploader::start_upload(agenda_ptr ag,
 
 	content->num_parts_ = number_of_segments;
 	content->etags_.resize(number_of_segments);
+	content->digests_.resize(number_of_segments);
+	content->part_sizes_.resize(number_of_segments);
 
 	//Now create file pumps
 	size_t num_per_pump = number_of_segments /
@@ -346,6 +621,64 @@ void file_uploader::start_upload(agenda_ptr ag,
 	}
 }
 
+void small_file_batch::operator()(agenda_ptr agenda)
+{
+	s3_connection up(conn_);
+	up.keep_connection();
+	std::vector<char> slab(conn_->small_file_size_+1);
+
+	const size_t first=next_;
+	for(;next_<entries_.size();++next_)
+	{
+		if (next_!=first)
+			reset_attempts();
+		const entry &cur=entries_.at(next_);
+
+		struct stat stbuf={0};
+		if (::stat(cur.path_.c_str(), &stbuf)!=0)
+		{
+			VLOG(1) << "File " << cur.path_ << " has disappeared, skipping";
+			continue;
+		}
+		uint64_t file_sz=stbuf.st_size;
+		if (file_sz>=slab.size())
+		{
+			//The file has grown since we've listed it
+			sync_task_ptr task(new file_uploader(conn_, cur.path_,
+												 cur.remote_));
+			agenda->schedule(task);
+			continue;
+		}
+
+		if (!cur.remote_absent_)
+		{
+			file_desc mod=up.find_mtime_and_size(cur.remote_);
+			if (mod.mtime_==stbuf.st_mtime && mod.raw_size_==file_sz)
+				continue;
+		}
+
+		handle_t fl(open(cur.path_.c_str(), O_RDONLY)
+					| libc_die2("Failed to open "+cur.path_.string()));
+		//Ask for one byte more to notice files that are being appended to
+		size_t read_so_far=get_io_engine().read_at(fl.get(), &slab[0],
+												   file_sz+1, 0);
+		if (read_so_far>file_sz)
+			err(errWarn) << "File " << cur.path_ << " is growing";
+		agenda->add_stat_counter(statRead, read_so_far);
+
+		VLOG(2) << "Starting upload of " << cur.path_ << " as "
+				<< cur.remote_;
+		part_digest digest=compute_digest(&slab[0], read_so_far);
+		header_map_t opts=file_metadata(cur.path_, stbuf.st_mtime,
+										read_so_far, stbuf.st_mode & 0777,
+										false);
+		opts["x-amz-meta-crc32c"]=int_to_string(digest.crc32c_);
+		up.upload_data(cur.remote_, "", 0, &slab[0], read_so_far,
+					   opts, digest);
+		agenda->add_stat_counter(statUploaded, read_so_far);
+	}
+}
+
 void remote_file_deleter::operator()(agenda_ptr agenda)
 {
 	VLOG(2) << "Removing " << remote_;
@@ -33,6 +33,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "common.h"
 #include "agenda.h"
 
+//Files this small are never compressed (see should_compress)
+#define MAX_SMALL_FILE_SIZE (1024*1024)
+
 namespace es3 {
 	struct upload_content;
 	typedef boost::shared_ptr<upload_content> upload_content_ptr;
@@ -68,6 +71,49 @@ namespace es3 {
 		void simple_upload(agenda_ptr ag, upload_content_ptr content);
 	};
 
+	/**
+	  Uploads a batch of small files one after another using a single
+	  kept-alive connection and a shared buffer, without going through
+	  the segment machinery.
+	  */
+	class small_file_batch : public sync_task
+	{
+		struct entry
+		{
+			bf::path path_;
+			s3_path remote_;
+			//The remote file is not in the listing, so there's no need
+			//to check its modification time
+			bool remote_absent_;
+		};
+
+		const context_ptr conn_;
+		std::vector<entry> entries_;
+		//Files before this one are already uploaded, so a retry
+		//doesn't need to redo them
+		size_t next_;
+	public:
+		small_file_batch(const context_ptr &conn) : conn_(conn), next_()
+		{
+		}
+
+		void add(const bf::path &path, const s3_path &remote,
+				 bool remote_absent)
+		{
+			entry e={path, remote, remote_absent};
+			entries_.push_back(e);
+		}
+		size_t size() const { return entries_.size(); }
+
+		virtual void operator()(agenda_ptr agenda);
+		virtual void print_to(std::ostream &str)
+		{
+			str << "Upload " << entries_.size() << " small files, starting with "
+				<< entries_.at(0).path_;
+		}
+	};
+	typedef boost::shared_ptr<small_file_batch> small_file_batch_ptr;
+
 	class remote_file_deleter : public sync_task
 	{
 		const context_ptr conn_;
@@ -0,0 +1,300 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "xml_stream.h"
+#include <stdlib.h>
+#include <ctype.h>
+
+using namespace es3;
+
+uint64_t xml_text::to_uint64() const
+{
+	uint64_t res=0;
+	for(size_t f=0;f<size_ && data_[f]>='0' && data_[f]<='9';++f)
+		res=res*10+(data_[f]-'0');
+	return res;
+}
+
+static bool is_space(char c)
+{
+	return c==' ' || c=='\t' || c=='\r' || c=='\n';
+}
+
+//Keeps the last few characters of a markup construct to find its end
+static bool ends_with(std::string *window, char c, const char *terminator)
+{
+	size_t term_len=strlen(terminator);
+	if (window->size()>=term_len)
+		window->erase(0, window->size()-term_len+1);
+	window->push_back(c);
+	return *window==terminator;
+}
+
+static void append_utf8(std::string *str, unsigned long cp)
+{
+	if (cp<0x80)
+		str->push_back(char(cp));
+	else if (cp<0x800)
+	{
+		str->push_back(char(0xC0 | (cp>>6)));
+		str->push_back(char(0x80 | (cp & 0x3F)));
+	} else if (cp<0x10000)
+	{
+		str->push_back(char(0xE0 | (cp>>12)));
+		str->push_back(char(0x80 | ((cp>>6) & 0x3F)));
+		str->push_back(char(0x80 | (cp & 0x3F)));
+	} else
+	{
+		str->push_back(char(0xF0 | (cp>>18)));
+		str->push_back(char(0x80 | ((cp>>12) & 0x3F)));
+		str->push_back(char(0x80 | ((cp>>6) & 0x3F)));
+		str->push_back(char(0x80 | (cp & 0x3F)));
+	}
+}
+
+xml_stream_parser::xml_stream_parser(xml_handler *handler)
+	: handler_(handler), state_(stText), quote_(), seen_root_()
+{
+}
+
+void xml_stream_parser::fail(const std::string &why)
+{
+	if (state_==stFailed)
+		return;
+	state_=stFailed;
+	error_=why;
+}
+
+void xml_stream_parser::feed(const char *data, size_t len)
+{
+	const char *cur=data, *end=data+len;
+	while(cur<end && state_!=stFailed)
+	{
+		if (state_==stText)
+		{
+			//Bulk-copy the character data up to the next markup
+			const char *start=cur;
+			while(cur<end && *cur!='<' && *cur!='&')
+				++cur;
+			//Whitespace around the root element is not interesting
+			if (!marks_.empty())
+				text_.append(start, cur);
+			if (cur==end)
+				break;
+			if (*cur=='&')
+			{
+				entity_.clear();
+				state_=stEntity;
+			} else
+				state_=stTagStart;
+			++cur;
+			continue;
+		}
+
+		char c=*cur++;
+		switch(state_)
+		{
+		case stEntity:
+			if (c==';')
+			{
+				decode_entity();
+				if (state_!=stFailed)
+					state_=stText;
+			} else if (entity_.size()>10)
+				fail("Entity is too long");
+			else
+				entity_.push_back(c);
+			break;
+		case stTagStart:
+			if (c=='/')
+			{
+				name_.clear();
+				state_=stCloseName;
+			} else if (c=='!' || c=='?')
+			{
+				markup_.clear();
+				markup_.push_back(c);
+				state_= c=='?' ? stInstruction : stMarkup;
+			} else if (is_space(c) || c=='>')
+				fail("Element name expected");
+			else if (seen_root_ && marks_.empty())
+				fail("Multiple root elements");
+			else
+			{
+				marks_.push_back(path_.size());
+				if (marks_.size()>1)
+					path_.push_back('/');
+				path_.push_back(c);
+				state_=stOpenName;
+			}
+			break;
+		case stOpenName:
+			if (is_space(c) || c=='>' || c=='/')
+			{
+				open_element();
+				state_= c=='>' ? stText : (c=='/' ? stEmptyTag : stAttributes);
+			} else
+				path_.push_back(c);
+			break;
+		case stAttributes:
+			if (c=='"' || c=='\'')
+			{
+				quote_=c;
+				state_=stAttrValue;
+			} else if (c=='>')
+				state_=stText;
+			else if (c=='/')
+				state_=stEmptyTag;
+			break;
+		case stAttrValue:
+			if (c==quote_)
+				state_=stAttributes;
+			break;
+		case stEmptyTag:
+			if (c!='>')
+				fail("Malformed empty element");
+			else
+			{
+				close_element();
+				state_=stText;
+			}
+			break;
+		case stCloseName:
+			if (c=='>')
+			{
+				size_t start=marks_.empty() ? 0 :
+					marks_.back()+(marks_.size()>1 ? 1 : 0);
+				if (marks_.empty() || path_.compare(start,
+						std::string::npos, name_)!=0)
+					fail("Mismatched closing tag: "+name_);
+				else
+				{
+					close_element();
+					state_=stText;
+				}
+			} else if (!is_space(c))
+				name_.push_back(c);
+			break;
+		case stMarkup:
+			if (markup_.size()<9)
+				markup_.push_back(c);
+			if (markup_=="!--")
+			{
+				markup_.clear();
+				state_=stComment;
+			} else if (markup_=="![CDATA[")
+			{
+				markup_.clear();
+				state_=stCData;
+			} else if (c=='>') //DOCTYPE and friends
+				state_=stText;
+			break;
+		case stComment:
+			if (ends_with(&markup_, c, "-->"))
+				state_=stText;
+			break;
+		case stCData:
+			text_.push_back(c);
+			if (ends_with(&markup_, c, "]]>"))
+			{
+				text_.resize(text_.size()-3);
+				state_=stText;
+			}
+			break;
+		case stInstruction:
+			if (ends_with(&markup_, c, "?>"))
+				state_=stText;
+			break;
+		default:
+			assert(false);
+		}
+	}
+}
+
+bool xml_stream_parser::finish()
+{
+	if (state_==stFailed)
+		return false;
+	if (state_!=stText || !marks_.empty() || !seen_root_)
+	{
+		fail("Document is incomplete");
+		return false;
+	}
+	return true;
+}
+
+void xml_stream_parser::open_element()
+{
+	seen_root_=true;
+	text_.clear();
+	handler_->on_open(xml_text(path_));
+}
+
+void xml_stream_parser::close_element()
+{
+	handler_->on_close(xml_text(path_), xml_text(text_));
+	text_.clear();
+	path_.resize(marks_.back());
+	marks_.pop_back();
+}
+
+void xml_stream_parser::decode_entity()
+{
+	if (entity_=="lt")
+		text_.push_back('<');
+	else if (entity_=="gt")
+		text_.push_back('>');
+	else if (entity_=="amp")
+		text_.push_back('&');
+	else if (entity_=="quot")
+		text_.push_back('"');
+	else if (entity_=="apos")
+		text_.push_back('\'');
+	else if (entity_.size()>1 && entity_[0]=='#')
+	{
+		bool hex=entity_[1]=='x';
+		const char *digits=entity_.c_str()+(hex ? 2 : 1);
+		char *num_end=0;
+		unsigned long cp=strtoul(digits, &num_end, hex ? 16 : 10);
+		//strtoul also takes an empty string, spaces and signs
+		unsigned char first=*digits;
+		if (!(hex ? isxdigit(first) : isdigit(first)) || *num_end ||
+				cp==0 || cp>0x10FFFF)
+			fail("Bad character reference: "+entity_);
+		else
+			append_utf8(&text_, cp);
+	} else
+		fail("Unknown entity: "+entity_);
+}
+
+bool es3::parse_xml(const std::string &doc, xml_handler *handler)
+{
+	xml_stream_parser parser(handler);
+	parser.feed(doc);
+	return parser.finish();
+}
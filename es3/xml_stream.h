@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2013, Illumina Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions 
+are met:
+. Redistributions of source code must retain the above copyright 
+notice, this list of conditions and the following disclaimer.
+. Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the 
+documentation and/or other materials provided with the distribution.
+. Neither the name of the Illumina, Inc. nor the names of its 
+contributors may be used to endorse or promote products derived from 
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef XML_STREAM_H
+#define XML_STREAM_H
+
+#include "common.h"
+#include <string.h>
+
+namespace es3 {
+	/**
+	  A view of a piece of text owned by somebody else. Views passed to
+	  xml_handler callbacks are only valid during the call.
+	  */
+	struct xml_text
+	{
+		const char *data_;
+		size_t size_;
+
+		xml_text() : data_(""), size_() {}
+		xml_text(const char *data, size_t size) : data_(data), size_(size) {}
+		explicit xml_text(const std::string &str)
+			: data_(str.data()), size_(str.size()) {}
+
+		bool empty() const { return size_==0; }
+		std::string str() const { return std::string(data_, size_); }
+		void assign_to(std::string *str) const { str->assign(data_, size_); }
+
+		template<size_t N> bool operator == (const char (&lit)[N]) const
+		{
+			return size_==N-1 && memcmp(data_, lit, N-1)==0;
+		}
+		template<size_t N> bool operator != (const char (&lit)[N]) const
+		{
+			return !(*this==lit);
+		}
+		bool operator == (const std::string &str) const
+		{
+			return size_==str.size() && memcmp(data_, str.data(), size_)==0;
+		}
+
+		//Parses a non-negative decimal number, stops at the first non-digit
+		ES3LIB_PUBLIC uint64_t to_uint64() const;
+	};
+
+	/**
+	  Receives the elements of a document. Paths are the slash-separated
+	  element names from the root, e.g. "ListBucketResult/Contents/Key".
+	  Attributes are not reported.
+	  */
+	class xml_handler
+	{
+	public:
+		virtual ~xml_handler() {}
+		virtual void on_open(const xml_text &path) {}
+		//The text is the character data of the element with entities
+		//decoded. It's only meaningful for leaf elements.
+		virtual void on_close(const xml_text &path, const xml_text &text) {}
+	};
+
+	/**
+	  Incremental XML parser. The document can be fed in arbitrary pieces
+	  (e.g. straight from a curl write callback) and the handler is called
+	  as soon as elements are complete, so the document is never held in
+	  memory. The buffers are reused, so steady-state parsing doesn't
+	  allocate.
+
+	  It handles the subset of XML that S3 produces: no DTDs and no
+	  namespace processing.
+	  */
+	class xml_stream_parser
+	{
+		enum state_e
+		{
+			stText,
+			stEntity,
+			stTagStart, //Just after '<'
+			stOpenName,
+			stCloseName,
+			stAttributes,
+			stAttrValue,
+			stEmptyTag, //After '/' in an opening tag
+			stMarkup, //"<!" or "<?" constructs
+			stCData,
+			stComment,
+			stInstruction,
+			stFailed,
+		};
+
+		xml_handler *handler_;
+		state_e state_;
+		//Path of the current element and the offsets where each of its
+		//components starts
+		std::string path_;
+		std::vector<size_t> marks_;
+		std::string text_, name_, entity_, markup_;
+		char quote_;
+		bool seen_root_;
+		std::string error_;
+	public:
+		ES3LIB_PUBLIC xml_stream_parser(xml_handler *handler);
+
+		ES3LIB_PUBLIC void feed(const char *data, size_t len);
+		void feed(const std::string &str) { feed(str.data(), str.size()); }
+
+		//Returns false if the document is malformed or incomplete
+		ES3LIB_PUBLIC bool finish();
+
+		//Stops the parsing, e.g. if the handler has failed
+		ES3LIB_PUBLIC void fail(const std::string &why);
+		bool failed() const { return state_==stFailed; }
+		const std::string& error() const { return error_; }
+	private:
+		void open_element();
+		void close_element();
+		void decode_entity();
+	};
+
+	/**
+	  Parses the whole document, returns false if it's malformed.
+	  */
+	ES3LIB_PUBLIC bool parse_xml(const std::string &doc, xml_handler *handler);
+
+}; //namespace es3
+
+#endif //XML_STREAM_H